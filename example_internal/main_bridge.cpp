@@ -0,0 +1,62 @@
+#include <moteusapi/LoopRunner.h>
+#include <moteusapi/UdpBridge.h>
+
+#include <cstring>
+
+// bridge server [topology.cfg] [port] [address]    on the robot computer
+// bridge client host [topology.cfg] [port]    on the operator station
+int main(int argc, char** argv) {
+  const bool server = argc > 1 && strcmp(argv[1], "server") == 0;
+  if (!server && !(argc > 2 && strcmp(argv[1], "client") == 0)) {
+    cout << "usage: bridge server [topology] [port] [address]" << endl
+         << "       bridge client host [topology] [port]" << endl;
+    return 1;
+  }
+  const int first = server ? 2 : 3;
+  string topology_path(argc > first ? argv[first] : "topology.cfg");
+  const int port = argc > first + 1 ? atoi(argv[first + 1]) : 9870;
+
+  if (server) {
+    // the control loop only copies frames, the bridge threads do the rest
+    MoteusGroup group(topology_path);
+    // loopback unless told otherwise, "::" listens everywhere
+    const string address(argc > first + 2 ? argv[first + 2] : "127.0.0.1");
+    BridgeServer bridge(group, address, port);
+    LoopRunner runner(group.topology().rate_hz);
+    runner.Run([&](int64_t tick) {
+      bridge.Apply();
+      group.Cycle();
+      bridge.Publish();
+      return true;
+    });
+    return 0;
+  }
+
+  // commands are encoded with the same topology the robot uses
+  const Topology topology = LoadTopology(topology_path);
+  const auto& servo = topology.servos[0];
+  const FrameLayout layout = MakePositionLayout(servo.command, servo.query);
+  mjbots::moteus::PositionCommand cmd;
+  cmd.position = 0;
+  cmd.velocity = 0;
+  cmd.maximum_torque = 1;
+  vector<BridgeRecord> records(1);
+  EncodePositionCommand(layout, cmd, &records[0].frame);
+
+  BridgeClient client(argv[2], port);
+  BridgePacket packet;
+  for (int ii = 0; ii < 1000; ii++) {
+    client.SendCommands(records);
+    if (!client.ReceiveState(&packet, 10000)) continue;
+    for (const auto& record : packet.records) {
+      const auto result = mjbots::moteus::ParseQueryResult(
+          record.frame.data, record.frame.size);
+      if (ii % 100 == 0) {
+        cout << topology.servos[record.servo].name
+             << " position: " << result.position << endl;
+      }
+    }
+  }
+  cout << "lost: " << client.lost() << endl;
+  return 0;
+}
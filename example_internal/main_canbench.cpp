@@ -0,0 +1,56 @@
+#include <moteusapi/Clock.h>
+#include <moteusapi/SocketCan.h>
+
+#include <cstdlib>
+#include <iostream>
+
+// canbench [interface] [servos] [cycles]
+//
+// Times bus cycles on a virtual CAN interface, with a second socket
+// answering every frame, once with batched and once with per-frame
+// system calls:
+//   sudo ip link add dev vcan0 type vcan
+//   sudo ip link set vcan0 mtu 72 up
+double Benchmark(SocketCan& host, SocketCan& servos, size_t count,
+                 int cycles) {
+  vector<BusFrame> commands(count), replies(count);
+  for (size_t ii = 0; ii < count; ii++) {
+    commands[ii].arbitration_id = BusFrame::kReplyRequested | (ii + 1);
+    commands[ii].frame.size = 16;
+    replies[ii].arbitration_id = (ii + 1) << 8;
+    replies[ii].frame.size = 24;
+  }
+  vector<BusFrame> rx(count);
+  size_t received = 0;
+
+  const int64_t start_ns = NowNs();
+  for (int cycle = 0; cycle < cycles; cycle++) {
+    if (!host.Send(commands.data(), count, 10000) ||
+        !servos.Receive(0, count, rx.data(), count, &received, 10000) ||
+        !servos.Send(replies.data(), count, 10000) ||
+        !host.Receive(count, count, rx.data(), count, &received, 10000)) {
+      cout << "cycle " << cycle << " lost frames" << endl;
+    }
+  }
+  return (NowNs() - start_ns) / 1e3 / cycles;
+}
+
+int main(int argc, char** argv) {
+  const string interface(argc > 1 ? argv[1] : "vcan0");
+  const size_t count = argc > 2 ? atoi(argv[2]) : 12;
+  const int cycles = argc > 3 ? atoi(argv[3]) : 10000;
+
+  // opened directly, the registry would hand out the same socket twice
+  SocketCan host(interface);
+  SocketCan servos(interface);
+
+  const double batched_us = Benchmark(host, servos, count, cycles);
+  host.SetBatching(false);
+  servos.SetBatching(false);
+  const double single_us = Benchmark(host, servos, count, cycles);
+
+  cout << count << " servos, " << cycles << " cycles" << endl
+       << "sendmmsg/recvmmsg: " << batched_us << " us per cycle" << endl
+       << "write/read:        " << single_us << " us per cycle" << endl;
+  return 0;
+}
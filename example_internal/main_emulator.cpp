@@ -0,0 +1,30 @@
+#include <moteusapi/FdcanusbEmulator.h>
+
+#include <chrono>
+#include <csignal>
+#include <thread>
+
+namespace {
+volatile sig_atomic_t done = 0;
+}
+
+// emulator [link] [capture]
+//
+// Serves an emulated fdcanusb at |link| until interrupted, with the
+// latency fitted from |capture| if given. Record a capture of the real
+// adapter with "capture = <file>" in its topology section.
+int main(int argc, char** argv) {
+  const string link(argc > 1 ? argv[1] : "/tmp/fdcanusb");
+  LatencyModel model;
+  if (argc > 2) {
+    model = FitLatencyModel(argv[2]);
+    PrintLatencyModel(cout, model);
+  }
+
+  FdcanusbEmulator emulator(link, model);
+  signal(SIGINT, [](int) { done = 1; });
+  cout << "emulating an fdcanusb at " << link << endl;
+  while (!done) this_thread::sleep_for(chrono::milliseconds(100));
+  cout << emulator.frames() << " frames" << endl;
+  return 0;
+}
@@ -0,0 +1,38 @@
+#include <moteusapi/MoteusGroup.h>
+
+int main(int argc, char** argv) {
+  // all device names and ids live in the topology file
+  string topology_path(argc > 1 ? argv[1] : "topology.cfg");
+  MoteusGroup group(topology_path);
+
+  // hold every servo at zero, the commands are clamped to the limits in
+  // the topology file
+  mjbots::moteus::PositionCommand cmd;
+  cmd.position = 0;
+  cmd.velocity = 0;
+  cmd.maximum_torque = 1;
+  for (size_t ii = 0; ii < group.size(); ii++) {
+    group.SetPositionCommand(ii, cmd);
+  }
+
+  for (int ii = 0; ii < 1000; ii++) {
+    group.Cycle();
+    std::this_thread::sleep_for(1ms);
+  }
+
+  // stop everything and print the last positions, slower servos only
+  // get a frame every few cycles so keep cycling for a while
+  for (size_t ii = 0; ii < group.size(); ii++) {
+    group.SetStopCommand(ii);
+  }
+  for (int ii = 0; ii < 100; ii++) {
+    group.Cycle();
+    std::this_thread::sleep_for(1ms);
+  }
+  for (size_t ii = 0; ii < group.size(); ii++) {
+    cout << group.config(ii).name << " position: " << group.state(ii).position
+         << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,23 @@
+#include <moteusapi/AdapterPlanner.h>
+
+#include <cstdlib>
+
+// plan [topology.cfg] [cycle_us per adapter...]
+// prints the current assignment and the proposed one
+int main(int argc, char** argv) {
+  string topology_path(argc > 1 ? argv[1] : "topology.cfg");
+  const Topology topology = LoadTopology(topology_path);
+
+  vector<AdapterLatency> latencies;
+  for (int ii = 2; ii < argc; ii++) {
+    AdapterLatency latency;
+    latency.cycle_us = atof(argv[ii]);
+    latencies.push_back(latency);
+  }
+
+  cout << "current:" << endl;
+  PrintPlan(cout, topology, EvaluateAdapters(topology, latencies));
+  cout << endl << "proposed:" << endl;
+  PrintPlan(cout, topology, PlanAdapters(topology, latencies));
+  return 0;
+}
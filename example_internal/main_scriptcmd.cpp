@@ -0,0 +1,20 @@
+#include <moteusapi/ScriptExecutor.h>
+
+int main(int argc, char** argv) {
+  string topology_path(argc > 1 ? argv[1] : "topology.cfg");
+  string script_path(argc > 2 ? argv[2] : "testmotortorque.csv");
+  string log_path(argc > 3 ? argv[3] : "testmotortorque_log.csv");
+
+  MoteusGroup group(topology_path);
+  CommandScript script = LoadCommandScript(script_path, group.topology());
+
+  // play the script at the bus rate and keep recording for one more second
+  ScriptExecutor executor(group, script);
+  executor.Run(1.0);
+  executor.SaveLog(log_path);
+
+  cout << executor.records().size() << " replies recorded, "
+       << executor.overruns() << " overruns, " << executor.timeouts()
+       << " timeouts" << endl;
+  return 0;
+}
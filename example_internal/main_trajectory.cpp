@@ -0,0 +1,39 @@
+#include <moteusapi/LoopRunner.h>
+#include <moteusapi/TrajectoryStreamer.h>
+
+int main(int argc, char** argv) {
+  string topology_path(argc > 1 ? argv[1] : "topology.cfg");
+  MoteusGroup group(topology_path);
+  const double rate_hz = group.topology().rate_hz;
+
+  // write a 10 second sine for the first servo, real trajectories would
+  // come from a recording or an offline optimizer
+  {
+    TrajectoryWriter writer("sine.traj", rate_hz);
+    for (int ii = 0; ii < 10 * rate_hz; ii++) {
+      const double t = ii / rate_hz;
+      TrajectorySample sample;
+      sample.position = 0.1 * std::sin(2 * M_PI * 0.5 * t);
+      sample.velocity = 0.1 * M_PI * std::cos(2 * M_PI * 0.5 * t);
+      writer.Append(sample);
+    }
+  }
+
+  // stream it from disk, only the read-ahead window is kept in memory
+  mjbots::moteus::PositionCommand base;
+  base.maximum_torque = 1;
+  TrajectoryStreamer streamer(group);
+  streamer.Add(0, "sine.traj", base);
+
+  LoopRunner runner(rate_hz);
+  runner.Run([&](int64_t tick) {
+    const bool active = streamer.Feed(tick / rate_hz);
+    group.Cycle();
+    return active;
+  });
+
+  group.SetStopCommand(0);
+  group.Cycle();
+  cout << "overruns: " << runner.overruns() << endl;
+  return 0;
+}
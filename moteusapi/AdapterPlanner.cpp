@@ -0,0 +1,292 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "AdapterPlanner.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+
+#include "FrameLayout.h"
+
+using namespace mjbots::moteus;
+
+namespace {
+
+int64_t Gcd(int64_t a, int64_t b) { return b == 0 ? a : Gcd(b, a % b); }
+
+int ValueSize(Resolution res) {
+  switch (res) {
+    case Resolution::kInt8:
+      return 1;
+    case Resolution::kInt16:
+      return 2;
+    case Resolution::kIgnore:
+      return 0;
+    default:
+      return 4;
+  }
+}
+
+class Planner {
+ public:
+  Planner(const Topology& topology, const vector<AdapterLatency>& latencies)
+      : topology_(topology), latencies_(latencies) {
+    if (latencies_.empty()) latencies_.resize(topology.adapters.size());
+    if (latencies_.size() != topology.adapters.size()) {
+      throw std::runtime_error("AdapterPlanner: one latency per adapter");
+    }
+    for (const auto& servo : topology.servos) {
+      loads_.push_back(ComputeServoLoad(topology, servo));
+    }
+  }
+
+  size_t servos() const { return loads_.size(); }
+  size_t adapters() const { return latencies_.size(); }
+
+  // average bus time of a servo, to order the greedy placement
+  double Average(size_t servo) const {
+    return FrameUs(latencies_[0], servo) / loads_[servo].divisor;
+  }
+
+  // Worst case cycle of |adapter|, with the phases MoteusGroup would
+  // give its servos.
+  //
+  // The servos of one divisor d add up to a load per cycle modulo d.
+  // Those loads are combined one divisor at a time into the load per
+  // cycle modulo m. Later divisors only see the cycle modulo the g
+  // dividing both m and their common multiple, so each combination is
+  // first reduced to the worst load per cycle modulo g. This is exact,
+  // and it stays as small as the divisors share factors, instead of
+  // growing with their common multiple.
+  double CycleUs(size_t adapter, const vector<int>& assignment) const {
+    const AdapterLatency& latency = latencies_[adapter];
+    map<int, vector<double>> loads;
+    map<int, int> count;
+    for (size_t ii = 0; ii < assignment.size(); ii++) {
+      if (assignment[ii] != static_cast<int>(adapter)) continue;
+      const int divisor = loads_[ii].divisor;
+      auto& load = loads[divisor];
+      load.resize(divisor);
+      load[count[divisor]++ % divisor] += FrameUs(latency, ii);
+    }
+
+    vector<int64_t> divisors;
+    for (const auto& entry : loads) divisors.push_back(entry.first);
+    // the worst load of the divisors so far per cycle modulo |modulus|
+    int64_t modulus = 1;
+    vector<double> worst(1, 0);
+    for (size_t ii = 0; ii < divisors.size(); ii++) {
+      const int64_t divisor = divisors[ii];
+      const vector<double>& load = loads[divisor];
+      const int64_t combined = modulus / Gcd(modulus, divisor) * divisor;
+      int64_t shared = 1;
+      for (size_t jj = ii + 1; jj < divisors.size(); jj++) {
+        const int64_t common = Gcd(combined, divisors[jj]);
+        shared = shared / Gcd(shared, common) * common;
+      }
+      vector<double> next(shared, 0);
+      for (int64_t cycle = 0; cycle < combined; cycle++) {
+        double& entry = next[cycle % shared];
+        entry = max(entry, worst[cycle % modulus] + load[cycle % divisor]);
+      }
+      worst.swap(next);
+      modulus = shared;
+    }
+    return latency.cycle_us + worst[0];
+  }
+
+  bool Allowed(size_t servo, size_t adapter,
+               const vector<int>& assignment) const {
+    for (size_t ii = 0; ii < assignment.size(); ii++) {
+      if (ii != servo && assignment[ii] == static_cast<int>(adapter) &&
+          topology_.servos[ii].id == topology_.servos[servo].id) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  AdapterPlan Evaluate(const vector<int>& assignment) const {
+    AdapterPlan plan;
+    plan.adapter = assignment;
+    for (size_t ii = 0; ii < adapters(); ii++) {
+      plan.cycle_us.push_back(CycleUs(ii, assignment));
+      plan.worst_us = max(plan.worst_us, plan.cycle_us.back());
+    }
+    return plan;
+  }
+
+ private:
+  double FrameUs(const AdapterLatency& latency, size_t servo) const {
+    const auto& load = loads_[servo];
+    const int frames = load.reply_bytes > 0 ? 2 : 1;
+    return frames * latency.frame_us +
+           (load.command_bytes + load.reply_bytes) * latency.byte_us;
+  }
+
+  const Topology& topology_;
+  vector<AdapterLatency> latencies_;
+  vector<ServoLoad> loads_;
+};
+
+// the plan's cycle times, largest first, to compare plans whose worst
+// adapter is the same
+bool Better(const AdapterPlan& lhs, const AdapterPlan& rhs) {
+  vector<double> a = lhs.cycle_us, b = rhs.cycle_us;
+  sort(a.rbegin(), a.rend());
+  sort(b.rbegin(), b.rend());
+  for (size_t ii = 0; ii < a.size(); ii++) {
+    // ignore differences below a nanosecond
+    if (a[ii] < b[ii] - 1e-3) return true;
+    if (a[ii] > b[ii] + 1e-3) return false;
+  }
+  return false;
+}
+
+}  // namespace
+
+ServoLoad ComputeServoLoad(const Topology& topology, const ServoConfig& servo) {
+  ServoLoad load;
+  load.divisor = CommandDivisor(topology, servo);
+  load.command_bytes =
+      max(MakePositionLayout(servo.command, servo.query).frame.size,
+          MakeWithinLayout(servo.within, servo.query).frame.size);
+
+  if (servo.query.any_set()) {
+    // the reply repeats the query with the values after each register
+    CanFrame reply;
+    WriteCanFrame writer(&reply);
+    EmitQueryCommand(&writer, servo.query);
+    const QueryCommand& q = servo.query;
+    for (const auto res :
+         {q.mode, q.position, q.velocity, q.torque, q.q_current, q.d_current,
+          q.rezero_state, q.voltage, q.temperature, q.fault}) {
+      reply.size += ValueSize(res);
+    }
+    PadFrame(&reply);
+    load.reply_bytes = reply.size;
+  }
+  return load;
+}
+
+AdapterPlan PlanAdapters(const Topology& topology,
+                         const vector<AdapterLatency>& latencies) {
+  const Planner planner(topology, latencies);
+  const size_t adapters = planner.adapters();
+  if (adapters == 0) throw std::runtime_error("AdapterPlanner: no adapters");
+
+  vector<size_t> order(planner.servos());
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    return planner.Average(lhs) > planner.Average(rhs);
+  });
+
+  vector<int> assignment(planner.servos(), -1);
+  for (const auto servo : order) {
+    int best = -1;
+    double best_us = 0;
+    for (size_t adapter = 0; adapter < adapters; adapter++) {
+      if (!planner.Allowed(servo, adapter, assignment)) continue;
+      assignment[servo] = adapter;
+      const double us = planner.CycleUs(adapter, assignment);
+      // ties go to the first adapter, up to rounding
+      if (best < 0 || us < best_us - 1e-3) {
+        best = adapter;
+        best_us = us;
+      }
+    }
+    if (best < 0) {
+      throw std::runtime_error("AdapterPlanner: too many servos with id " +
+                               to_string(topology.servos[servo].id));
+    }
+    assignment[servo] = best;
+  }
+
+  AdapterPlan plan = planner.Evaluate(assignment);
+  bool improved = true;
+  while (improved) {
+    improved = false;
+    for (size_t servo = 0; servo < assignment.size(); servo++) {
+      // move the servo elsewhere
+      for (size_t adapter = 0; adapter < adapters; adapter++) {
+        vector<int> candidate = plan.adapter;
+        candidate[servo] = adapter;
+        if (plan.adapter[servo] == static_cast<int>(adapter) ||
+            !planner.Allowed(servo, adapter, candidate)) {
+          continue;
+        }
+        AdapterPlan next = planner.Evaluate(candidate);
+        if (Better(next, plan)) {
+          plan = next;
+          improved = true;
+        }
+      }
+      // or swap it with a servo on another adapter
+      for (size_t other = servo + 1; other < assignment.size(); other++) {
+        if (plan.adapter[other] == plan.adapter[servo]) continue;
+        vector<int> candidate = plan.adapter;
+        swap(candidate[servo], candidate[other]);
+        if (!planner.Allowed(servo, candidate[servo], candidate) ||
+            !planner.Allowed(other, candidate[other], candidate)) {
+          continue;
+        }
+        AdapterPlan next = planner.Evaluate(candidate);
+        if (Better(next, plan)) {
+          plan = next;
+          improved = true;
+        }
+      }
+    }
+  }
+  return plan;
+}
+
+AdapterPlan EvaluateAdapters(const Topology& topology,
+                             const vector<AdapterLatency>& latencies) {
+  vector<int> assignment;
+  for (const auto& servo : topology.servos) {
+    assignment.push_back(servo.adapter);
+  }
+  return Planner(topology, latencies).Evaluate(assignment);
+}
+
+Topology ApplyPlan(const Topology& topology, const AdapterPlan& plan) {
+  Topology result = topology;
+  for (size_t ii = 0; ii < result.servos.size(); ii++) {
+    result.servos[ii].adapter = plan.adapter.at(ii);
+  }
+  ValidateTopology(result);
+  return result;
+}
+
+void PrintPlan(ostream& os, const Topology& topology, const AdapterPlan& plan) {
+  os << fixed << setprecision(1);
+  for (size_t adapter = 0; adapter < topology.adapters.size(); adapter++) {
+    os << "[adapter " << topology.adapters[adapter].name << "]  worst cycle "
+       << plan.cycle_us[adapter] << " us\n";
+    for (size_t ii = 0; ii < topology.servos.size(); ii++) {
+      if (plan.adapter[ii] != static_cast<int>(adapter)) continue;
+      const auto load = ComputeServoLoad(topology, topology.servos[ii]);
+      os << "  " << topology.servos[ii].name << "  id "
+         << topology.servos[ii].id << ", " << load.command_bytes << "+"
+         << load.reply_bytes << " bytes every " << load.divisor
+         << " cycles\n";
+    }
+  }
+  os << "worst cycle " << plan.worst_us << " us, "
+     << 1e6 / plan.worst_us << " Hz at most\n";
+}
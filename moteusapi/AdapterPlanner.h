@@ -0,0 +1,79 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSADAPTERPLANNER_H__
+#define MOTEUSADAPTERPLANNER_H__
+
+#include <iostream>
+#include <vector>
+
+#include "Topology.h"
+
+using namespace std;
+
+// Time one adapter needs per bus cycle, in microseconds. The defaults
+// are a CAN-FD bus at 1 Mbit/s arbitration and 5 Mbit/s data rate
+// behind a USB full speed round trip; replace them with measurements,
+// e.g. from the reply timestamps of a MoteusGroup.
+struct AdapterLatency {
+  // fixed cost of a cycle, host to adapter and back
+  double cycle_us = 250;
+  // per frame on the bus, arbitration and framing
+  double frame_us = 36;
+  // per payload byte in the data phase
+  double byte_us = 1.6;
+};
+
+// What one servo costs on a bus, from the encoders of its topology.
+struct ServoLoad {
+  // command and reply sizes after padding
+  int command_bytes = 0;
+  int reply_bytes = 0;
+  // frames are sent every |divisor| bus cycles
+  int divisor = 1;
+};
+
+ServoLoad ComputeServoLoad(const Topology& topology, const ServoConfig& servo);
+
+struct AdapterPlan {
+  // adapter index per servo
+  vector<int> adapter;
+  // worst case time of a cycle per adapter
+  vector<double> cycle_us;
+  // the largest of them
+  double worst_us = 0;
+};
+
+// Proposes which adapter each servo of |topology| goes on, so that the
+// slowest cycle of any adapter is as short as possible. |latencies|
+// holds one entry per adapter, or none for the defaults. Servos sharing
+// an id are kept on different adapters. Throws std::runtime_error if
+// that is impossible.
+//
+// Servos are placed largest first on the adapter where they raise the
+// worst case the least, then single moves and pairwise swaps are tried
+// until none improves the plan.
+AdapterPlan PlanAdapters(const Topology& topology,
+                         const vector<AdapterLatency>& latencies = {});
+
+// Worst case cycle times of the assignment already in |topology|.
+AdapterPlan EvaluateAdapters(const Topology& topology,
+                             const vector<AdapterLatency>& latencies = {});
+
+// |topology| with the servos moved to the adapters of |plan|.
+Topology ApplyPlan(const Topology& topology, const AdapterPlan& plan);
+
+void PrintPlan(ostream& os, const Topology& topology, const AdapterPlan& plan);
+
+#endif  // MOTEUSADAPTERPLANNER_H__
@@ -0,0 +1,72 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "AdaptiveRate.h"
+
+#include <stdexcept>
+
+AdaptiveRate::AdaptiveRate(MoteusGroup& group,
+                           const AdaptiveRateConfig& config)
+    : group_(group),
+      config_(config),
+      settle_ns_(llround(config.settle_s * 1e9)),
+      servos_(group.size()) {
+  if (!(settle_ns_ > 0) || config_.max_slowdown < 1) {
+    throw std::runtime_error("AdaptiveRate: invalid configuration");
+  }
+}
+
+void AdaptiveRate::Update() {
+  for (size_t ii = 0; ii < servos_.size(); ii++) {
+    auto& servo = servos_[ii];
+    // a new command woke the servo up
+    if (group_.slowdown(ii) < servo.slowdown) {
+      servo.slowdown = 1;
+      servo.still_since_ns = 0;
+    }
+    if (!group_.replied(ii)) continue;
+
+    const StateView view = group_.view(ii);
+    const double torque = view.torque();
+    const int64_t now_ns = group_.reply_time_ns(ii);
+    const bool still =
+        std::abs(view.velocity()) < config_.velocity_threshold &&
+        (servo.still_since_ns == 0 ||
+         std::abs(torque - servo.settled_torque) <
+             config_.torque_threshold);
+    if (!still) {
+      servo.still_since_ns = 0;
+      if (servo.slowdown > 1) {
+        servo.slowdown = 1;
+        group_.SetSlowdown(ii, 1);
+      }
+      continue;
+    }
+    if (servo.still_since_ns == 0) {
+      servo.still_since_ns = now_ns;
+      servo.settled_torque = torque;
+      continue;
+    }
+
+    // double the slowdown for every settle period spent still
+    int64_t periods = (now_ns - servo.still_since_ns) / settle_ns_;
+    int slowdown = 1;
+    while (periods-- > 0 && slowdown < config_.max_slowdown) slowdown *= 2;
+    slowdown = std::min(slowdown, config_.max_slowdown);
+    if (slowdown != servo.slowdown) {
+      group_.SetSlowdown(ii, slowdown);
+      servo.slowdown = group_.slowdown(ii);
+    }
+  }
+}
@@ -0,0 +1,64 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSADAPTIVERATE_H__
+#define MOTEUSADAPTIVERATE_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "MoteusGroup.h"
+
+using namespace std;
+
+struct AdaptiveRateConfig {
+  // a servo is still while |velocity| stays below this, rev/s
+  double velocity_threshold = 0.01;
+  // and its torque within this of where it settled, Nm
+  double torque_threshold = 0.05;
+  // the slowdown doubles after every period of this length spent still
+  double settle_s = 0.2;
+  // the largest slowdown applied, MoteusGroup::SetSlowdown() lowers it
+  // further where the servo's watchdog needs more frames
+  int max_slowdown = 16;
+};
+
+// Lowers the frame rate of servos holding still through
+// MoteusGroup::SetSlowdown(). Every settle_s of stillness doubles the
+// slowdown; movement in a reply brings the servo back to its full rate
+// at once, as does any new command (done by the group itself).
+class AdaptiveRate {
+ public:
+  explicit AdaptiveRate(MoteusGroup& group,
+                        const AdaptiveRateConfig& config =
+                            AdaptiveRateConfig());
+
+  // Call after each Cycle().
+  void Update();
+
+ private:
+  struct Servo {
+    // NowNs() of the reply that started the still period, 0 if moving
+    int64_t still_since_ns = 0;
+    double settled_torque = 0;
+    int slowdown = 1;
+  };
+
+  MoteusGroup& group_;
+  const AdaptiveRateConfig config_;
+  const int64_t settle_ns_;
+  vector<Servo> servos_;
+};
+
+#endif  // MOTEUSADAPTIVERATE_H__
@@ -0,0 +1,134 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ChangeNotifier.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include "MoteusGroup.h"
+
+namespace {
+
+bool Moved(double reference, double value, double deadband) {
+  const bool was_nan = std::isnan(reference);
+  if (was_nan || std::isnan(value)) return was_nan != std::isnan(value);
+  const double delta = std::abs(value - reference);
+  return deadband > 0 ? delta > deadband : delta != 0;
+}
+
+}  // namespace
+
+ChangeQueue::ChangeQueue(size_t capacity) : capacity_(capacity) {
+  if (capacity_ == 0) throw std::runtime_error("ChangeQueue: no capacity");
+}
+
+void ChangeQueue::Push(const ChangeEvent& event) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (events_.size() == capacity_) {
+      events_.pop_front();
+      dropped_++;
+    }
+    events_.push_back(event);
+  }
+  ready_.notify_one();
+}
+
+bool ChangeQueue::Pop(ChangeEvent* event, int timeout_us) {
+  unique_lock<mutex> lock(mutex_);
+  if (!ready_.wait_for(lock, std::chrono::microseconds(timeout_us),
+                       [this]() { return !events_.empty(); })) {
+    return false;
+  }
+  *event = events_.front();
+  events_.pop_front();
+  return true;
+}
+
+uint64_t ChangeQueue::dropped() const {
+  lock_guard<mutex> lock(mutex_);
+  return dropped_;
+}
+
+ChangeNotifier::ChangeNotifier(size_t servos) : by_servo_(servos) {}
+
+int ChangeNotifier::Subscribe(size_t servo, TelemetryField field,
+                              double deadband, Callback callback) {
+  if (servo >= by_servo_.size()) {
+    throw std::runtime_error("ChangeNotifier: no servo " + to_string(servo));
+  }
+  if (!(deadband >= 0) || field == TelemetryField::kCount) {
+    throw std::runtime_error("ChangeNotifier: invalid subscription");
+  }
+  Subscription subscription;
+  subscription.servo = servo;
+  subscription.field = field;
+  subscription.deadband = deadband;
+  subscription.callback = std::move(callback);
+  subscription.active = true;
+  subscriptions_.push_back(std::move(subscription));
+
+  const int id = static_cast<int>(subscriptions_.size() - 1);
+  by_servo_[servo].push_back(id);
+  return id;
+}
+
+int ChangeNotifier::Subscribe(size_t servo, TelemetryField field,
+                              double deadband, ChangeQueue* queue) {
+  return Subscribe(servo, field, deadband,
+                   [queue](const ChangeEvent& event) { queue->Push(event); });
+}
+
+void ChangeNotifier::Unsubscribe(int id) {
+  auto& subscription = subscriptions_.at(id);
+  if (!subscription.active) return;
+  subscription.active = false;
+  subscription.callback = nullptr;
+  auto& ids = by_servo_[subscription.servo];
+  ids.erase(std::find(ids.begin(), ids.end(), id));
+}
+
+void ChangeNotifier::Update(size_t servo, int64_t timestamp_ns,
+                            const State& state) {
+  for (const int id : by_servo_[servo]) {
+    auto& subscription = subscriptions_[id];
+    const double value = FieldValue(state, subscription.field);
+    if (subscription.reported &&
+        !Moved(subscription.reference, value, subscription.deadband)) {
+      continue;
+    }
+
+    ChangeEvent event;
+    event.servo = servo;
+    event.field = subscription.field;
+    event.previous = subscription.reference;
+    event.value = value;
+    event.timestamp_ns = timestamp_ns;
+    // measured from the last event, so slow drifts are reported too
+    subscription.reference = value;
+    subscription.reported = true;
+    subscription.callback(event);
+  }
+}
+
+void ChangeNotifier::Update(const MoteusGroup& group) {
+  const size_t servos = std::min(group.size(), by_servo_.size());
+  for (size_t ii = 0; ii < servos; ii++) {
+    if (group.replied(ii)) {
+      Update(ii, group.reply_time_ns(ii), group.decoded(ii));
+    }
+  }
+}
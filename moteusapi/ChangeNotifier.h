@@ -0,0 +1,105 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSCHANGENOTIFIER_H__
+#define MOTEUSCHANGENOTIFIER_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "MoteusAPI.h"
+#include "TelemetryStore.h"
+
+using namespace std;
+
+class MoteusGroup;
+
+struct ChangeEvent {
+  size_t servo = 0;
+  TelemetryField field = TelemetryField::kPosition;
+  // value of the previous event, NAN before the first one
+  double previous = NAN;
+  double value = NAN;
+  // NowNs() of the reply carrying |value|
+  int64_t timestamp_ns = 0;
+};
+
+// A bounded queue of events for consumers on other threads. When full,
+// the oldest event is dropped.
+class ChangeQueue {
+ public:
+  explicit ChangeQueue(size_t capacity = 1024);
+
+  void Push(const ChangeEvent& event);
+  // Waits up to |timeout_us| for an event.
+  bool Pop(ChangeEvent* event, int timeout_us);
+
+  uint64_t dropped() const;
+
+ private:
+  const size_t capacity_;
+  mutable mutex mutex_;
+  condition_variable ready_;
+  deque<ChangeEvent> events_;
+  uint64_t dropped_ = 0;
+};
+
+// Turns the stream of servo states into events for the values that
+// moved by more than a deadband since the last event. A deadband of 0
+// reports every change, e.g. of the mode or the fault code. The first
+// value of each subscription is reported as well.
+//
+// Update() runs the callbacks on its caller's thread, normally the one
+// driving the bus, so they should be short; a ChangeQueue hands the
+// events to another thread instead. Subscriptions must be changed from
+// the same thread, and not from within a callback.
+class ChangeNotifier {
+ public:
+  typedef function<void(const ChangeEvent&)> Callback;
+
+  explicit ChangeNotifier(size_t servos);
+
+  // Returns the subscription id.
+  int Subscribe(size_t servo, TelemetryField field, double deadband,
+                Callback callback);
+  // |queue| must outlive the subscription.
+  int Subscribe(size_t servo, TelemetryField field, double deadband,
+                ChangeQueue* queue);
+  void Unsubscribe(int subscription);
+
+  void Update(size_t servo, int64_t timestamp_ns, const State& state);
+  // Checks every servo that replied in the group's last cycle.
+  void Update(const MoteusGroup& group);
+
+ private:
+  struct Subscription {
+    size_t servo = 0;
+    TelemetryField field = TelemetryField::kPosition;
+    double deadband = 0;
+    Callback callback;
+    bool active = false;
+    bool reported = false;
+    double reference = NAN;
+  };
+
+  vector<Subscription> subscriptions_;
+  // subscription ids per servo
+  vector<vector<int>> by_servo_;
+};
+
+#endif  // MOTEUSCHANGENOTIFIER_H__
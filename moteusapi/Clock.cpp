@@ -0,0 +1,229 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Clock.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+#if defined(__x86_64__)
+
+// the first calibration busy waits this long
+const int64_t kCalibrateNs = 2000000;
+// and the scale is refined from the first sample this often
+const int64_t kRefineNs = 100000000;
+
+bool TscReliable() {
+  const char* clock = getenv("MOTEUS_CLOCK");
+  if (clock != nullptr && strcmp(clock, "steady") == 0) return false;
+
+  // invariant TSC: constant rate in every power state
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+    return false;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  if (!(edx & (1u << 8))) return false;
+
+#ifdef __linux__
+  // the kernel falls back from the TSC when it finds it unsynchronized
+  // between cores
+  ifstream in("/sys/devices/system/clocksource/clocksource0/"
+              "current_clocksource");
+  string source;
+  if (in >> source && source != "tsc") return false;
+#endif
+  return true;
+}
+
+// A TSC reading and the steady clock at the same moment, the steady
+// clock read between two TSC readings. Of a few tries the one read
+// fastest is kept, the others may have been interrupted.
+void Sample(uint64_t* tsc, int64_t* ns) {
+  uint64_t best = ~0ull;
+  *tsc = 0;
+  *ns = 0;
+  for (int ii = 0; ii < 5; ii++) {
+    const uint64_t before = __rdtsc();
+    const int64_t steady = SteadyNs();
+    const uint64_t after = __rdtsc();
+    if (after - before < best) {
+      best = after - before;
+      *tsc = before + (after - before) / 2;
+      *ns = steady;
+    }
+  }
+}
+
+class TscClock {
+ public:
+  TscClock() : enabled_(TscReliable()) {
+    if (!enabled_) return;
+    Sample(&first_tsc_, &first_ns_);
+    uint64_t tsc;
+    int64_t ns;
+    do {
+      Sample(&tsc, &ns);
+    } while (ns - first_ns_ < kCalibrateNs);
+    const double ns_per_tick = (ns - first_ns_) / double(tsc - first_tsc_);
+    if (!(ns_per_tick > 0)) {
+      enabled_ = false;
+      return;
+    }
+    base_tsc_.store(tsc, memory_order_relaxed);
+    base_ns_.store(ns, memory_order_relaxed);
+    ns_per_tick_.store(ns_per_tick, memory_order_relaxed);
+    refine_ticks_ = llround(kRefineNs / ns_per_tick);
+    inverse_refine_ticks_ = 1.0 / refine_ticks_;
+    sequence_.store(0, memory_order_release);
+  }
+
+  bool enabled() const { return enabled_; }
+
+  int64_t Now() {
+    int64_t now;
+    // the first reading after a pause refines the scale before using it
+    while (!Read(&now)) Refine();
+
+    // what a slew could not make up in time is stepped, never back for
+    // the same thread; a shared latest time would cost an atomic write
+    // per reading
+    thread_local int64_t last = 0;
+    last = max(last, now);
+    return last;
+  }
+
+ private:
+  bool Read(int64_t* now) const {
+    const uint64_t tsc = __rdtsc();
+    uint64_t base_tsc;
+    int64_t base_ns;
+    double ns_per_tick;
+    double offset_ns;
+    while (true) {
+      const uint32_t before = sequence_.load(memory_order_acquire);
+      base_tsc = base_tsc_.load(memory_order_relaxed);
+      base_ns = base_ns_.load(memory_order_relaxed);
+      ns_per_tick = ns_per_tick_.load(memory_order_relaxed);
+      offset_ns = offset_ns_.load(memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+      if (!(before & 1) &&
+          sequence_.load(memory_order_relaxed) == before) {
+        break;
+      }
+    }
+
+    // another thread may have read the TSC first and refined already
+    const int64_t delta = static_cast<int64_t>(tsc - base_tsc);
+    *now = Extrapolate(delta, base_ns, ns_per_tick, offset_ns);
+    return delta <= refine_ticks_;
+  }
+
+  // The steady time |delta| ticks after the base sample, plus the offset
+  // the clock had from it then, which fades out until the next refine.
+  int64_t Extrapolate(int64_t delta, int64_t base_ns, double ns_per_tick,
+                      double offset_ns) const {
+    const double fade = max(0.0, 1.0 - delta * inverse_refine_ticks_);
+    return base_ns + llround(delta * ns_per_tick + offset_ns * fade);
+  }
+
+  // Scales with the whole time since the first sample, so the error of
+  // a single sample fades, and bases the clock on the new sample. What
+  // the clock was off by then, ahead or behind, is slewed out over the
+  // next refine interval rather than stepped, at most half of it so that
+  // the clock keeps running forward.
+  void Refine() {
+    if (refining_.test_and_set(memory_order_acquire)) return;
+    uint64_t tsc;
+    int64_t ns;
+    Sample(&tsc, &ns);
+
+    // the only writer, no sequence needed
+    const uint64_t base_tsc = base_tsc_.load(memory_order_relaxed);
+    const int64_t extrapolated =
+        Extrapolate(static_cast<int64_t>(tsc - base_tsc),
+                    base_ns_.load(memory_order_relaxed),
+                    ns_per_tick_.load(memory_order_relaxed),
+                    offset_ns_.load(memory_order_relaxed));
+
+    const uint32_t sequence = sequence_.load(memory_order_relaxed);
+    sequence_.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    base_tsc_.store(tsc, memory_order_relaxed);
+    base_ns_.store(ns, memory_order_relaxed);
+    ns_per_tick_.store((ns - first_ns_) / double(tsc - first_tsc_),
+                       memory_order_relaxed);
+    offset_ns_.store(max<int64_t>(-kRefineNs / 2,
+                                  min<int64_t>(kRefineNs / 2,
+                                               extrapolated - ns)),
+                     memory_order_relaxed);
+    sequence_.store(sequence + 2, memory_order_release);
+
+    refining_.clear(memory_order_release);
+  }
+
+  bool enabled_;
+  uint64_t first_tsc_ = 0;
+  int64_t first_ns_ = 0;
+  int64_t refine_ticks_ = 0;
+  double inverse_refine_ticks_ = 0;
+
+  // guarded by sequence_, odd while Refine() writes
+  atomic<uint32_t> sequence_{0};
+  atomic<uint64_t> base_tsc_{0};
+  atomic<int64_t> base_ns_{0};
+  atomic<double> ns_per_tick_{0};
+  atomic<double> offset_ns_{0};
+  atomic_flag refining_ = ATOMIC_FLAG_INIT;
+};
+
+TscClock& Tsc() {
+  static TscClock clock;
+  return clock;
+}
+
+#endif  // __x86_64__
+
+}  // namespace
+
+int64_t NowNs() {
+#if defined(__x86_64__)
+  TscClock& clock = Tsc();
+  if (clock.enabled()) return clock.Now();
+#endif
+  return SteadyNs();
+}
+
+bool ClockUsesTsc() {
+#if defined(__x86_64__)
+  return Tsc().enabled();
+#else
+  return false;
+#endif
+}
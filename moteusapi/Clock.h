@@ -0,0 +1,46 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSCLOCK_H__
+#define MOTEUSCLOCK_H__
+
+#include <chrono>
+#include <cstdint>
+
+// Monotonic time in nanoseconds. Every timestamp the library records
+// (reply times, logs, the command journal) uses this time base, which
+// is the steady clock, CLOCK_MONOTONIC on Linux, so timestamps of
+// different processes compare.
+//
+// On x86-64 with an invariant TSC the time is read from the TSC, with a
+// scale calibrated against the steady clock on the first call and
+// refined ten times a second, which keeps the two within about a
+// microsecond while a reading skips the system call. Corrections are
+// slewed in, a thread never reads a time before one it read already.
+// Elsewhere, when the kernel does not use the TSC as its clock source,
+// or with MOTEUS_CLOCK=steady in the environment, the steady clock is
+// read directly.
+int64_t NowNs();
+
+// The steady clock itself.
+inline int64_t SteadyNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Whether NowNs() reads the TSC.
+bool ClockUsesTsc();
+
+#endif  // MOTEUSCLOCK_H__
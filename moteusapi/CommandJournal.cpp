@@ -0,0 +1,130 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "CommandJournal.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <stdexcept>
+
+#include "Clock.h"
+
+using mjbots::moteus::CanFrame;
+
+namespace {
+
+const char kMagic[8] = "MOTJRNL";
+const uint32_t kVersion = 1;
+
+// FNV-1a over everything that identifies a servo's slot
+uint64_t Fingerprint(const Topology& topology) {
+  uint64_t hash = 14695981039346656037ull;
+  auto add = [&hash](const string& str) {
+    for (const char c : str) {
+      hash ^= static_cast<uint8_t>(c);
+      hash *= 1099511628211ull;
+    }
+    hash ^= 0xff;
+    hash *= 1099511628211ull;
+  };
+  for (const auto& servo : topology.servos) {
+    add(servo.name);
+    add(topology.adapters[servo.adapter].dev_name);
+    add(to_string(servo.id));
+  }
+  return hash;
+}
+
+}  // namespace
+
+CommandJournal::CommandJournal(const string& path, const Topology& topology)
+    : path_(path), servos_(topology.servos.size()) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("CommandJournal: unable to open " + path);
+  }
+  map_size_ = sizeof(Header) + servos_ * sizeof(Slot);
+
+  Header expected;
+  memset(&expected, 0, sizeof(expected));
+  memcpy(expected.magic, kMagic, sizeof(kMagic));
+  expected.version = kVersion;
+  expected.servos = static_cast<uint32_t>(servos_);
+  expected.fingerprint = Fingerprint(topology);
+
+  struct stat st;
+  Header header;
+  const bool valid =
+      fstat(fd_, &st) == 0 && static_cast<size_t>(st.st_size) == map_size_ &&
+      pread(fd_, &header, sizeof(header), 0) == sizeof(header) &&
+      memcmp(&header, &expected, sizeof(header)) == 0;
+  if (!valid) {
+    // start over with empty slots
+    if (ftruncate(fd_, 0) < 0 || ftruncate(fd_, map_size_) < 0 ||
+        pwrite(fd_, &expected, sizeof(expected), 0) != sizeof(expected)) {
+      close(fd_);
+      throw std::runtime_error("CommandJournal: unable to initialize " + path);
+    }
+  }
+
+  map_ = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map_ == MAP_FAILED) {
+    close(fd_);
+    throw std::runtime_error("CommandJournal: unable to map " + path);
+  }
+  slots_ = reinterpret_cast<Slot*>(static_cast<char*>(map_) + sizeof(Header));
+}
+
+CommandJournal::~CommandJournal() {
+  munmap(map_, map_size_);
+  close(fd_);
+}
+
+void CommandJournal::Store(size_t servo, const CanFrame& frame,
+                           int64_t timestamp_ns) {
+  Slot& slot = slots_[servo];
+  const uint32_t sequence = slot.sequence.load(memory_order_relaxed);
+  slot.sequence.store(sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot.size = frame.size;
+  slot.timestamp_ns = timestamp_ns;
+  memcpy(slot.data, frame.data, frame.size);
+  slot.sequence.store(sequence + 2, memory_order_release);
+}
+
+bool CommandJournal::Load(size_t servo, double max_age_s,
+                          CanFrame* frame) const {
+  if (servo >= servos_) return false;
+  const Slot& slot = slots_[servo];
+  const uint32_t before = slot.sequence.load(memory_order_acquire);
+  // odd: the writer died in the middle of the slot
+  if (before & 1) return false;
+  const uint8_t size = slot.size;
+  const int64_t timestamp_ns = slot.timestamp_ns;
+  if (size == 0 || size > sizeof(frame->data)) return false;
+  memcpy(frame->data, slot.data, size);
+  atomic_thread_fence(memory_order_acquire);
+  if (slot.sequence.load(memory_order_relaxed) != before) return false;
+
+  // a timestamp from the future belongs to another boot
+  const int64_t age_ns = NowNs() - timestamp_ns;
+  if (age_ns < 0 || age_ns > std::llround(max_age_s * 1e9)) return false;
+  frame->size = size;
+  return true;
+}
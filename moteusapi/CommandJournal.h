@@ -0,0 +1,76 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSCOMMANDJOURNAL_H__
+#define MOTEUSCOMMANDJOURNAL_H__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "Topology.h"
+#include "moteus_protocol.h"
+
+using namespace std;
+
+// The latest command frame of every servo in a shared file mapping, so a
+// restarted process can resend them before it rebuilt its own state.
+// Storing is a memcpy into the mapping, the kernel writes the pages back
+// on its own. Put the file on a tmpfs such as /dev/shm: it then survives
+// process restarts but not reboots, and never causes disk writes.
+//
+// Each slot is guarded by a sequence number that is odd while the slot
+// is written, so a slot torn by a crash is never loaded. A journal
+// written for a different topology is cleared when opened.
+class CommandJournal {
+ public:
+  CommandJournal(const string& path, const Topology& topology);
+  ~CommandJournal();
+
+  CommandJournal(const CommandJournal&) = delete;
+  CommandJournal& operator=(const CommandJournal&) = delete;
+
+  // |frame| with size 0 records that the servo is not commanded.
+  void Store(size_t servo, const mjbots::moteus::CanFrame& frame,
+             int64_t timestamp_ns);
+  // The servo's last command frame if it was stored at most |max_age_s|
+  // ago.
+  bool Load(size_t servo, double max_age_s,
+            mjbots::moteus::CanFrame* frame) const;
+
+ private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t servos;
+    uint64_t fingerprint;
+  };
+
+  struct Slot {
+    atomic<uint32_t> sequence;
+    uint8_t size;
+    uint8_t reserved[3];
+    int64_t timestamp_ns;
+    uint8_t data[64];
+  };
+
+  const string path_;
+  int fd_ = -1;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+  Slot* slots_ = nullptr;
+  size_t servos_ = 0;
+};
+
+#endif  // MOTEUSCOMMANDJOURNAL_H__
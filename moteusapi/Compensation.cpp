@@ -0,0 +1,210 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "Compensation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+string Trim(const string& str) {
+  const auto begin = str.find_first_not_of(" \t\r");
+  if (begin == string::npos) return "";
+  const auto end = str.find_last_not_of(" \t\r");
+  return str.substr(begin, end - begin + 1);
+}
+
+// std::floor without the call it becomes before SSE4.1, for |value|
+// below 2^63
+double Floor(double value) {
+  const double truncated = static_cast<double>(static_cast<int64_t>(value));
+  return truncated - (truncated > value);
+}
+
+}  // namespace
+
+Compensation::Compensation(const Topology& topology) {
+  const size_t servos = topology.servos.size();
+  scale_.assign(servos, 1);
+  bins_.assign(servos, 1);
+  inverse_bins_.assign(servos, 1);
+  offset_.assign(servos, 0);
+  coulomb_.assign(servos, 0);
+  inverse_band_.assign(servos, 0);
+  viscous_.assign(servos, 0);
+  compensated_.assign(servos, false);
+  // one zero bin, shared by the servos without a table
+  table_.assign(2, 0);
+}
+
+void Compensation::Set(size_t servo, const CompensationTable& table) {
+  if (!(table.period > 0)) {
+    throw std::runtime_error("Compensation: the period must be positive");
+  }
+  if (!(table.velocity_band >= 0)) {
+    throw std::runtime_error("Compensation: negative velocity_band");
+  }
+  // NAN and infinities would end up in every feedforward torque
+  bool finite = std::isfinite(table.period) &&
+                std::isfinite(table.velocity_band) &&
+                std::isfinite(table.coulomb) && std::isfinite(table.viscous);
+  for (const double bin : table.cogging) finite = finite && std::isfinite(bin);
+  if (!finite) {
+    throw std::runtime_error("Compensation: values must be finite");
+  }
+  vector<double> bins = table.cogging;
+  if (bins.empty()) bins.push_back(0);
+
+  // setting a servo again leaves its old bins unused in table_
+  offset_.at(servo) = table_.size();
+  table_.insert(table_.end(), bins.begin(), bins.end());
+  table_.push_back(bins.front());
+
+  bins_[servo] = static_cast<double>(bins.size());
+  inverse_bins_[servo] = 1.0 / bins.size();
+  scale_[servo] = bins.size() / table.period;
+  coulomb_[servo] = table.coulomb;
+  // a band of 0 is a step at standstill
+  inverse_band_[servo] = table.velocity_band > 0
+                             ? 1 / table.velocity_band
+                             : std::numeric_limits<double>::max();
+  viscous_[servo] = table.viscous;
+  compensated_[servo] = true;
+}
+
+void Compensation::Compute(const double* position, const double* velocity,
+                           double* torque) const {
+  const size_t count = size();
+  const double* const table = table_.data();
+  for (size_t ii = 0; ii < count; ii++) {
+    const double p = position[ii];
+    const double v = velocity[ii];
+    // neither NAN nor infinite
+    const bool has_position = p - p == 0;
+    const bool has_velocity = v == v;
+
+    // where in the table, wrapped into [0, bins)
+    const double bins = bins_[ii];
+    const double x = (has_position ? p : 0) * scale_[ii];
+    const double u = x - Floor(x * inverse_bins_[ii]) * bins;
+    const double index = std::min(Floor(u), bins - 1);
+    const double* const bin = table + offset_[ii] + static_cast<size_t>(index);
+    const double cogging = bin[0] + (bin[1] - bin[0]) * (u - index);
+
+    const double w = has_velocity ? v : 0;
+    const double direction =
+        std::max(-1.0, std::min(1.0, w * inverse_band_[ii]));
+    const double friction = coulomb_[ii] * direction + viscous_[ii] * w;
+
+    torque[ii] = (has_position ? cogging : 0) + friction;
+  }
+}
+
+Compensation LoadCompensation(const string& path, const Topology& topology) {
+  ifstream file(path);
+  if (!file) throw std::runtime_error("Compensation: unable to open " + path);
+  stringstream ss;
+  ss << file.rdbuf();
+  return ParseCompensation(ss.str(), topology, path);
+}
+
+Compensation ParseCompensation(const string& text, const Topology& topology,
+                               const string& source) {
+  Compensation result(topology);
+  vector<CompensationTable> tables(topology.servos.size());
+  vector<bool> used(topology.servos.size());
+
+  int line_number = 0;
+  auto fail = [&](const string& message) {
+    throw std::runtime_error("Compensation: " + source + ":" +
+                             to_string(line_number) + ": " + message);
+  };
+  auto number = [&](const string& value) {
+    size_t used_chars = 0;
+    double number = 0;
+    try {
+      number = stod(value, &used_chars);
+    } catch (const logic_error&) {
+      fail("'" + value + "' is not a number");
+    }
+    if (used_chars != value.size()) fail("'" + value + "' is not a number");
+    if (!std::isfinite(number)) fail("'" + value + "' is not finite");
+    return number;
+  };
+
+  int servo = -1;
+  istringstream iss(text);
+  string line;
+  while (getline(iss, line)) {
+    line_number++;
+    const auto comment = line.find('#');
+    if (comment != string::npos) line.erase(comment);
+    line = Trim(line);
+    if (line.empty()) continue;
+
+    if (line.front() == '[') {
+      if (line.back() != ']') fail("unterminated section header");
+      istringstream header(line.substr(1, line.size() - 2));
+      string kind, name, extra;
+      header >> kind >> name >> extra;
+      if (kind != "servo" || name.empty() || !extra.empty()) {
+        fail("expected '[servo <name>]'");
+      }
+      servo = topology.ServoIndex(name);
+      if (servo < 0) fail("no servo '" + name + "' in the topology");
+      used[servo] = true;
+      continue;
+    }
+
+    const auto eq = line.find('=');
+    if (eq == string::npos) fail("expected 'key = value'");
+    if (servo < 0) fail("key outside of any servo section");
+    const string key = Trim(line.substr(0, eq));
+    const string value = Trim(line.substr(eq + 1));
+    auto& table = tables[servo];
+    if (key == "cogging") {
+      istringstream values(value);
+      string item;
+      while (values >> item) table.cogging.push_back(number(item));
+    } else if (key == "period") {
+      table.period = number(value);
+    } else if (key == "coulomb") {
+      table.coulomb = number(value);
+    } else if (key == "velocity_band") {
+      table.velocity_band = number(value);
+    } else if (key == "viscous") {
+      table.viscous = number(value);
+    } else {
+      fail("unknown key '" + key + "'");
+    }
+  }
+
+  for (size_t ii = 0; ii < tables.size(); ii++) {
+    if (!used[ii]) continue;
+    try {
+      result.Set(ii, tables[ii]);
+    } catch (const runtime_error& e) {
+      throw std::runtime_error(string(e.what()) + " for servo '" +
+                               topology.servos[ii].name + "' in " + source);
+    }
+  }
+  return result;
+}
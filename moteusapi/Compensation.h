@@ -0,0 +1,95 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MOTEUSCOMPENSATION_H__
+#define MOTEUSCOMPENSATION_H__
+
+#include <string>
+#include <vector>
+
+#include "Topology.h"
+
+using namespace std;
+
+// Torque a servo loses to cogging and friction, as characterized on
+// the bench. Positions are in the servo's units, revolutions for moteus.
+struct CompensationTable {
+  // the cogging torque repeats every |period|
+  double period = 1;
+  // Nm at |cogging.size()| evenly spaced positions over one period,
+  // starting at position 0, interpolated linearly in between
+  vector<double> cogging;
+  // Nm against the direction of motion, ramped in over |velocity_band|
+  // rev/s around standstill
+  double coulomb = 0;
+  double velocity_band = 0.01;
+  // Nm per rev/s
+  double viscous = 0;
+};
+
+// The compensation tables of every servo of a topology, laid out to be
+// evaluated for all of them in one branch free pass. Servos without a
+// table are compensated with 0.
+class Compensation {
+ public:
+  explicit Compensation(const Topology& topology);
+
+  size_t size() const { return scale_.size(); }
+  // Throws std::runtime_error for a period that is not positive, a
+  // negative velocity_band or a value that is not finite.
+  void Set(size_t servo, const CompensationTable& table);
+  // Whether |servo| has a table.
+  bool compensated(size_t servo) const { return compensated_[servo]; }
+
+  // Writes the torque to add to each servo's feedforward torque for its
+  // |position| and |velocity|, all arrays of size() entries. A NAN
+  // position leaves out the cogging, a NAN velocity the friction.
+  void Compute(const double* position, const double* velocity,
+               double* torque) const;
+
+ private:
+  // per servo: table bins per position unit, number of bins and where
+  // the bins start in table_
+  vector<double> scale_;
+  vector<double> bins_;
+  vector<double> inverse_bins_;
+  vector<size_t> offset_;
+  vector<double> coulomb_;
+  vector<double> inverse_band_;
+  vector<double> viscous_;
+  vector<bool> compensated_;
+  // all bins, each table followed by its first bin again so that
+  // interpolating never wraps
+  vector<double> table_;
+};
+
+// Reads the tables of the servos of |topology| from a file in the
+// format of the topology, one section per compensated servo:
+//
+//   [servo hip_left]
+//   period = 1
+//   cogging = 0.012 0.020 0.009 -0.004 -0.015 -0.011
+//   cogging = 0.002 0.010           # continues the table
+//   coulomb = 0.03
+//   velocity_band = 0.02
+//   viscous = 0.01
+//
+// Throws std::runtime_error for unknown servos or keys and for values
+// that do not parse or are not finite, naming the file and line.
+Compensation LoadCompensation(const string& path, const Topology& topology);
+Compensation ParseCompensation(const string& text, const Topology& topology,
+                               const string& source = "<string>");
+
+#endif  // MOTEUSCOMPENSATION_H__
@@ -0,0 +1,142 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "DeadmanMonitor.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+
+#include "Clock.h"
+#include "FrameLayout.h"
+#include "MoteusGroup.h"
+
+using namespace mjbots::moteus;
+
+namespace {
+
+// A query of nothing, the frames of the monitor ask for no reply.
+QueryCommand NoQuery() {
+  QueryCommand query;
+  query.mode = Resolution::kIgnore;
+  query.position = Resolution::kIgnore;
+  query.velocity = Resolution::kIgnore;
+  query.torque = Resolution::kIgnore;
+  query.q_current = Resolution::kIgnore;
+  query.d_current = Resolution::kIgnore;
+  query.rezero_state = Resolution::kIgnore;
+  query.voltage = Resolution::kIgnore;
+  query.temperature = Resolution::kIgnore;
+  query.fault = Resolution::kIgnore;
+  return query;
+}
+
+}  // namespace
+
+DeadmanMonitor::DeadmanMonitor(const MoteusGroup& group, double timeout_s,
+                               Action action, int priority)
+    : timeout_ns_(llround(timeout_s * 1e9)) {
+  if (!(timeout_s > 0)) {
+    throw std::runtime_error("DeadmanMonitor: timeout must be positive");
+  }
+
+  const size_t adapters = group.topology().adapters.size();
+  frames_.resize(adapters);
+  for (size_t ii = 0; ii < adapters; ii++) {
+    transports_.push_back(group.transport(ii));
+  }
+
+  const QueryCommand none = NoQuery();
+  for (size_t ii = 0; ii < group.size(); ii++) {
+    const auto& config = group.config(ii);
+    BusFrame frame;
+    frame.arbitration_id = config.id;
+    if (action == Action::kStop) {
+      frame.frame = MakeStopFrame(none);
+    } else {
+      // no position is the position the servo is at
+      PositionCommand hold;
+      hold.position = NAN;
+      hold.velocity = 0;
+      hold.maximum_torque =
+          std::isfinite(config.torque_max) ? config.torque_max : NAN;
+      if (config.watchdog_timeout != 0) {
+        hold.watchdog_timeout = config.watchdog_timeout;
+      }
+      EncodePositionCommand(MakePositionLayout(config.command, none), hold,
+                            &frame.frame);
+    }
+    auto& frames = frames_[config.adapter];
+    frames.push_back(frame);
+    if (frames.size() > Transport::kMaxUrgent) {
+      throw std::runtime_error("DeadmanMonitor: too many servos on " +
+                               transports_[config.adapter]->dev_name());
+    }
+  }
+
+  thread_ = thread([this, priority]() {
+    if (priority > 0) {
+      struct sched_param param = {};
+      param.sched_priority = priority;
+      realtime_ =
+          pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+    }
+    Run();
+  });
+}
+
+DeadmanMonitor::~DeadmanMonitor() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    done_ = true;
+  }
+  wake_.notify_all();
+  thread_.join();
+}
+
+void DeadmanMonitor::Heartbeat() {
+  heartbeat_ns_.store(NowNs(), memory_order_release);
+  tripped_.store(false, memory_order_relaxed);
+}
+
+void DeadmanMonitor::Run() {
+  unique_lock<mutex> lock(mutex_);
+  while (!done_) {
+    const int64_t heartbeat = heartbeat_ns_.load(memory_order_acquire);
+    // not armed before the first heartbeat
+    const int64_t remaining_ns =
+        heartbeat == 0 ? timeout_ns_ : heartbeat + timeout_ns_ - NowNs();
+    if (heartbeat == 0 || remaining_ns > 0) {
+      wake_.wait_for(lock, chrono::nanoseconds(remaining_ns));
+      continue;
+    }
+
+    // the loop may have come back meanwhile
+    if (heartbeat_ns_.load(memory_order_acquire) != heartbeat) continue;
+    if (!tripped_.exchange(true)) trips_++;
+    Trip();
+    // and again after every further timeout
+    wake_.wait_for(lock, chrono::nanoseconds(timeout_ns_));
+  }
+}
+
+void DeadmanMonitor::Trip() {
+  for (size_t ii = 0; ii < transports_.size(); ii++) {
+    if (frames_[ii].empty()) continue;
+    transports_[ii]->SendUrgent(frames_[ii].data(), frames_[ii].size());
+  }
+}
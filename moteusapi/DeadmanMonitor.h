@@ -0,0 +1,88 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSDEADMANMONITOR_H__
+#define MOTEUSDEADMANMONITOR_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Transport.h"
+
+using namespace std;
+
+class MoteusGroup;
+
+// Watches the heartbeat of a control loop from its own thread and, when
+// a heartbeat is late, sends every servo of the group a stop or hold
+// frame straight through Transport::SendUrgent(), while the control
+// thread may still be stuck inside Cycle(). The frames are built at
+// construction, tripping only writes them. They are sent again every
+// timeout until the loop beats again.
+//
+// The thread asks for SCHED_FIFO at |priority| if that is above 0, which
+// needs the privilege to; realtime() tells whether it got it.
+class DeadmanMonitor {
+ public:
+  enum class Action {
+    // stop mode, the servos go limp
+    kStop,
+    // position mode at the current position and zero velocity, limited
+    // to torque_max
+    kHold,
+  };
+
+  DeadmanMonitor(const MoteusGroup& group, double timeout_s,
+                 Action action = Action::kStop, int priority = 0);
+  ~DeadmanMonitor();
+
+  DeadmanMonitor(const DeadmanMonitor&) = delete;
+  DeadmanMonitor& operator=(const DeadmanMonitor&) = delete;
+
+  // Called by the control loop, e.g. once per Cycle(). The first call
+  // arms the monitor.
+  void Heartbeat();
+
+  // whether the loop is late right now
+  bool tripped() const { return tripped_; }
+  // how often the loop was late
+  uint64_t trips() const { return trips_; }
+  bool realtime() const { return realtime_; }
+
+ private:
+  void Run();
+  void Trip();
+
+  const int64_t timeout_ns_;
+  // per adapter, the transport and its frames
+  vector<shared_ptr<Transport>> transports_;
+  vector<vector<BusFrame>> frames_;
+
+  atomic<int64_t> heartbeat_ns_{0};
+  atomic<bool> tripped_{false};
+  atomic<uint64_t> trips_{0};
+  atomic<bool> realtime_{false};
+
+  mutex mutex_;
+  condition_variable wake_;
+  bool done_ = false;
+  thread thread_;
+};
+
+#endif  // MOTEUSDEADMANMONITOR_H__
@@ -0,0 +1,146 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "FaultRecovery.h"
+
+#include <algorithm>
+#include <cmath>
+
+using mjbots::moteus::Mode;
+
+namespace {
+
+bool Faulted(Mode mode) {
+  return mode == Mode::kFault || mode == Mode::kPositionTimeout;
+}
+
+}  // namespace
+
+FaultRecovery::FaultRecovery(MoteusGroup& group,
+                             const FaultRecoveryConfig& config)
+    : group_(group), config_(config), servos_(group.size()) {}
+
+void FaultRecovery::Update() {
+  const int64_t settle_ns = llround(config_.settle_s * 1e9);
+  const int64_t clear_timeout_ns = llround(config_.clear_timeout_s * 1e9);
+
+  for (size_t ii = 0; ii < servos_.size(); ii++) {
+    if (!group_.replied(ii)) continue;
+    // the view also works with lazy decoding
+    const double value = group_.view(ii).mode();
+    if (std::isnan(value)) continue;
+    const Mode mode = static_cast<Mode>(static_cast<int>(value));
+    const int64_t now_ns = group_.reply_time_ns(ii);
+    auto& servo = servos_[ii];
+
+    switch (servo.phase) {
+      case Phase::kWatching:
+      case Phase::kRestarting:
+        if (Faulted(mode)) {
+          Detect(ii, mode, now_ns);
+        } else if (servo.phase == Phase::kRestarting &&
+                   mode != Mode::kStopped && mode != Mode::kEnabling) {
+          Finish(ii, now_ns);
+        }
+        break;
+      case Phase::kClearing:
+        if (mode == Mode::kStopped) {
+          if (config_.policy == FaultRecoveryConfig::Policy::kStop) {
+            Finish(ii, now_ns);
+          } else {
+            servo.phase = Phase::kSettling;
+            servo.phase_ns = now_ns;
+          }
+        } else if (now_ns - servo.phase_ns > clear_timeout_ns) {
+          Finish(ii, 0);
+        }
+        break;
+      case Phase::kSettling:
+        if (Faulted(mode)) {
+          Detect(ii, mode, now_ns);
+        } else if (now_ns - servo.phase_ns >= settle_ns) {
+          if (config_.policy == FaultRecoveryConfig::Policy::kReenable) {
+            // no position is the position the servo is at
+            mjbots::moteus::PositionCommand hold;
+            hold.position = NAN;
+            hold.velocity = 0;
+            const double torque_max = group_.config(ii).torque_max;
+            hold.maximum_torque = std::isfinite(torque_max) ? torque_max : NAN;
+            group_.OverridePosition(ii, hold);
+          } else {
+            group_.ClearOverride(ii);
+            if (!group_.commanded(ii)) {
+              // it was meant to be stopped anyway
+              Finish(ii, now_ns);
+              break;
+            }
+          }
+          servo.phase = Phase::kRestarting;
+          servo.phase_ns = now_ns;
+        }
+        break;
+      case Phase::kFailed:
+        break;
+    }
+  }
+}
+
+void FaultRecovery::Reset(size_t index) {
+  auto& servo = servos_[index];
+  group_.ClearOverride(index);
+  servo.phase = Phase::kWatching;
+  servo.faults.clear();
+}
+
+void FaultRecovery::Detect(size_t index, Mode mode, int64_t now_ns) {
+  auto& servo = servos_[index];
+  faults_++;
+
+  const int64_t window_ns = llround(config_.retry_window_s * 1e9);
+  servo.faults.erase(
+      std::remove_if(servo.faults.begin(), servo.faults.end(),
+                     [&](int64_t ns) { return now_ns - ns > window_ns; }),
+      servo.faults.end());
+  servo.faults.push_back(now_ns);
+
+  // a fault during a recovery is a retry of it, reported with it
+  if (servo.phase == Phase::kWatching) {
+    const double fault = group_.view(index).fault();
+    servo.event = FaultEvent();
+    servo.event.servo = index;
+    servo.event.mode = mode;
+    servo.event.fault = std::isnan(fault) ? 0 : static_cast<int>(fault);
+    servo.event.detected_ns = now_ns;
+  }
+
+  group_.OverrideStop(index);
+  servo.phase = Phase::kClearing;
+  servo.phase_ns = now_ns;
+  if (servo.faults.size() > static_cast<size_t>(config_.max_retries)) {
+    Finish(index, 0);
+  }
+}
+
+void FaultRecovery::Finish(size_t index, int64_t recovered_ns) {
+  auto& servo = servos_[index];
+  servo.event.recovered_ns = recovered_ns;
+  servo.last = servo.event;
+  if (recovered_ns != 0) {
+    recoveries_++;
+    servo.phase = Phase::kWatching;
+  } else {
+    servo.phase = Phase::kFailed;
+  }
+  if (callback_) callback_(servo.last);
+}
@@ -0,0 +1,132 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSFAULTRECOVERY_H__
+#define MOTEUSFAULTRECOVERY_H__
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "MoteusGroup.h"
+
+using namespace std;
+
+struct FaultRecoveryConfig {
+  enum class Policy {
+    // stop the servo and leave it stopped
+    kStop,
+    // once the fault is cleared, hold the servo where it is
+    kReenable,
+    // once the fault is cleared, send the latched command again
+    kResume,
+  };
+  Policy policy = Policy::kResume;
+  // time between the fault clearing and the servo being commanded again
+  double settle_s = 0.05;
+  // a fault not cleared by the stop within this is given up on
+  double clear_timeout_s = 0.5;
+  // more faults than this within retry_window_s are given up on too
+  int max_retries = 3;
+  double retry_window_s = 10;
+};
+
+// One fault of one servo, reported when it is over.
+struct FaultEvent {
+  size_t servo = 0;
+  // kFault or kPositionTimeout
+  mjbots::moteus::Mode mode = mjbots::moteus::Mode::kFault;
+  // the fault register, 0 if not queried
+  int fault = 0;
+  // reply time of the reply showing the fault
+  int64_t detected_ns = 0;
+  // reply time of the reply showing the servo recovered, 0 if it did not
+  int64_t recovered_ns = 0;
+  bool recovered() const { return recovered_ns != 0; }
+  // NaN if it did not
+  double recovery_s() const {
+    return recovered() ? (recovered_ns - detected_ns) * 1e-9 : NAN;
+  }
+};
+
+// Tracks the mode of every servo from its replies and recovers servos
+// that enter kFault or kPositionTimeout: the servo is stopped, which
+// clears the fault, and once the replies show it stopped it is, after
+// settle_s, re-enabled or given its last command again. It counts as
+// recovered with the first reply showing it in another mode, or, with
+// kStop, stopped. Servos that keep faulting or do not clear are left
+// stopped until Reset().
+//
+// The stop and the hold are MoteusGroup overrides, so commands the
+// application latches meanwhile do not replace them; with kResume the
+// latest of those goes out once the fault is cleared. After kStop and
+// kReenable the servo stays stopped or held until Reset(). The servos
+// must have mode in their query.
+class FaultRecovery {
+ public:
+  using Callback = function<void(const FaultEvent&)>;
+
+  explicit FaultRecovery(MoteusGroup& group,
+                         const FaultRecoveryConfig& config =
+                             FaultRecoveryConfig());
+
+  // Called with every finished recovery, from Update().
+  void SetCallback(Callback callback) { callback_ = std::move(callback); }
+
+  // Call after each Cycle().
+  void Update();
+
+  // Whether the servo is being recovered or was given up on.
+  bool recovering(size_t servo) const {
+    return servos_[servo].phase != Phase::kWatching;
+  }
+  bool failed(size_t servo) const {
+    return servos_[servo].phase == Phase::kFailed;
+  }
+  // Hands a failed, stopped or held servo back to its latched command
+  // and watches it again.
+  void Reset(size_t servo);
+
+  // faults detected and recovered so far
+  uint64_t faults() const { return faults_; }
+  uint64_t recoveries() const { return recoveries_; }
+  // the latest finished recovery of the servo
+  const FaultEvent& last(size_t servo) const { return servos_[servo].last; }
+
+ private:
+  enum class Phase { kWatching, kClearing, kSettling, kRestarting, kFailed };
+
+  struct Servo {
+    Phase phase = Phase::kWatching;
+    // reply time the phase started
+    int64_t phase_ns = 0;
+    FaultEvent event;
+    FaultEvent last;
+    // detection times of the recent faults
+    vector<int64_t> faults;
+  };
+
+  void Detect(size_t servo, mjbots::moteus::Mode mode, int64_t now_ns);
+  void Finish(size_t servo, int64_t recovered_ns);
+
+  MoteusGroup& group_;
+  const FaultRecoveryConfig config_;
+  vector<Servo> servos_;
+  Callback callback_;
+  uint64_t faults_ = 0;
+  uint64_t recoveries_ = 0;
+};
+
+#endif  // MOTEUSFAULTRECOVERY_H__
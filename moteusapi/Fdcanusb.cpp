@@ -0,0 +1,309 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Fdcanusb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include "Clock.h"
+
+namespace {
+
+const char kHex[] = "0123456789abcdef";
+
+int64_t NowUs() { return NowNs() / 1000; }
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool StartsWith(const char* str, const char* prefix) {
+  return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+}  // namespace
+
+Fdcanusb::Fdcanusb(const string& dev_name) : dev_name_(dev_name) {
+  Open();
+  tx_buffer_.reserve(4096);
+  // room for kMaxUrgent frames of 64 bytes
+  urgent_buffer_.reserve(kMaxUrgent * 160);
+}
+
+Fdcanusb::~Fdcanusb() {
+  if (fd_ >= 0) close(fd_);
+}
+
+shared_ptr<Fdcanusb> Fdcanusb::Open(const string& dev_name) {
+  static mutex registry_mutex;
+  static map<string, weak_ptr<Fdcanusb>> registry;
+
+  char resolved[PATH_MAX];
+  const string key =
+      realpath(dev_name.c_str(), resolved) != nullptr ? resolved : dev_name;
+
+  lock_guard<mutex> lock(registry_mutex);
+  auto& entry = registry[key];
+  shared_ptr<Fdcanusb> result = entry.lock();
+  if (!result) {
+    result = make_shared<Fdcanusb>(dev_name);
+    entry = result;
+  }
+  return result;
+}
+
+void Fdcanusb::Open() {
+  fd_ = open(dev_name_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd_ == -1) {
+    throw std::runtime_error("Fdcanusb: Unable to open " + dev_name_);
+  }
+
+  struct termios toptions;
+  if (tcgetattr(fd_, &toptions) < 0) {
+    close(fd_);
+    throw std::runtime_error("Fdcanusb: Couldn't get term attributes");
+  }
+
+  // the baud rate is ignored by the adapter
+  cfsetispeed(&toptions, B115200);
+  cfsetospeed(&toptions, B115200);
+  cfmakeraw(&toptions);
+  toptions.c_cflag &= ~(CSTOPB | CRTSCTS);
+  toptions.c_cflag |= CREAD | CLOCAL;
+  toptions.c_cc[VMIN] = 0;
+  toptions.c_cc[VTIME] = 0;
+
+  if (tcsetattr(fd_, TCSAFLUSH, &toptions) < 0) {
+    close(fd_);
+    throw std::runtime_error("Fdcanusb: Couldn't set term attributes");
+  }
+}
+
+bool Fdcanusb::Send(const BusFrame* frames, size_t count, int timeout_us) {
+  if (stale_) {
+    lock_guard<mutex> lock(write_mutex_);
+    tcflush(fd_, TCIFLUSH);
+    rx_begin_ = rx_end_ = 0;
+    urgent_acks_ = 0;
+    stale_ = false;
+    // the OKs of the frames before are gone
+    lock_guard<mutex> capture_lock(capture_mutex_);
+    if (capture_.is_open()) capture_ << NowNs() << " - flush\n";
+  }
+
+  tx_buffer_.clear();
+  Format(frames, count, &tx_buffer_);
+
+  // captured under the lock, in the order the adapter gets the lines
+  lock_guard<mutex> lock(write_mutex_);
+  Capture('>', tx_buffer_);
+  return Write(tx_buffer_, timeout_us);
+}
+
+bool Fdcanusb::SendUrgent(const BusFrame* frames, size_t count) {
+  if (count > kMaxUrgent) return false;
+  lock_guard<mutex> lock(write_mutex_);
+  urgent_buffer_.clear();
+  Format(frames, count, &urgent_buffer_);
+  // counted and captured first, the OKs may arrive before the write
+  // returns
+  Capture('!', urgent_buffer_);
+  urgent_acks_ += count;
+  if (!Write(urgent_buffer_, kUrgentTimeoutUs)) {
+    urgent_acks_ -= count;
+    return false;
+  }
+  return true;
+}
+
+void Fdcanusb::Format(const BusFrame* frames, size_t count, string* buffer) {
+  for (size_t ii = 0; ii < count; ii++) {
+    const auto& frame = frames[ii];
+    char id[] = "can send 0000 ";
+    for (int nibble = 0; nibble < 4; nibble++) {
+      id[9 + nibble] = kHex[(frame.arbitration_id >> (12 - 4 * nibble)) & 0xf];
+    }
+    buffer->append(id, sizeof(id) - 1);
+    for (int jj = 0; jj < frame.frame.size; jj++) {
+      buffer->push_back(kHex[frame.frame.data[jj] >> 4]);
+      buffer->push_back(kHex[frame.frame.data[jj] & 0xf]);
+    }
+    buffer->push_back('\n');
+  }
+}
+
+void Fdcanusb::Capture(char direction, const string& buffer) {
+  lock_guard<mutex> lock(capture_mutex_);
+  if (!capture_.is_open()) return;
+  // one time for all lines, they are one write
+  const int64_t now = NowNs();
+  size_t begin = 0;
+  while (begin < buffer.size()) {
+    const size_t end = buffer.find('\n', begin);
+    capture_ << now << ' ' << direction << ' ';
+    capture_.write(buffer.data() + begin, end - begin + 1);
+    begin = end + 1;
+  }
+}
+
+bool Fdcanusb::Write(const string& buffer, int64_t timeout_us) {
+  const int64_t deadline_us = NowUs() + timeout_us;
+  size_t written = 0;
+  while (written < buffer.size()) {
+    const ssize_t n =
+        write(fd_, buffer.data() + written, buffer.size() - written);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) return false;
+      const int64_t remaining_us = deadline_us - NowUs();
+      if (timeout_us >= 0 && remaining_us <= 0) return false;
+      fd_set writefds;
+      FD_ZERO(&writefds);
+      FD_SET(fd_, &writefds);
+      struct timeval tv;
+      tv.tv_sec = remaining_us / 1000000;
+      tv.tv_usec = remaining_us % 1000000;
+      select(fd_ + 1, nullptr, &writefds, nullptr,
+             timeout_us < 0 ? nullptr : &tv);
+      continue;
+    }
+    written += n;
+  }
+  return true;
+}
+
+bool Fdcanusb::Receive(size_t acks, size_t expected, BusFrame* replies,
+                       size_t max_replies, size_t* received, int timeout_us) {
+  const int64_t deadline_us = NowUs() + timeout_us;
+  size_t acked = 0;
+  size_t replied = 0;
+  bool error = false;
+
+  while (true) {
+    // urgent frames sent meanwhile are acknowledged in between
+    acks += urgent_acks_.exchange(0);
+    if (acked >= acks && replied >= expected) break;
+    const char* line = ReadLine(deadline_us);
+    if (line == nullptr) {
+      stale_ = true;
+      break;
+    }
+    {
+      lock_guard<mutex> lock(capture_mutex_);
+      if (capture_.is_open()) capture_ << NowNs() << " < " << line << '\n';
+    }
+    if (StartsWith(line, "OK")) {
+      acked++;
+    } else if (StartsWith(line, "ERR")) {
+      acked++;
+      error = true;
+    } else if (StartsWith(line, "rcv ")) {
+      if (replied < max_replies && ParseReceive(line, &replies[replied])) {
+        replies[replied].timestamp_ns = NowNs();
+        replied++;
+      }
+    }
+  }
+
+  *received = replied;
+  return !error && acked >= acks && replied >= expected;
+}
+
+void Fdcanusb::SetCapture(const string& path) {
+  lock_guard<mutex> lock(capture_mutex_);
+  if (capture_.is_open()) capture_.close();
+  if (path.empty()) return;
+  capture_.open(path, ios::app);
+  if (!capture_) {
+    throw std::runtime_error("Fdcanusb: Unable to open capture " + path);
+  }
+}
+
+const char* Fdcanusb::ReadLine(int64_t deadline_us) {
+  while (true) {
+    char* begin = rx_buffer_ + rx_begin_;
+    char* newline =
+        static_cast<char*>(memchr(begin, '\n', rx_end_ - rx_begin_));
+    if (newline != nullptr) {
+      *newline = 0;
+      if (newline > begin && newline[-1] == '\r') newline[-1] = 0;
+      rx_begin_ = newline - rx_buffer_ + 1;
+      return begin;
+    }
+
+    // keep the partial line at the front of the buffer
+    if (rx_begin_ > 0) {
+      memmove(rx_buffer_, begin, rx_end_ - rx_begin_);
+      rx_end_ -= rx_begin_;
+      rx_begin_ = 0;
+    }
+    if (rx_end_ == sizeof(rx_buffer_)) {
+      // no sane line is this long, drop it
+      rx_end_ = 0;
+    }
+
+    const ssize_t n =
+        read(fd_, rx_buffer_ + rx_end_, sizeof(rx_buffer_) - rx_end_);
+    if (n > 0) {
+      rx_end_ += n;
+      continue;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EINTR) return nullptr;
+
+    const int64_t remaining_us = deadline_us - NowUs();
+    if (remaining_us <= 0) return nullptr;
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(fd_, &readfds);
+    struct timeval tv;
+    tv.tv_sec = remaining_us / 1000000;
+    tv.tv_usec = remaining_us % 1000000;
+    select(fd_ + 1, &readfds, nullptr, nullptr, &tv);
+  }
+}
+
+bool Fdcanusb::ParseReceive(const char* line, BusFrame* frame) const {
+  // rcv <id> <data> [flags]
+  const char* ptr = line + 4;
+  uint32_t id = 0;
+  int digits = 0;
+  for (; HexValue(*ptr) >= 0; ptr++, digits++) {
+    id = (id << 4) | HexValue(*ptr);
+  }
+  if (digits == 0 || *ptr != ' ') return false;
+  ptr++;
+
+  frame->arbitration_id = static_cast<uint16_t>(id);
+  frame->frame.size = 0;
+  while (HexValue(ptr[0]) >= 0 && HexValue(ptr[1]) >= 0) {
+    if (frame->frame.size == sizeof(frame->frame.data)) return false;
+    frame->frame.data[frame->frame.size++] =
+        (HexValue(ptr[0]) << 4) | HexValue(ptr[1]);
+    ptr += 2;
+  }
+  return *ptr == 0 || *ptr == ' ';
+}
@@ -0,0 +1,96 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSFDCANUSB_H__
+#define MOTEUSFDCANUSB_H__
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Transport.h"
+
+using namespace std;
+
+// Owns the serial device of one fdcanusb adapter and speaks its line
+// protocol. A whole cycle of frames goes out with a single write, the
+// acknowledges and replies are then collected with buffered reads.
+//
+// The device is closed when the last owner goes away. Users sharing an
+// adapter must not drive it from several threads at once.
+class Fdcanusb : public Transport {
+ public:
+  explicit Fdcanusb(const string& dev_name);
+  ~Fdcanusb();
+
+  // Returns the transport already open for |dev_name| (after resolving
+  // symlinks), or opens it. Every servo handle and group on the same
+  // adapter thereby shares one device.
+  static shared_ptr<Fdcanusb> Open(const string& dev_name);
+
+  Fdcanusb(const Fdcanusb&) = delete;
+  Fdcanusb& operator=(const Fdcanusb&) = delete;
+
+  const string& dev_name() const override { return dev_name_; }
+
+  // Queues every frame into one "can send" write.
+  bool Send(const BusFrame* frames, size_t count, int timeout_us) override;
+
+  bool Receive(size_t acks, size_t expected, BusFrame* replies,
+               size_t max_replies, size_t* received,
+               int timeout_us) override;
+
+  // The OKs of urgent frames are skipped by the next Receive().
+  bool SendUrgent(const BusFrame* frames, size_t count) override;
+
+  // Appends every line sent and received to |path|, prefixed with its
+  // NowNs() time and > or <, for FitLatencyModel(). Urgent lines are
+  // marked ! instead of >, and "- flush" notes the input of a timed out
+  // cycle being dropped. An empty path stops the capture.
+  void SetCapture(const string& path);
+
+ private:
+  void Open();
+  // Returns the next complete line without its terminator, or nullptr
+  // if none arrived before |deadline_us|.
+  const char* ReadLine(int64_t deadline_us);
+  bool ParseReceive(const char* line, BusFrame* frame) const;
+  // Appends the "can send" lines of |frames| to |buffer|.
+  static void Format(const BusFrame* frames, size_t count, string* buffer);
+  // Appends the lines of |buffer| to the capture, if one is open.
+  void Capture(char direction, const string& buffer);
+  // Gives up after |timeout_us|, a negative one waits as long as it takes.
+  bool Write(const string& buffer, int64_t timeout_us);
+
+  const string dev_name_;
+  int fd_ = -1;
+  string tx_buffer_;
+  // held while writing, so urgent lines do not split a cycle's lines
+  mutex write_mutex_;
+  string urgent_buffer_;
+  // OKs of urgent frames not yet read
+  atomic<size_t> urgent_acks_{0};
+  char rx_buffer_[4096];
+  size_t rx_begin_ = 0;
+  size_t rx_end_ = 0;
+  // a cycle timed out, its late replies must not count for the next one
+  bool stale_ = false;
+  // urgent lines are captured from another thread
+  mutex capture_mutex_;
+  ofstream capture_;
+};
+
+#endif  // MOTEUSFDCANUSB_H__
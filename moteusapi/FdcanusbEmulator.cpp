@@ -0,0 +1,374 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "FdcanusbEmulator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <stdexcept>
+
+#include "Clock.h"
+#include "FrameLayout.h"
+
+using namespace mjbots::moteus;
+
+namespace {
+
+const char kHex[] = "0123456789abcdef";
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+size_t ResolutionSize(Resolution res) {
+  switch (res) {
+    case Resolution::kInt8:
+      return 1;
+    case Resolution::kInt16:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+string Hex(const CanFrame& frame) {
+  string result;
+  for (int ii = 0; ii < frame.size; ii++) {
+    result.push_back(kHex[frame.data[ii] >> 4]);
+    result.push_back(kHex[frame.data[ii] & 0xf]);
+  }
+  return result;
+}
+
+// A register number, as a varuint. Returns the bytes it took, 0 if the
+// frame ends first.
+size_t ReadRegister(const CanFrame& frame, size_t offset, uint32_t* reg) {
+  *reg = 0;
+  for (size_t ii = 0; offset + ii < frame.size && ii < 5; ii++) {
+    const uint8_t byte = frame.data[offset + ii];
+    *reg |= static_cast<uint32_t>(byte & 0x7f) << (7 * ii);
+    if (!(byte & 0x80)) return ii + 1;
+  }
+  return 0;
+}
+
+void WriteValue(WriteCanFrame* writer, uint32_t reg, double value,
+                Resolution res) {
+  switch (static_cast<Register>(reg)) {
+    case Register::kPosition:
+      writer->WritePosition(value, res);
+      break;
+    case Register::kVelocity:
+      writer->WriteVelocity(value, res);
+      break;
+    case Register::kTorque:
+      writer->WriteTorque(value, res);
+      break;
+    case Register::kQCurrent:
+    case Register::kDCurrent:
+      writer->WriteMapped(value, 1.0, 0.1, 0.001, res);
+      break;
+    case Register::kVoltage:
+      writer->WriteVoltage(value, res);
+      break;
+    case Register::kTemperature:
+      writer->WriteTemperature(value, res);
+      break;
+    default:
+      writer->WriteMapped(value, 1.0, 1.0, 1.0, res);
+      break;
+  }
+}
+
+}  // namespace
+
+FdcanusbEmulator::FdcanusbEmulator(const string& link,
+                                   const LatencyModel& model,
+                                   unsigned int seed)
+    : link_(link), model_(model), rng_(seed), servos_(128) {
+  master_ = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master_ < 0 || grantpt(master_) < 0 || unlockpt(master_) < 0) {
+    if (master_ >= 0) close(master_);
+    throw std::runtime_error("FdcanusbEmulator: Unable to open a pty");
+  }
+  const string slave_name = ptsname(master_);
+
+  // held open, so the terminal outlives the clients and stays raw
+  slave_ = open(slave_name.c_str(), O_RDWR | O_NOCTTY);
+  struct termios toptions;
+  if (slave_ < 0 || tcgetattr(slave_, &toptions) < 0) {
+    if (slave_ >= 0) close(slave_);
+    close(master_);
+    throw std::runtime_error("FdcanusbEmulator: Unable to open " +
+                             slave_name);
+  }
+  cfmakeraw(&toptions);
+  tcsetattr(slave_, TCSANOW, &toptions);
+  fcntl(master_, F_SETFL, fcntl(master_, F_GETFL) | O_NONBLOCK);
+
+  unlink(link_.c_str());
+  if (symlink(slave_name.c_str(), link_.c_str()) < 0) {
+    close(slave_);
+    close(master_);
+    throw std::runtime_error("FdcanusbEmulator: Unable to create " + link_);
+  }
+
+  thread_ = thread(&FdcanusbEmulator::Run, this);
+}
+
+FdcanusbEmulator::~FdcanusbEmulator() {
+  done_ = true;
+  thread_.join();
+  unlink(link_.c_str());
+  close(slave_);
+  close(master_);
+}
+
+void FdcanusbEmulator::Run() {
+  string input;
+  // due, but not taken by the terminal yet
+  string output;
+  char buffer[4096];
+  while (!done_) {
+    // write what is due, then sleep until the next output or input
+    int64_t now = NowNs();
+    while (!outputs_.empty() && outputs_.top().due_ns <= now) {
+      output += outputs_.top().line;
+      outputs_.pop();
+    }
+    if (!output.empty()) {
+      const ssize_t n = write(master_, output.data(), output.size());
+      if (n > 0) {
+        output.erase(0, n);
+      } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        // nobody will read it
+        output.clear();
+      }
+    }
+
+    // at most 10 ms, to notice done_, and until there is room for the
+    // rest of the output when the client does not read
+    int64_t wait_ns = 10000000;
+    if (output.empty() && !outputs_.empty()) {
+      wait_ns = min(wait_ns, outputs_.top().due_ns - now);
+    }
+    fd_set readfds, writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    FD_SET(master_, &readfds);
+    if (!output.empty()) FD_SET(master_, &writefds);
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = max<int64_t>(0, wait_ns / 1000);
+    if (select(master_ + 1, &readfds, &writefds, nullptr, &tv) <= 0 ||
+        !FD_ISSET(master_, &readfds)) {
+      continue;
+    }
+
+    const ssize_t n = read(master_, buffer, sizeof(buffer));
+    if (n <= 0) continue;
+    now = NowNs();
+    input.append(buffer, n);
+    size_t begin = 0;
+    size_t newline;
+    while ((newline = input.find('\n', begin)) != string::npos) {
+      HandleLine(input.substr(begin, newline - begin), now);
+      begin = newline + 1;
+    }
+    input.erase(0, begin);
+  }
+}
+
+void FdcanusbEmulator::HandleLine(const string& line, int64_t now_ns) {
+  // can send <id> <data> [flags]
+  const char* ptr = line.c_str();
+  if (strncmp(ptr, "can send ", 9) != 0) {
+    if (!line.empty() && line != "\r") Queue(now_ns, "OK\r\n");
+    return;
+  }
+  ptr += 9;
+  uint32_t id = 0;
+  for (; HexValue(*ptr) >= 0; ptr++) id = (id << 4) | HexValue(*ptr);
+  if (*ptr == ' ') ptr++;
+  CanFrame frame;
+  while (HexValue(ptr[0]) >= 0 && HexValue(ptr[1]) >= 0 &&
+         frame.size < sizeof(frame.data)) {
+    frame.data[frame.size++] = (HexValue(ptr[0]) << 4) | HexValue(ptr[1]);
+    ptr += 2;
+  }
+  frames_++;
+
+  // frames are sent on the bus one after the other, so a frame waits
+  // for the ones queued before it
+  if (last_ack_ns_ <= now_ns) queued_bytes_ = 0;
+  queued_bytes_ += frame.size;
+  const int64_t ack_ns =
+      max<int64_t>(last_ack_ns_,
+                   now_ns + llround(model_.ack.Sample(queued_bytes_, rng_) *
+                                    1e3));
+  last_ack_ns_ = ack_ns;
+  Queue(ack_ns, "OK\r\n");
+
+  CanFrame reply;
+  Execute(frame, &servos_[id & 0x7f], &reply);
+  if (!(id & 0x8000) || reply.size == 0) return;
+  PadFrame(&reply);
+  const int64_t reply_ns =
+      ack_ns + llround(model_.reply.Sample(reply.size, rng_) * 1e3);
+  char reply_id[8];
+  snprintf(reply_id, sizeof(reply_id), "%x", (id & 0x7f) << 8);
+  Queue(reply_ns, string("rcv ") + reply_id + " " + Hex(reply) + "\r\n");
+}
+
+void FdcanusbEmulator::Execute(const CanFrame& frame, Servo* servo,
+                               CanFrame* reply) const {
+  static const Resolution kResolutions[] = {
+      Resolution::kInt8, Resolution::kInt16, Resolution::kInt32,
+      Resolution::kFloat};
+
+  // a velocity alone moves the servo between frames
+  const int64_t now_ns = NowNs();
+  if (servo->mode == Mode::kPosition && servo->updated_ns != 0) {
+    servo->position += servo->velocity * (now_ns - servo->updated_ns) * 1e-9;
+  }
+  servo->updated_ns = now_ns;
+
+  double command[3] = {NAN, NAN, NAN};  // position, velocity, torque
+  double bounds[2] = {NAN, NAN};
+  WriteCanFrame writer(reply);
+  // set once a read no longer fits the reply, the later ones are dropped
+  // as a whole and the writes still executed
+  bool truncated = false;
+
+  size_t offset = 0;
+  while (offset < frame.size) {
+    const uint8_t cmd = frame.data[offset++];
+    if (cmd == Multiplex::kNop) continue;
+    if (cmd >= 0x20) break;
+    const bool write = cmd < 0x10;
+    const Resolution res = kResolutions[(cmd >> 2) & 0x03];
+    size_t count = cmd & 0x03;
+    if (count == 0) {
+      if (offset >= frame.size) break;
+      count = frame.data[offset++];
+    }
+    uint32_t reg = 0;
+    const size_t reg_size = ReadRegister(frame, offset, &reg);
+    if (reg_size == 0) break;
+
+    if (!write) {
+      const size_t size = 1 + ((cmd & 0x03) == 0 ? 1 : 0) + reg_size +
+                          count * ResolutionSize(res);
+      if (reply->size + size > sizeof(reply->data)) truncated = true;
+    }
+    if (!write && !truncated) {
+      // the reply repeats the header, with the values after it
+      writer.Write<uint8_t>(0x20 | (cmd & 0x0f));
+      if ((cmd & 0x03) == 0) writer.Write<uint8_t>(count);
+      for (size_t ii = 0; ii < reg_size; ii++) {
+        writer.Write<uint8_t>(frame.data[offset + ii]);
+      }
+    }
+    offset += reg_size;
+
+    for (size_t ii = 0; ii < count; ii++, reg++) {
+      if (write) {
+        if (offset + ResolutionSize(res) > frame.size) return;
+        MultiplexParser parser(frame.data + offset, frame.size - offset);
+        switch (static_cast<Register>(reg)) {
+          case Register::kMode:
+            servo->mode = static_cast<Mode>(parser.ReadInt(res));
+            break;
+          case Register::kCommandPosition:
+            command[0] = parser.ReadPosition(res);
+            break;
+          case Register::kCommandVelocity:
+            command[1] = parser.ReadVelocity(res);
+            break;
+          case Register::kCommandFeedforwardTorque:
+          case Register::kStayWithinFeedforward:
+            command[2] = parser.ReadTorque(res);
+            break;
+          case Register::kStayWithinLower:
+          case Register::kStayWithinUpper:
+            bounds[reg - Register::kStayWithinLower] =
+                parser.ReadPosition(res);
+            break;
+          default:
+            break;
+        }
+        offset += ResolutionSize(res);
+        continue;
+      }
+      if (truncated) continue;
+
+      double value = 0;
+      switch (static_cast<Register>(reg)) {
+        case Register::kMode:
+          value = static_cast<int>(servo->mode);
+          break;
+        case Register::kPosition:
+          value = servo->position;
+          break;
+        case Register::kVelocity:
+          value = servo->velocity;
+          break;
+        case Register::kTorque:
+          value = servo->torque;
+          break;
+        case Register::kVoltage:
+          value = 24;
+          break;
+        case Register::kTemperature:
+          value = 30;
+          break;
+        default:
+          break;
+      }
+      WriteValue(&writer, reg, value, res);
+    }
+  }
+
+  switch (servo->mode) {
+    case Mode::kPosition:
+      if (std::isfinite(command[0])) servo->position = command[0];
+      servo->velocity = std::isfinite(command[1]) ? command[1] : 0;
+      servo->torque = std::isfinite(command[2]) ? command[2] : 0;
+      break;
+    case Mode::kStayWithinBounds:
+      if (servo->position < bounds[0]) servo->position = bounds[0];
+      if (servo->position > bounds[1]) servo->position = bounds[1];
+      servo->velocity = 0;
+      servo->torque = std::isfinite(command[2]) ? command[2] : 0;
+      break;
+    default:
+      servo->velocity = 0;
+      servo->torque = 0;
+      break;
+  }
+}
+
+void FdcanusbEmulator::Queue(int64_t due_ns, const string& line) {
+  outputs_.push({due_ns, order_++, line});
+}
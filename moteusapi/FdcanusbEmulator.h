@@ -0,0 +1,102 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSFDCANUSBEMULATOR_H__
+#define MOTEUSFDCANUSBEMULATOR_H__
+
+#include <atomic>
+#include <cstdint>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LatencyModel.h"
+#include "moteus_protocol.h"
+
+using namespace std;
+
+// An fdcanusb with servos behind it, on a pseudo terminal, for running
+// controllers and benchmarks without hardware. |link| becomes a symlink
+// to the terminal, use it as the device of an adapter.
+//
+// Every servo id answers. Its model is just rich enough for plausible
+// replies: a position command puts it at the commanded position, or
+// moves it at the commanded velocity if there is none, a stay within
+// command clamps it to the bounds, a stop stops it. Replies carry the
+// registers the command queried, at the queried resolutions.
+//
+// OKs and replies are delayed by |model|, e.g. FitLatencyModel() of a
+// capture of the real adapter, and keep their order.
+class FdcanusbEmulator {
+ public:
+  FdcanusbEmulator(const string& link, const LatencyModel& model = {},
+                   unsigned int seed = 1);
+  ~FdcanusbEmulator();
+
+  FdcanusbEmulator(const FdcanusbEmulator&) = delete;
+  FdcanusbEmulator& operator=(const FdcanusbEmulator&) = delete;
+
+  const string& link() const { return link_; }
+  // frames received so far
+  uint64_t frames() const { return frames_; }
+
+ private:
+  struct Servo {
+    mjbots::moteus::Mode mode = mjbots::moteus::Mode::kStopped;
+    double position = 0;
+    double velocity = 0;
+    double torque = 0;
+    // NowNs() of the latest frame
+    int64_t updated_ns = 0;
+  };
+
+  struct Output {
+    int64_t due_ns;
+    uint64_t order;
+    string line;
+    bool operator>(const Output& rhs) const {
+      return due_ns != rhs.due_ns ? due_ns > rhs.due_ns : order > rhs.order;
+    }
+  };
+
+  void Run();
+  void HandleLine(const string& line, int64_t now_ns);
+  // Applies the writes of |frame| to |servo| and fills |reply| with the
+  // registers it reads.
+  void Execute(const mjbots::moteus::CanFrame& frame, Servo* servo,
+               mjbots::moteus::CanFrame* reply) const;
+  void Queue(int64_t due_ns, const string& line);
+
+  const string link_;
+  const LatencyModel model_;
+  mt19937 rng_;
+  int master_ = -1;
+  int slave_ = -1;
+  atomic<bool> done_{false};
+  atomic<uint64_t> frames_{0};
+
+  vector<Servo> servos_;
+  priority_queue<Output, vector<Output>, greater<Output>> outputs_;
+  uint64_t order_ = 0;
+  // OK time of the latest frame and the command bytes not yet sent on
+  // the bus at that time
+  int64_t last_ack_ns_ = 0;
+  size_t queued_bytes_ = 0;
+
+  thread thread_;
+};
+
+#endif  // MOTEUSFDCANUSBEMULATOR_H__
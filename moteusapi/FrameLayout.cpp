@@ -0,0 +1,318 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "FrameLayout.h"
+
+#include <stdexcept>
+
+using namespace mjbots::moteus;
+
+namespace {
+
+void WriteScaled(WriteCanFrame* writer, FieldScale scale, Resolution res,
+                 double value) {
+  switch (scale) {
+    case FieldScale::kPosition:
+      writer->WritePosition(value, res);
+      break;
+    case FieldScale::kVelocity:
+      writer->WriteVelocity(value, res);
+      break;
+    case FieldScale::kTorque:
+      writer->WriteTorque(value, res);
+      break;
+    case FieldScale::kPwm:
+      writer->WritePwm(value, res);
+      break;
+    case FieldScale::kTime:
+      writer->WriteTime(value, res);
+      break;
+  }
+}
+
+FrameLayout MakeLayout(
+    Mode mode, Register start_register,
+    const std::array<Resolution, FrameLayout::kFields>& res,
+    const std::array<FieldScale, FrameLayout::kFields>& scale,
+    const QueryCommand& query) {
+  FrameLayout layout;
+  WriteCanFrame writer(&layout.frame);
+  writer.Write<int8_t>(Multiplex::kWriteInt8 | 0x01);
+  writer.Write<int8_t>(Register::kMode);
+  writer.Write<int8_t>(mode);
+
+  {
+    WriteCombiner<FrameLayout::kFields> combiner(&writer, 0x00, start_register,
+                                                 res);
+    for (int ii = 0; ii < FrameLayout::kFields; ii++) {
+      layout.resolution[ii] = res[ii];
+      layout.scale[ii] = scale[ii];
+      if (combiner.MaybeWrite()) {
+        layout.offset[ii] = layout.frame.size;
+        WriteScaled(&writer, scale[ii], res[ii], 0.0);
+      }
+    }
+  }
+
+  EmitQueryCommand(&writer, query);
+  PadFrame(&layout.frame);
+  return layout;
+}
+
+void EncodeFields(const FrameLayout& layout,
+                  const double (&values)[FrameLayout::kFields],
+                  CanFrame* frame) {
+  *frame = layout.frame;
+  for (int ii = 0; ii < FrameLayout::kFields; ii++) {
+    if (layout.resolution[ii] == Resolution::kIgnore) continue;
+    WriteField(frame, layout.offset[ii], layout.scale[ii],
+               layout.resolution[ii], values[ii]);
+  }
+}
+
+}  // namespace
+
+FrameLayout MakePositionLayout(const PositionResolution& resolution,
+                               const QueryCommand& query) {
+  return MakeLayout(Mode::kPosition, Register::kCommandPosition,
+                    {
+                        resolution.position,
+                        resolution.velocity,
+                        resolution.feedforward_torque,
+                        resolution.kp_scale,
+                        resolution.kd_scale,
+                        resolution.maximum_torque,
+                        resolution.stop_position,
+                        resolution.watchdog_timeout,
+                    },
+                    {
+                        FieldScale::kPosition,
+                        FieldScale::kVelocity,
+                        FieldScale::kTorque,
+                        FieldScale::kPwm,
+                        FieldScale::kPwm,
+                        FieldScale::kTorque,
+                        FieldScale::kPosition,
+                        FieldScale::kTime,
+                    },
+                    query);
+}
+
+FrameLayout MakeWithinLayout(const WithinResolution& resolution,
+                             const QueryCommand& query) {
+  return MakeLayout(Mode::kStayWithinBounds, Register::kStayWithinLower,
+                    {
+                        resolution.bounds_min,
+                        resolution.bounds_max,
+                        resolution.feedforward_torque,
+                        resolution.kp_scale,
+                        resolution.kd_scale,
+                        resolution.maximum_torque,
+                        resolution.watchdog_timeout,
+                        Resolution::kIgnore,
+                    },
+                    {
+                        FieldScale::kPosition,
+                        FieldScale::kPosition,
+                        FieldScale::kTorque,
+                        FieldScale::kPwm,
+                        FieldScale::kPwm,
+                        FieldScale::kTorque,
+                        FieldScale::kTime,
+                        FieldScale::kTime,
+                    },
+                    query);
+}
+
+CanFrame MakeStopFrame(const QueryCommand& query) {
+  CanFrame frame;
+  WriteCanFrame writer(&frame);
+  EmitStopCommand(&writer);
+  EmitQueryCommand(&writer, query);
+  PadFrame(&frame);
+  return frame;
+}
+
+CanFrame MakeQueryFrame(const QueryCommand& query) {
+  CanFrame frame;
+  WriteCanFrame writer(&frame);
+  EmitQueryCommand(&writer, query);
+  PadFrame(&frame);
+  return frame;
+}
+
+void EncodePositionCommand(const FrameLayout& layout,
+                           const PositionCommand& command, CanFrame* frame) {
+  const double values[FrameLayout::kFields] = {
+      command.position, command.velocity,       command.feedforward_torque,
+      command.kp_scale, command.kd_scale,       command.maximum_torque,
+      command.stop_position, command.watchdog_timeout,
+  };
+  EncodeFields(layout, values, frame);
+}
+
+void EncodeWithinCommand(const FrameLayout& layout,
+                         const WithinCommand& command, CanFrame* frame) {
+  const double values[FrameLayout::kFields] = {
+      command.bounds_min, command.bounds_max, command.feedforward_torque,
+      command.kp_scale,   command.kd_scale,   command.maximum_torque,
+      command.watchdog_timeout, 0.0,
+  };
+  EncodeFields(layout, values, frame);
+}
+
+bool DecodeCommandFrame(const CanFrame& frame, DecodedCommand* command) {
+  static const Resolution kResolutions[] = {
+      Resolution::kInt8, Resolution::kInt16, Resolution::kInt32,
+      Resolution::kFloat};
+  using Kind = DecodedCommand::Kind;
+
+  *command = DecodedCommand();
+  // registers of the position and stay within modes written so far
+  bool position = false;
+  bool within = false;
+  size_t offset = 0;
+  while (offset < frame.size) {
+    const uint8_t cmd = frame.data[offset++];
+    if (cmd == Multiplex::kNop) continue;
+    if (cmd >= 0x20) return false;
+    const bool write = cmd < 0x10;
+    const Resolution res = kResolutions[(cmd >> 2) & 0x03];
+    size_t count = cmd & 0x03;
+    if (count == 0) {
+      if (offset >= frame.size) return false;
+      count = frame.data[offset++];
+    }
+
+    // the register number is a varuint
+    uint32_t reg = 0;
+    for (int shift = 0;; shift += 7) {
+      if (offset >= frame.size || shift > 28) return false;
+      const uint8_t byte = frame.data[offset++];
+      reg |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) break;
+    }
+    if (!write) continue;
+
+    const size_t size = res == Resolution::kInt8    ? 1
+                        : res == Resolution::kInt16 ? 2
+                                                    : 4;
+    for (size_t ii = 0; ii < count; ii++, reg++) {
+      if (offset + size > frame.size) return false;
+      MultiplexParser parser(frame.data + offset, frame.size - offset);
+      offset += size;
+      auto& p = command->position;
+      auto& w = command->within;
+      switch (static_cast<Register>(reg)) {
+        case Register::kMode: {
+          const Mode mode = static_cast<Mode>(parser.ReadInt(res));
+          if (mode == Mode::kStopped) {
+            command->kind = Kind::kStop;
+          } else if (mode == Mode::kPosition) {
+            command->kind = Kind::kPosition;
+          } else if (mode == Mode::kStayWithinBounds) {
+            command->kind = Kind::kWithin;
+          } else {
+            return false;
+          }
+          break;
+        }
+        case Register::kCommandPosition:
+          p.position = parser.ReadPosition(res);
+          position = true;
+          break;
+        case Register::kCommandVelocity:
+          p.velocity = parser.ReadVelocity(res);
+          position = true;
+          break;
+        case Register::kCommandFeedforwardTorque:
+          p.feedforward_torque = parser.ReadTorque(res);
+          position = true;
+          break;
+        case Register::kCommandKpScale:
+          p.kp_scale = parser.ReadPwm(res);
+          position = true;
+          break;
+        case Register::kCommandKdScale:
+          p.kd_scale = parser.ReadPwm(res);
+          position = true;
+          break;
+        case Register::kCommandPositionMaxTorque:
+          p.maximum_torque = parser.ReadTorque(res);
+          position = true;
+          break;
+        case Register::kCommandStopPosition:
+          p.stop_position = parser.ReadPosition(res);
+          position = true;
+          break;
+        case Register::kCommandTimeout:
+          p.watchdog_timeout = parser.ReadTime(res);
+          position = true;
+          break;
+        case Register::kStayWithinLower:
+          w.bounds_min = parser.ReadPosition(res);
+          within = true;
+          break;
+        case Register::kStayWithinUpper:
+          w.bounds_max = parser.ReadPosition(res);
+          within = true;
+          break;
+        case Register::kStayWithinFeedforward:
+          w.feedforward_torque = parser.ReadTorque(res);
+          within = true;
+          break;
+        case Register::kStayWithinKpScale:
+          w.kp_scale = parser.ReadPwm(res);
+          within = true;
+          break;
+        case Register::kStayWithinKdScale:
+          w.kd_scale = parser.ReadPwm(res);
+          within = true;
+          break;
+        case Register::kStayWithinMaxTorque:
+          w.maximum_torque = parser.ReadTorque(res);
+          within = true;
+          break;
+        case Register::kStayWithinTimeout:
+          w.watchdog_timeout = parser.ReadTime(res);
+          within = true;
+          break;
+        default:
+          return false;
+      }
+    }
+  }
+
+  if (position && command->kind != Kind::kPosition) return false;
+  if (within && command->kind != Kind::kWithin) return false;
+  return true;
+}
+
+void WriteField(CanFrame* frame, uint8_t offset, FieldScale scale,
+                Resolution res, double value) {
+  uint8_t size = offset;
+  WriteCanFrame writer(frame->data, &size);
+  WriteScaled(&writer, scale, res, value);
+}
+
+void PadFrame(CanFrame* frame) {
+  static const uint8_t kLengths[] = {0,  1,  2,  3,  4,  5,  6,  7,
+                                     8,  12, 16, 20, 24, 32, 48, 64};
+  for (const auto length : kLengths) {
+    if (length < frame->size) continue;
+    while (frame->size < length) frame->data[frame->size++] = Multiplex::kNop;
+    return;
+  }
+  throw std::runtime_error("overflow");
+}
@@ -0,0 +1,93 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSFRAMELAYOUT_H__
+#define MOTEUSFRAMELAYOUT_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#include "moteus_protocol.h"
+
+// How a command field is scaled when written at integer resolution.
+enum class FieldScale : uint8_t {
+  kPosition,
+  kVelocity,
+  kTorque,
+  kPwm,
+  kTime,
+};
+
+// Byte layout of a command frame. The register headers, the trailing
+// query and the padding only depend on the resolutions, so they are
+// computed once and encoding a command only writes the values at their
+// offsets.
+struct FrameLayout {
+  static const int kFields = 8;
+
+  // template with every value zeroed
+  mjbots::moteus::CanFrame frame;
+  uint8_t offset[kFields] = {};
+  mjbots::moteus::Resolution resolution[kFields];
+  FieldScale scale[kFields];
+};
+
+FrameLayout MakePositionLayout(
+    const mjbots::moteus::PositionResolution& resolution,
+    const mjbots::moteus::QueryCommand& query);
+
+// Stay within mode. Only the first seven fields are used, there is no
+// stop position register in this mode.
+FrameLayout MakeWithinLayout(
+    const mjbots::moteus::WithinResolution& resolution,
+    const mjbots::moteus::QueryCommand& query);
+
+mjbots::moteus::CanFrame MakeStopFrame(
+    const mjbots::moteus::QueryCommand& query);
+mjbots::moteus::CanFrame MakeQueryFrame(
+    const mjbots::moteus::QueryCommand& query);
+
+void EncodePositionCommand(const FrameLayout& layout,
+                           const mjbots::moteus::PositionCommand& command,
+                           mjbots::moteus::CanFrame* frame);
+void EncodeWithinCommand(const FrameLayout& layout,
+                         const mjbots::moteus::WithinCommand& command,
+                         mjbots::moteus::CanFrame* frame);
+
+// A command frame read back into the command it carries.
+struct DecodedCommand {
+  enum class Kind { kNone, kStop, kPosition, kWithin };
+
+  // kNone for frames that only query
+  Kind kind = Kind::kNone;
+  // fields missing from the frame keep their defaults
+  mjbots::moteus::PositionCommand position;
+  mjbots::moteus::WithinCommand within;
+};
+
+// Decodes a frame built by the functions above or the Emit*Command()
+// ones. Returns false for malformed frames and for frames writing
+// anything but the mode and the registers of the mode they select.
+bool DecodeCommandFrame(const mjbots::moteus::CanFrame& frame,
+                        DecodedCommand* command);
+
+// Writes |value| at |offset| without touching the rest of the frame.
+void WriteField(mjbots::moteus::CanFrame* frame, uint8_t offset,
+                FieldScale scale, mjbots::moteus::Resolution res,
+                double value);
+
+// Pads the frame with NOPs up to the next valid CAN-FD length.
+void PadFrame(mjbots::moteus::CanFrame* frame);
+
+#endif  // MOTEUSFRAMELAYOUT_H__
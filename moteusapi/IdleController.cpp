@@ -0,0 +1,83 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "IdleController.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <stdexcept>
+
+#include "Clock.h"
+
+IdleController::IdleController(LoopRunner& runner, MoteusGroup& group,
+                               double idle_after_s, double idle_rate_hz)
+    : runner_(runner),
+      group_(group),
+      idle_after_ns_(llround(idle_after_s * 1e9)),
+      idle_rate_hz_(idle_rate_hz),
+      changes_(group.changes()),
+      last_change_ns_(NowNs()) {
+  if (!(idle_after_ns_ >= 0) || !(idle_rate_hz_ > 0)) {
+    throw std::runtime_error("IdleController: invalid configuration");
+  }
+}
+
+void IdleController::Update() {
+  const int64_t now = NowNs();
+  // a Wake() from another thread already put the runner back to full rate
+  const bool woken = idle_ && runner_.idle_divisor() == 1;
+  if (group_.changes() != changes_ || woken) {
+    changes_ = group_.changes();
+    last_change_ns_ = now;
+    if (idle_) Leave();
+    return;
+  }
+  if (!idle_ && now - last_change_ns_ >= idle_after_ns_) Enter();
+  // a reconfiguration may have shortened a watchdog meanwhile
+  if (idle_ && Divisor() < runner_.idle_divisor()) Enter();
+}
+
+int IdleController::Divisor() const {
+  double interval = 1.0 / idle_rate_hz_;
+  for (size_t ii = 0; ii < group_.size(); ii++) {
+    interval = std::min(interval, group_.max_frame_interval(ii));
+  }
+  const double period_s = runner_.period_ns() * 1e-9;
+  int divisor =
+      static_cast<int>(std::min<double>(std::floor(interval / period_s),
+                                        INT_MAX));
+  // every servo gets a frame per idle period, which must not outlast
+  // half of any watchdog timeout
+  while (divisor > 1 && divisor * period_s > interval) divisor--;
+  return std::max(divisor, 1);
+}
+
+void IdleController::Enter() {
+  const int divisor = Divisor();
+  // nothing to gain when a watchdog needs the full rate
+  if (divisor <= 1) {
+    if (idle_) Leave();
+    return;
+  }
+  idle_ = true;
+  group_.SetIdle(true);
+  runner_.SetIdleDivisor(divisor);
+}
+
+void IdleController::Leave() {
+  idle_ = false;
+  group_.SetIdle(false);
+  runner_.SetIdleDivisor(1);
+}
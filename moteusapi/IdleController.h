@@ -0,0 +1,62 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSIDLECONTROLLER_H__
+#define MOTEUSIDLECONTROLLER_H__
+
+#include <cstdint>
+
+#include "LoopRunner.h"
+#include "MoteusGroup.h"
+
+using namespace std;
+
+// Slows a control loop down while no command changes. After
+// |idle_after_s| without a changed command, the runner only calls back
+// at about |idle_rate_hz| and the group sends every servo a frame on
+// each of those calls, so the watchdogs stay fed. The idle rate is
+// raised where a watchdog needs it, the servo's default one included,
+// and again when a watchdog gets shorter while idle.
+//
+// A changed command ends idle mode on the tick it is set on; input from
+// other threads should call LoopRunner::Wake() so the loop picks it up
+// on the next full rate tick.
+class IdleController {
+ public:
+  IdleController(LoopRunner& runner, MoteusGroup& group,
+                 double idle_after_s = 5.0, double idle_rate_hz = 20.0);
+
+  // Call from the loop callback after the commands of the tick are set
+  // and before Cycle().
+  void Update();
+
+  bool idle() const { return idle_; }
+
+ private:
+  // The idle divisor of the runner's period that keeps every watchdog
+  // fed at |idle_rate_hz| or faster.
+  int Divisor() const;
+  void Enter();
+  void Leave();
+
+  LoopRunner& runner_;
+  MoteusGroup& group_;
+  const int64_t idle_after_ns_;
+  const double idle_rate_hz_;
+  bool idle_ = false;
+  int64_t changes_ = 0;
+  int64_t last_change_ns_ = 0;
+};
+
+#endif  // MOTEUSIDLECONTROLLER_H__
@@ -0,0 +1,177 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "LatencyModel.h"
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// the jitter of a fit keeps at most this many residuals
+const size_t kJitterSamples = 1000;
+
+struct Sample {
+  double bytes;
+  double delay_us;
+};
+
+DelayModel Fit(const vector<Sample>& samples, const string& what) {
+  if (samples.size() < 2) {
+    throw std::runtime_error("LatencyModel: too few " + what +
+                             " in the capture");
+  }
+
+  double mean_x = 0, mean_y = 0;
+  for (const auto& sample : samples) {
+    mean_x += sample.bytes;
+    mean_y += sample.delay_us;
+  }
+  mean_x /= samples.size();
+  mean_y /= samples.size();
+  double cov = 0, var = 0;
+  for (const auto& sample : samples) {
+    cov += (sample.bytes - mean_x) * (sample.delay_us - mean_y);
+    var += (sample.bytes - mean_x) * (sample.bytes - mean_x);
+  }
+
+  DelayModel model;
+  // all of one size, or a bus that gets faster with more bytes: a
+  // constant delay
+  model.byte_us = var > 0 ? max(0.0, cov / var) : 0;
+  model.base_us = mean_y - model.byte_us * mean_x;
+
+  vector<double> residuals;
+  for (const auto& sample : samples) {
+    residuals.push_back(sample.delay_us - model.base_us -
+                        model.byte_us * sample.bytes);
+  }
+  sort(residuals.begin(), residuals.end());
+  const size_t count = min(residuals.size(), kJitterSamples);
+  for (size_t ii = 0; ii < count; ii++) {
+    model.jitter_us.push_back(residuals[ii * residuals.size() / count]);
+  }
+  return model;
+}
+
+// <time> > can send <id> <data>  or  <time> < OK | rcv <id> <data> ...
+// Urgent frames are sent with ! instead of >, <time> - flush drops the
+// input of a timed out cycle.
+bool ParseLine(const string& line, int64_t* ns, char* direction,
+               string* word, unsigned int* id, size_t* bytes) {
+  istringstream in(line);
+  string hex;
+  if (!(in >> *ns >> *direction >> *word)) return false;
+  if (*direction == '>' || *direction == '!') {
+    string send;
+    if (!(in >> send >> std::hex >> *id >> hex) || send != "send") {
+      return false;
+    }
+  } else if (*word == "rcv") {
+    if (!(in >> std::hex >> *id >> hex)) return false;
+  }
+  *bytes = hex.size() / 2;
+  return true;
+}
+
+}  // namespace
+
+double DelayModel::Sample(double bytes, mt19937& rng) const {
+  double delay = base_us + byte_us * bytes;
+  if (!jitter_us.empty()) {
+    uniform_int_distribution<size_t> pick(0, jitter_us.size() - 1);
+    delay += jitter_us[pick(rng)];
+  }
+  return max(0.0, delay);
+}
+
+LatencyModel FitLatencyModel(const string& capture_path) {
+  ifstream in(capture_path);
+  if (!in) {
+    throw std::runtime_error("LatencyModel: Unable to open " + capture_path);
+  }
+
+  struct Pending {
+    int64_t sent_ns;
+    size_t queued_bytes;
+    unsigned int id;
+    // its OK is not a sample
+    bool urgent;
+  };
+  deque<Pending> pending;
+  size_t queued_bytes = 0;
+  // OK time of the frames waiting for a reply, by servo
+  map<int, int64_t> acked;
+  vector<Sample> acks, replies;
+
+  string line;
+  while (getline(in, line)) {
+    int64_t ns;
+    char direction;
+    string word;
+    unsigned int id = 0;
+    size_t bytes = 0;
+    if (!ParseLine(line, &ns, &direction, &word, &id, &bytes)) continue;
+
+    if (direction == '-') {
+      // the OKs and replies still due were flushed
+      pending.clear();
+      acked.clear();
+    } else if (direction == '>' || direction == '!') {
+      // frames queue up behind the ones the adapter has not sent yet,
+      // urgent ones too, but those are sent by another thread at any
+      // time and their delays say nothing about a cycle
+      if (pending.empty()) queued_bytes = 0;
+      queued_bytes += bytes;
+      pending.push_back({ns, queued_bytes, id, direction == '!'});
+    } else if (word == "OK" || word == "ERR") {
+      // the capture started in the middle of a cycle
+      if (pending.empty()) continue;
+      const Pending frame = pending.front();
+      pending.pop_front();
+      if (word == "ERR" || frame.urgent) continue;
+      acks.push_back(
+          {double(frame.queued_bytes), (ns - frame.sent_ns) / 1e3});
+      if (frame.id & 0x8000) acked[frame.id & 0x7f] = ns;
+    } else if (word == "rcv") {
+      const auto it = acked.find((id >> 8) & 0x7f);
+      if (it == acked.end()) continue;
+      replies.push_back({double(bytes), (ns - it->second) / 1e3});
+      acked.erase(it);
+    }
+  }
+
+  LatencyModel model;
+  model.ack = Fit(acks, "acknowledged frames");
+  model.reply = Fit(replies, "replies");
+  return model;
+}
+
+void PrintLatencyModel(ostream& os, const LatencyModel& model) {
+  auto print = [&](const char* name, const DelayModel& delay) {
+    os << name << ": " << delay.base_us << " us + " << delay.byte_us
+       << " us/byte";
+    if (!delay.jitter_us.empty()) {
+      os << ", jitter " << delay.jitter_us.front() << " to "
+         << delay.jitter_us.back() << " us";
+    }
+    os << "\n";
+  };
+  print("ack", model.ack);
+  print("reply", model.reply);
+}
@@ -0,0 +1,55 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSLATENCYMODEL_H__
+#define MOTEUSLATENCYMODEL_H__
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A delay growing linearly with a number of bytes, plus jitter drawn
+// from the residuals of the fit.
+struct DelayModel {
+  double base_us = 0;
+  double byte_us = 0;
+  // sorted, empty for none
+  vector<double> jitter_us;
+
+  // never negative
+  double Sample(double bytes, mt19937& rng) const;
+};
+
+// How an fdcanusb and the servos behind it answer, seen from the host.
+// The default answers instantly.
+struct LatencyModel {
+  // From the write of a cycle to the OK of a frame, over the command
+  // bytes of the cycle up to that frame: USB out and the bus.
+  DelayModel ack;
+  // From the OK of a frame to its reply, over the reply bytes: the
+  // servo, the bus and USB in.
+  DelayModel reply;
+};
+
+// Fits a model to a capture written by Fdcanusb::SetCapture(). Throws
+// std::runtime_error if the capture holds too few acknowledged frames
+// or replies.
+LatencyModel FitLatencyModel(const string& capture_path);
+
+void PrintLatencyModel(ostream& os, const LatencyModel& model);
+
+#endif  // MOTEUSLATENCYMODEL_H__
@@ -0,0 +1,98 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "LoopRunner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+
+#include "Clock.h"
+
+namespace {
+
+int64_t PeriodNs(double rate_hz) {
+  if (!(rate_hz > 0)) {
+    throw std::runtime_error("LoopRunner: rate_hz must be positive");
+  }
+  return static_cast<int64_t>(1e9 / rate_hz);
+}
+
+}  // namespace
+
+LoopRunner::LoopRunner(double rate_hz) : period_ns_(PeriodNs(rate_hz)) {}
+
+void LoopRunner::Stop() {
+  stop_ = true;
+  Wake();
+}
+
+void LoopRunner::SetIdleDivisor(int divisor) {
+  idle_divisor_ = std::max(1, divisor);
+}
+
+void LoopRunner::Wake() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    woken_ = true;
+  }
+  wake_cv_.notify_one();
+}
+
+void LoopRunner::Run(const function<bool(int64_t tick)>& callback) {
+  stop_ = false;
+  overruns_ = 0;
+  start_ns_ = NowNs();
+
+  int64_t tick = 0;
+  while (!stop_) {
+    if (!callback(tick)) break;
+
+    {
+      lock_guard<mutex> lock(mutex_);
+      if (woken_) idle_divisor_ = 1;
+      woken_ = false;
+    }
+    tick += idle_divisor_;
+    int64_t now = NowNs();
+    int64_t deadline = start_ns_ + tick * period_ns_;
+    if (now - deadline > period_ns_) {
+      const int64_t missed = (now - deadline) / period_ns_;
+      tick += missed;
+      overruns_ += missed;
+      deadline = start_ns_ + tick * period_ns_;
+    }
+    if (deadline <= now) continue;
+
+    if (idle_divisor_ == 1) {
+      this_thread::sleep_for(chrono::nanoseconds(deadline - now));
+      continue;
+    }
+    // idle, a Wake() moves the next call to the next full rate tick
+    unique_lock<mutex> lock(mutex_);
+    if (wake_cv_.wait_for(lock, chrono::nanoseconds(deadline - now),
+                          [this]() { return woken_; })) {
+      woken_ = false;
+      idle_divisor_ = 1;
+      now = NowNs();
+      tick = (now - start_ns_) / period_ns_ + 1;
+      deadline = start_ns_ + tick * period_ns_;
+      lock.unlock();
+      if (deadline > now) {
+        this_thread::sleep_for(chrono::nanoseconds(deadline - now));
+      }
+    }
+  }
+}
@@ -0,0 +1,66 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSLOOPRUNNER_H__
+#define MOTEUSLOOPRUNNER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+using namespace std;
+
+// Calls a function at a fixed rate. Deadlines are absolute (start + tick
+// * period), so the loop does not drift with the time spent in the
+// callback or with sleep jitter.
+class LoopRunner {
+ public:
+  explicit LoopRunner(double rate_hz);
+
+  // Runs |callback| with the tick number until it returns false or
+  // Stop() is called. When the loop falls more than a period behind, the
+  // missed ticks are skipped (the tick number jumps) and counted as
+  // overruns, so tick * period() stays aligned with the wall clock.
+  void Run(const function<bool(int64_t tick)>& callback);
+  // Safe to call from any thread.
+  void Stop();
+
+  // Idle mode: the callback only runs every |divisor|th tick, the tick
+  // numbers in between are skipped without counting as overruns. 1 is
+  // full rate. Meant to be called from the callback.
+  void SetIdleDivisor(int divisor);
+  int idle_divisor() const { return idle_divisor_; }
+  // Ends idle mode from any thread, the callback runs again on the next
+  // tick.
+  void Wake();
+
+  int64_t period_ns() const { return period_ns_; }
+  // NowNs() at the start of the last Run().
+  int64_t start_ns() const { return start_ns_; }
+  int64_t overruns() const { return overruns_; }
+
+ private:
+  const int64_t period_ns_;
+  atomic<bool> stop_{false};
+  atomic<int> idle_divisor_{1};
+  mutex mutex_;
+  condition_variable wake_cv_;
+  bool woken_ = false;
+  int64_t start_ns_ = 0;
+  int64_t overruns_ = 0;
+};
+
+#endif  // MOTEUSLOOPRUNNER_H__
@@ -14,20 +14,81 @@
 
 #include "MoteusAPI.h"
 
-#include <errno.h>   // Error number definitions
-#include <fcntl.h>   // File control definitions
-#include <stdio.h>   // Standard input/output definitions
-#include <string.h>  // String function definitions
-#include <sys/ioctl.h>
-#include <termios.h>  // POSIX terminal control definitions
-#include <unistd.h>   // UNIX standard function definitions
+#include "Clock.h"
+#include "FrameLayout.h"
+
+using mjbots::moteus::QueryCommand;
+using mjbots::moteus::QueryResult;
+using mjbots::moteus::Resolution;
+
+namespace {
+
+struct Field {
+  double State::*value;
+  bool State::*flag;
+  Resolution QueryCommand::*resolution;
+};
+
+const Field kFields[] = {
+    {&State::position, &State::position_flag, &QueryCommand::position},
+    {&State::velocity, &State::velocity_flag, &QueryCommand::velocity},
+    {&State::torque, &State::torque_flag, &QueryCommand::torque},
+    {&State::q_curr, &State::q_curr_flag, &QueryCommand::q_current},
+    {&State::d_curr, &State::d_curr_flag, &QueryCommand::d_current},
+    {&State::rezero_state, &State::rezero_state_flag,
+     &QueryCommand::rezero_state},
+    {&State::voltage, &State::voltage_flag, &QueryCommand::voltage},
+    {&State::temperature, &State::temperature_flag,
+     &QueryCommand::temperature},
+    {&State::fault, &State::fault_flag, &QueryCommand::fault},
+    {&State::mode, &State::mode_flag, &QueryCommand::mode},
+};
+
+double ResultValue(const QueryResult& qr, int field) {
+  switch (field) {
+    case 0:
+      return qr.position;
+    case 1:
+      return qr.velocity;
+    case 2:
+      return qr.torque;
+    case 3:
+      return qr.q_current;
+    case 4:
+      return qr.d_current;
+    case 5:
+      return qr.rezero_state;
+    case 6:
+      return qr.voltage;
+    case 7:
+      return qr.temperature;
+    case 8:
+      return qr.fault;
+    default:
+      return static_cast<double>(qr.mode);
+  }
+}
+
+// the default resolutions for the flagged fields, the others ignored
+QueryCommand QueryFor(const State& fields) {
+  QueryCommand query;
+  for (const auto& field : kFields) {
+    if (!(fields.*field.flag)) query.*field.resolution = Resolution::kIgnore;
+  }
+  return query;
+}
+
+}  // namespace
 
 MoteusAPI::MoteusAPI(const string dev_name, int moteus_id)
-    : dev_name_(dev_name), moteus_id_(moteus_id) {
-  OpenDev();
+    : MoteusAPI(Transport::Open(dev_name), moteus_id) {}
+
+MoteusAPI::MoteusAPI(shared_ptr<Transport> transport, int moteus_id)
+    : transport_(std::move(transport)), moteus_id_(moteus_id) {
+  if (!transport_) throw std::runtime_error("MoteusAPI: no transport");
 }
 
-MoteusAPI::~MoteusAPI() { CloseDev(); }
+MoteusAPI::~MoteusAPI() {}
 
 bool MoteusAPI::SendPositionCommand(double stop_position, double velocity,
                                     double max_torque,
@@ -48,25 +109,7 @@ bool MoteusAPI::SendPositionCommand(double stop_position, double velocity,
   mjbots::moteus::PositionResolution pres;
   mjbots::moteus::EmitPositionCommand(&write_frame, p_com, pres);
 
-  // Encode message to hex
-  stringstream ss;
-  ss << "can send 80" << std::setfill('0') << std::setw(2) << std::hex
-     << moteus_id_ << " ";
-  for (uint ii = 0; ii < (uint)frame.size; ii++) {
-    ss << std::setfill('0') << std::setw(2) << std::hex << (int)frame.data[ii];
-  }
-  ss << '\n';
-
-  if (!WriteDev(ss.str()))
-    throw std::runtime_error("Failiur: could not WriteDev.");
-
-  // process response
-  string resp;
-  if (!((ExpectResponse("OK", resp) && ExpectResponse("rcv", resp)))) {
-    return false;
-  }
-
-  return true;
+  return SendCommand(frame);
 }
 
 bool MoteusAPI::SendStopCommand() {
@@ -74,25 +117,7 @@ bool MoteusAPI::SendStopCommand() {
   mjbots::moteus::WriteCanFrame write_frame(&frame);
   mjbots::moteus::EmitStopCommand(&write_frame);
 
-  // Encode message to hex
-  stringstream ss;
-  ss << "can send 80" << std::setfill('0') << std::setw(2) << std::hex
-     << moteus_id_ << " ";
-  for (uint ii = 0; ii < (uint)frame.size; ii++) {
-    ss << std::setfill('0') << std::setw(2) << std::hex << (int)frame.data[ii];
-  }
-  ss << '\n';
-
-  if (!WriteDev(ss.str()))
-    throw std::runtime_error("Failiur: could not WriteDev.");
-
-  // process response
-  string resp;
-  if (!((ExpectResponse("OK", resp) && ExpectResponse("rcv", resp)))) {
-    return false;
-  }
-
-  return true;
+  return SendCommand(frame);
 }
 
 bool MoteusAPI::SendWithinCommand(double bounds_min, double bounds_max,
@@ -114,192 +139,87 @@ bool MoteusAPI::SendWithinCommand(double bounds_min, double bounds_max,
   mjbots::moteus::WithinResolution pres;
   mjbots::moteus::EmitWithinCommand(&write_frame, p_com, pres);
 
-  // Encode message to hex
-  stringstream ss;
-  ss << "can send 80" << std::setfill('0') << std::setw(2) << std::hex
-     << moteus_id_ << " ";
-  for (uint ii = 0; ii < (uint)frame.size; ii++) {
-    ss << std::setfill('0') << std::setw(2) << std::hex << (int)frame.data[ii];
-  }
-  ss << '\n';
-
-  if (!WriteDev(ss.str()))
-    throw std::runtime_error("Failiur: could not WriteDev.");
-
-  // process response
-  string resp;
-  if (!((ExpectResponse("OK", resp) && ExpectResponse("rcv", resp)))) {
-    return false;
-  }
-
-  return true;
+  return SendCommand(frame);
 }
 
 void MoteusAPI::ReadState(State& curr_state) const {
-  mjbots::moteus::QueryCommand q_com;
-  if (!curr_state.position_flag)
-    q_com.position = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.velocity_flag)
-    q_com.velocity = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.torque_flag)
-    q_com.torque = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.q_curr_flag)
-    q_com.q_current = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.d_curr_flag)
-    q_com.d_current = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.rezero_state_flag)
-    q_com.rezero_state = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.voltage_flag)
-    q_com.voltage = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.temperature_flag)
-    q_com.temperature = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.fault_flag) q_com.fault = mjbots::moteus::Resolution::kIgnore;
-  if (!curr_state.mode_flag) q_com.mode = mjbots::moteus::Resolution::kIgnore;
+  ReadState(curr_state, -1);
+}
 
-  mjbots::moteus::CanFrame frame;
-  mjbots::moteus::WriteCanFrame wcan_frame(&frame);
-  mjbots::moteus::EmitQueryCommand(&wcan_frame, q_com);
-  // Encode message to hex
-  stringstream ss;
-  ss << "can send 80" << std::setfill('0') << std::setw(2) << std::hex
-     << moteus_id_ << " ";
-  for (uint ii = 0; ii < (uint)frame.size; ii++) {
-    ss << std::setfill('0') << std::setw(2) << std::hex << (int)frame.data[ii];
+void MoteusAPI::ReadState(State& curr_state, double max_age_s) const {
+  const int64_t oldest_ns = NowNs() - llround(max_age_s * 1e9);
+  State stale;
+  bool any_stale = false;
+  for (int ii = 0; ii < Cache::kFields; ii++) {
+    const auto& field = kFields[ii];
+    if (!(curr_state.*field.flag)) continue;
+    cache_.state.*field.flag = true;
+    if (max_age_s >= 0 && cache_.time_ns[ii] != 0 &&
+        cache_.time_ns[ii] >= oldest_ns) {
+      continue;
+    }
+    stale.*field.flag = true;
+    any_stale = true;
   }
-  ss << '\n';
 
-  if (!WriteDev(ss.str()))
-    throw std::runtime_error("Failiur: could not WriteDev.");
+  if (any_stale) {
+    const QueryCommand q_com = QueryFor(stale);
+    mjbots::moteus::CanFrame frame;
+    mjbots::moteus::WriteCanFrame wcan_frame(&frame);
+    mjbots::moteus::EmitQueryCommand(&wcan_frame, q_com);
 
-  string resp;
-  if (!((ExpectResponse("OK", resp) && ExpectResponse("rcv", resp)))) {
-    return;
+    BusFrame reply;
+    if (!Transaction(frame, &reply)) return;
+    Update(q_com, reply);
   }
-  // cout << "resp is :" << resp << endl;
 
-  /// parse response
-  istringstream iss(resp);
-  vector<string> words;
-  copy(istream_iterator<string>(iss), istream_iterator<string>(),
-       back_inserter(words));
-
-  uint8_t decoded[readbuffsize];
-  string respstr(words.at(2));
-  uint loopsize = respstr.size() / 2;
-
-  for (uint ii = 0; ii < loopsize; ii++) {
-    std::stringstream stream;
-    stream << respstr.substr(ii * 2, 2);
-    int tmp;
-    stream >> std::hex >> tmp;
-    decoded[ii] = (uint8_t)tmp;
+  for (int ii = 0; ii < Cache::kFields; ii++) {
+    const auto& field = kFields[ii];
+    if (curr_state.*field.flag && cache_.time_ns[ii] != 0) {
+      curr_state.*field.value = cache_.state.*field.value;
+    }
   }
-
-  mjbots::moteus::QueryResult qr =
-      mjbots::moteus::ParseQueryResult(decoded, loopsize);
-  curr_state.position = qr.position;
-  curr_state.velocity = qr.velocity;
-  curr_state.torque = qr.torque;
-  curr_state.q_curr = qr.q_current;
-  curr_state.d_curr = qr.d_current;
-  curr_state.voltage = qr.voltage;
-  curr_state.temperature = qr.temperature;
-  curr_state.fault = qr.fault;
 }
 
-bool MoteusAPI::ExpectResponse(const string& exp_string,
-                               string& fullresp) const {
-  char read_buff[readbuffsize];
-  for (uint ii = 0; ii < readbuffsize; ii++) {
-    read_buff[ii] = 0;
-  }
-  do {
-    int res = ReadUntilDev(read_buff, '\n', readbuffsize, 1000);
-    if (res) {
-      cout << "Timeout: Expected response'" << exp_string
-           << "' was not received" << endl;
-      return false;
-    }
-    fullresp = string(read_buff);
-  } while (fullresp.find(exp_string) == std::string::npos);
+bool MoteusAPI::SendCommand(mjbots::moteus::CanFrame& frame) const {
+  const QueryCommand q_com = QueryFor(cache_.state);
+  mjbots::moteus::WriteCanFrame write_frame(frame.data, &frame.size);
+  mjbots::moteus::EmitQueryCommand(&write_frame, q_com);
+
+  BusFrame reply;
+  if (!Transaction(frame, &reply)) return false;
+  Update(q_com, reply);
   return true;
 }
 
-int MoteusAPI::OpenDev() {
-  struct termios toptions;
-  int fd;
-
-  fd = open(dev_name_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
-
-  if (fd == -1) {
-    throw std::runtime_error("MoteusAPI: Unable to open port");
-    exit(EXIT_FAILURE);
-  }
-
-  if (tcgetattr(fd, &toptions) < 0) {
-    throw std::runtime_error("MoteusAPI: Couldn't get term attributes");
-    exit(EXIT_FAILURE);
+void MoteusAPI::Update(const QueryCommand& query, const BusFrame& reply) const {
+  const QueryResult qr =
+      mjbots::moteus::ParseQueryResult(reply.frame.data, reply.frame.size);
+  for (int ii = 0; ii < Cache::kFields; ii++) {
+    const auto& field = kFields[ii];
+    if (query.*field.resolution == Resolution::kIgnore) continue;
+    cache_.state.*field.value = ResultValue(qr, ii);
+    cache_.time_ns[ii] = reply.timestamp_ns;
   }
-
-  // set baud to arbitrary value, it will get ignored by dev
-  speed_t brate = B115200;
-
-  cfsetispeed(&toptions, brate);
-  cfsetospeed(&toptions, brate);
-
-  // 8N1
-  toptions.c_cflag &= ~PARENB;
-  toptions.c_cflag &= ~CSTOPB;
-  toptions.c_cflag &= ~CSIZE;
-  toptions.c_cflag |= CS8;
-  // no flow control
-  toptions.c_cflag &= ~CRTSCTS;
-
-  toptions.c_cflag |= CREAD | CLOCAL;
-  toptions.c_iflag &= ~(IXON | IXOFF | IXANY);
-
-  toptions.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-  toptions.c_oflag &= ~OPOST;
-
-  toptions.c_cc[VMIN] = 0;
-  toptions.c_cc[VTIME] = 0;
-
-  tcsetattr(fd, TCSANOW, &toptions);
-  if (tcsetattr(fd, TCSAFLUSH, &toptions) < 0) {
-    throw std::runtime_error("MoteusAPI: Couldn't set term attributes");
-  }
-
-  fd_ = fd;
-  return fd_;
 }
 
-bool MoteusAPI::WriteDev(const string& buff) const {
-  uint n = write(fd_, buff.c_str(), buff.size());
-  if (n != buff.size()) {
+bool MoteusAPI::Transaction(mjbots::moteus::CanFrame& frame,
+                            BusFrame* reply) const {
+  PadFrame(&frame);
+  BusFrame tx;
+  tx.arbitration_id = BusFrame::kReplyRequested | moteus_id_;
+  tx.frame = frame;
+  if (!transport_->Send(&tx, 1, timeoutus))
+    throw std::runtime_error("Failiur: could not WriteDev.");
+
+  BusFrame rx;
+  size_t received = 0;
+  if (!transport_->Receive(1, 1, &rx, 1, &received, timeoutus)) {
+    cout << "Timeout: Expected response from moteus " << moteus_id_
+         << " was not received" << endl;
     return false;
   }
+  if (rx.source() != moteus_id_) return false;
+  *reply = rx;
   return true;
 }
-
-int MoteusAPI::CloseDev() const { return close(fd_); }
-
-int MoteusAPI::ReadUntilDev(char* buf, char until, int buf_max,
-                            int timeout) const {
-  char b[1];  // read expects an array, so we give it a 1-byte array
-  int i = 0;
-  do {
-    int n = read(fd_, b, 1);  // read a char at a time
-    if (n == -1) return -1;   // couldn't read
-    if (n == 0) {
-      usleep(1 * 1000);  // wait 1 msec try again
-      timeout--;
-      if (timeout == 0) return -2;
-      continue;
-    }
-    buf[i] = b[0];
-    i++;
-  } while (b[0] != until && i < buf_max && timeout > 0);
-
-  buf[i] = 0;  // null terminate the string
-  return 0;
-}
\ No newline at end of file
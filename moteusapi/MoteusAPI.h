@@ -21,12 +21,14 @@
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "Transport.h"
 #include "moteus_protocol.h"
 
 using namespace std;
@@ -109,11 +111,23 @@ struct State {
   }
 };
 
+// Handle to one servo. Handles are move-only and share the transport of
+// their adapter, so containers of handles are cheap to build and the
+// device is opened once and closed with the last handle.
 class MoteusAPI {
  public:
   MoteusAPI(const string dev_name, int moteus_id);
+  MoteusAPI(shared_ptr<Transport> transport, int moteus_id);
   ~MoteusAPI();
 
+  MoteusAPI(const MoteusAPI&) = delete;
+  MoteusAPI& operator=(const MoteusAPI&) = delete;
+  MoteusAPI(MoteusAPI&&) noexcept = default;
+  MoteusAPI& operator=(MoteusAPI&&) noexcept = default;
+
+  int moteus_id() const { return moteus_id_; }
+  const shared_ptr<Transport>& transport() const { return transport_; }
+
   bool SendPositionCommand(double stop_position, double velocity,
                            double max_torque, double feedforward_torque = 0,
                            double kp_scale = 1.0, double kd_scale = 1.0,
@@ -128,19 +142,37 @@ class MoteusAPI {
   bool SendStopCommand();
 
   void ReadState(State& curr_state) const;
+  // Like ReadState(), but fields the handle saw at most |max_age_s| ago
+  // are taken from its cache and only the others are queried. Returns
+  // without bus traffic if every requested field is fresh enough.
+  //
+  // The cache holds the latest value of every field from any reply. Once
+  // a field was read, the commands sent through this handle query it as
+  // well, so their replies keep it fresh.
+  void ReadState(State& curr_state, double max_age_s) const;
 
  private:
-  // Open /dev/dev_name_
-  int OpenDev();
-  int CloseDev() const;
-  bool WriteDev(const string& buff) const;
-  int ReadUntilDev(char* buf, char until, int buf_max, int timeout) const;
-  bool ExpectResponse(const string& exp_string, string& resp) const;
-  const string dev_name_;
-  const int moteus_id_;
-  int fd_;
-  const unsigned int readbuffsize = 500;
-  // const unsigned long timeoutdelayus = 1000;
+  struct Cache {
+    static const int kFields = 10;
+    // the flags mark the fields read so far
+    State state;
+    // NowNs() of each field's latest value, 0 for none
+    int64_t time_ns[kFields] = {};
+  };
+
+  // Appends the query of the fields read so far to a command and sends
+  // it.
+  bool SendCommand(mjbots::moteus::CanFrame& frame) const;
+  // Sends |frame| and waits for the servo's reply.
+  bool Transaction(mjbots::moteus::CanFrame& frame, BusFrame* reply) const;
+  // Stores the fields of |query| found in |reply|.
+  void Update(const mjbots::moteus::QueryCommand& query,
+              const BusFrame& reply) const;
+
+  shared_ptr<Transport> transport_;
+  int moteus_id_;
+  mutable Cache cache_;
+  static const int timeoutus = 1000000;
 };
 
 #endif  // MOTEUSAPI_H__
\ No newline at end of file
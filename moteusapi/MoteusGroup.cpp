@@ -0,0 +1,651 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "MoteusGroup.h"
+
+#include <string.h>
+
+#include <limits>
+#include <stdexcept>
+
+#include "Clock.h"
+#include "CommandJournal.h"
+#include "Compensation.h"
+#include "Fdcanusb.h"
+
+using mjbots::moteus::CanFrame;
+using mjbots::moteus::PositionCommand;
+using mjbots::moteus::QueryCommand;
+using mjbots::moteus::QueryResult;
+using mjbots::moteus::Resolution;
+using mjbots::moteus::WithinCommand;
+
+namespace {
+
+double Clamp(double value, double min, double max) {
+  // NAN passes through, the servo reads it as "unset"
+  if (value < min) return min;
+  if (value > max) return max;
+  return value;
+}
+
+void SetQueryFlags(const QueryCommand& query, State* state) {
+  state->Reset();
+  state->mode_flag = query.mode != Resolution::kIgnore;
+  state->position_flag = query.position != Resolution::kIgnore;
+  state->velocity_flag = query.velocity != Resolution::kIgnore;
+  state->torque_flag = query.torque != Resolution::kIgnore;
+  state->q_curr_flag = query.q_current != Resolution::kIgnore;
+  state->d_curr_flag = query.d_current != Resolution::kIgnore;
+  state->rezero_state_flag = query.rezero_state != Resolution::kIgnore;
+  state->voltage_flag = query.voltage != Resolution::kIgnore;
+  state->temperature_flag = query.temperature != Resolution::kIgnore;
+  state->fault_flag = query.fault != Resolution::kIgnore;
+}
+
+void DecodeState(const CanFrame& frame, State* state) {
+  const QueryResult qr =
+      mjbots::moteus::ParseQueryResult(frame.data, frame.size);
+  if (state->mode_flag) state->mode = static_cast<double>(qr.mode);
+  if (state->position_flag) state->position = qr.position;
+  if (state->velocity_flag) state->velocity = qr.velocity;
+  if (state->torque_flag) state->torque = qr.torque;
+  if (state->q_curr_flag) state->q_curr = qr.q_current;
+  if (state->d_curr_flag) state->d_curr = qr.d_current;
+  if (state->rezero_state_flag) state->rezero_state = qr.rezero_state;
+  if (state->voltage_flag) state->voltage = qr.voltage;
+  if (state->temperature_flag) state->temperature = qr.temperature;
+  if (state->fault_flag) state->fault = qr.fault;
+}
+
+}  // namespace
+
+MoteusGroup::MoteusGroup(const string& topology_path)
+    : MoteusGroup(LoadTopology(topology_path)) {}
+
+MoteusGroup::MoteusGroup(const Topology& topology) : topology_(topology) {
+  ValidateTopology(topology_);
+
+  Plan plan;
+  plan.topology = topology_;
+  Build(&plan);
+  servos_ = std::move(plan.servos);
+  adapters_ = std::move(plan.adapters);
+
+  for (size_t ii = 0; ii < adapters_.size(); ii++) {
+    auto& adapter = adapters_[ii];
+    const auto& config = topology_.adapters[ii];
+    adapter.transport = Transport::Open(config.dev_name);
+    if (!config.capture.empty()) {
+      auto fdcanusb = dynamic_pointer_cast<Fdcanusb>(adapter.transport);
+      if (!fdcanusb) {
+        throw std::runtime_error("MoteusGroup: adapter '" + config.name +
+                                 "' cannot capture, it is no fdcanusb");
+      }
+      fdcanusb->SetCapture(config.capture);
+    }
+  }
+
+  if (!topology_.journal.empty()) {
+    journal_.reset(new CommandJournal(topology_.journal, topology_));
+    for (size_t ii = 0; ii < servos_.size(); ii++) {
+      auto& servo = servos_[ii];
+      if (journal_->Load(ii, topology_.journal_max_age_s, &servo.raw)) {
+        servo.kind = CommandKind::kRaw;
+        resumed_++;
+      }
+    }
+  }
+}
+
+MoteusGroup::~MoteusGroup() {
+  if (builder_.joinable()) builder_.join();
+}
+
+void MoteusGroup::Build(Plan* plan) {
+  const Topology& topology = plan->topology;
+  auto& servos = plan->servos;
+  auto& adapters = plan->adapters;
+
+  adapters.resize(topology.adapters.size());
+  for (auto& adapter : adapters) {
+    std::fill(std::begin(adapter.by_id), std::end(adapter.by_id), -1);
+  }
+
+  servos.resize(topology.servos.size());
+  for (size_t ii = 0; ii < servos.size(); ii++) {
+    const auto& config = topology.servos[ii];
+    auto& servo = servos[ii];
+    servo.adapter = config.adapter;
+    Prepare(config, config.query, &servo);
+
+    auto& adapter = adapters[config.adapter];
+    servo.divisor = CommandDivisor(topology, config);
+    for (const auto other : adapter.servos) {
+      if (servos[other].divisor == servo.divisor) servo.phase++;
+    }
+    servo.phase %= servo.divisor;
+    adapter.servos.push_back(ii);
+    adapter.by_id[config.id] = static_cast<int>(ii);
+  }
+
+  for (auto& adapter : adapters) {
+    adapter.tx.resize(adapter.servos.size());
+    adapter.rx.resize(adapter.servos.size());
+  }
+}
+
+void MoteusGroup::Prepare(size_t index, const QueryCommand& query) {
+  Prepare(topology_.servos[index], query, &servos_[index]);
+}
+
+void MoteusGroup::Prepare(const ServoConfig& config, const QueryCommand& query,
+                          Servo* servo) {
+  // build everything first, so a query that does not fit changes nothing
+  const FrameLayout position_layout =
+      MakePositionLayout(config.command, query);
+  const FrameLayout within_layout = MakeWithinLayout(config.within, query);
+  const CanFrame stop_frame = MakeStopFrame(query);
+
+  servo->query = query;
+  servo->arbitration_id = config.id;
+  if (query.any_set()) servo->arbitration_id |= BusFrame::kReplyRequested;
+  servo->position_layout = position_layout;
+  servo->within_layout = within_layout;
+  servo->stop_frame = stop_frame;
+  servo->query_frame = MakeQueryFrame(query);
+  SetQueryFlags(query, &servo->state);
+}
+
+size_t MoteusGroup::Index(const string& name) const {
+  const int index = topology_.ServoIndex(name);
+  if (index < 0) throw std::runtime_error("MoteusGroup: no servo " + name);
+  return index;
+}
+
+PositionCommand MoteusGroup::Limit(size_t index,
+                                   const PositionCommand& command) const {
+  const auto& config = topology_.servos[index];
+  PositionCommand c = command;
+  c.position = Clamp(c.position, config.position_min, config.position_max);
+  c.stop_position =
+      Clamp(c.stop_position, config.position_min, config.position_max);
+  c.velocity = Clamp(c.velocity, -config.velocity_max, config.velocity_max);
+  c.feedforward_torque =
+      Clamp(c.feedforward_torque, -config.torque_max, config.torque_max);
+  if (std::isfinite(config.torque_max) &&
+      !(std::abs(c.maximum_torque) <= config.torque_max)) {
+    c.maximum_torque = config.torque_max;
+  }
+  if (config.watchdog_timeout != 0) {
+    c.watchdog_timeout = config.watchdog_timeout;
+  }
+  return c;
+}
+
+WithinCommand MoteusGroup::Limit(size_t index,
+                                 const WithinCommand& command) const {
+  const auto& config = topology_.servos[index];
+  WithinCommand c = command;
+  c.bounds_min = Clamp(c.bounds_min, config.position_min, config.position_max);
+  c.bounds_max = Clamp(c.bounds_max, config.position_min, config.position_max);
+  c.feedforward_torque =
+      Clamp(c.feedforward_torque, -config.torque_max, config.torque_max);
+  if (std::isfinite(config.torque_max) &&
+      !(std::abs(c.maximum_torque) <= config.torque_max)) {
+    c.maximum_torque = config.torque_max;
+  }
+  if (config.watchdog_timeout != 0) {
+    c.watchdog_timeout = config.watchdog_timeout;
+  }
+  return c;
+}
+
+void MoteusGroup::SetPositionCommand(size_t index,
+                                     const PositionCommand& command) {
+  auto& servo = servos_[index];
+  const PositionCommand c = Limit(index, command);
+  if (servo.kind != CommandKind::kPosition ||
+      memcmp(&c, &servo.command, sizeof(c)) != 0) {
+    Wake(index);
+  }
+  servo.kind = CommandKind::kPosition;
+  servo.command = c;
+}
+
+void MoteusGroup::SetWithinCommand(size_t index,
+                                   const WithinCommand& command) {
+  auto& servo = servos_[index];
+  const WithinCommand c = Limit(index, command);
+  if (servo.kind != CommandKind::kWithin ||
+      memcmp(&c, &servo.within, sizeof(c)) != 0) {
+    Wake(index);
+  }
+  servo.kind = CommandKind::kWithin;
+  servo.within = c;
+}
+
+void MoteusGroup::SetWithinCommands(const vector<size_t>& servos,
+                                    const WithinCommand& common,
+                                    const vector<double>& bounds_min,
+                                    const vector<double>& bounds_max) {
+  if (bounds_min.size() != servos.size() ||
+      bounds_max.size() != servos.size()) {
+    throw std::runtime_error("MoteusGroup: one bound per servo expected");
+  }
+  WithinCommand command = common;
+  for (size_t ii = 0; ii < servos.size(); ii++) {
+    command.bounds_min = bounds_min[ii];
+    command.bounds_max = bounds_max[ii];
+    SetWithinCommand(servos[ii], command);
+  }
+}
+
+void MoteusGroup::SetStopCommand(size_t servo) {
+  if (servos_[servo].kind != CommandKind::kStop) Wake(servo);
+  servos_[servo].kind = CommandKind::kStop;
+}
+
+void MoteusGroup::SetRawCommand(size_t index, const CanFrame& frame) {
+  auto& servo = servos_[index];
+  CanFrame raw = frame;
+  PadFrame(&raw);
+  if (servo.kind != CommandKind::kRaw || raw.size != servo.raw.size ||
+      memcmp(raw.data, servo.raw.data, raw.size) != 0) {
+    Wake(index);
+  }
+  servo.raw = raw;
+  servo.kind = CommandKind::kRaw;
+}
+
+void MoteusGroup::SetQuery(size_t servo, const QueryCommand& query) {
+  Prepare(servo, query);
+  servos_[servo].query_overridden =
+      memcmp(&query, &topology_.servos[servo].query, sizeof(query)) != 0;
+}
+
+void MoteusGroup::ClearCommand(size_t servo) {
+  if (servos_[servo].kind != CommandKind::kNone) Wake(servo);
+  servos_[servo].kind = CommandKind::kNone;
+}
+
+void MoteusGroup::OverrideStop(size_t index) {
+  auto& servo = servos_[index];
+  if (servo.override_kind != CommandKind::kStop) Wake(index);
+  servo.override_kind = CommandKind::kStop;
+}
+
+void MoteusGroup::OverridePosition(size_t index,
+                                   const PositionCommand& command) {
+  auto& servo = servos_[index];
+  const PositionCommand c = Limit(index, command);
+  if (servo.override_kind != CommandKind::kPosition ||
+      memcmp(&c, &servo.override_command, sizeof(c)) != 0) {
+    Wake(index);
+  }
+  servo.override_kind = CommandKind::kPosition;
+  servo.override_command = c;
+}
+
+void MoteusGroup::ClearOverride(size_t index) {
+  if (servos_[index].override_kind != CommandKind::kNone) Wake(index);
+  servos_[index].override_kind = CommandKind::kNone;
+}
+
+void MoteusGroup::SetSlowdown(size_t index, int slowdown) {
+  auto& servo = servos_[index];
+  servo.slowdown = std::max(1, std::min(slowdown, MaxSlowdown(index)));
+  servo.skip = std::min(servo.skip, servo.slowdown - 1);
+}
+
+double MoteusGroup::max_frame_interval(size_t index) const {
+  const auto& config = topology_.servos[index];
+  const auto& servo = servos_[index];
+  double watchdog = config.watchdog_timeout;
+  if (watchdog == 0) {
+    // the command's own if it is sent at all, 0 in the command is the
+    // servo's default
+    const bool position_sent =
+        config.command.watchdog_timeout != Resolution::kIgnore;
+    const bool within_sent =
+        config.within.watchdog_timeout != Resolution::kIgnore;
+    if (servo.override_kind == CommandKind::kPosition) {
+      if (position_sent) watchdog = servo.override_command.watchdog_timeout;
+    } else if (SentKind(servo) == CommandKind::kPosition) {
+      if (position_sent) watchdog = servo.command.watchdog_timeout;
+    } else if (SentKind(servo) == CommandKind::kWithin) {
+      if (within_sent) watchdog = servo.within.watchdog_timeout;
+    }
+    if (watchdog == 0) watchdog = kDefaultWatchdogTimeout;
+  }
+  // NAN disables the watchdog
+  if (std::isnan(watchdog)) return std::numeric_limits<double>::infinity();
+  // as in ValidateTopology, two frames per watchdog period
+  return watchdog / 2;
+}
+
+int MoteusGroup::MaxSlowdown(size_t index) const {
+  const double interval = servos_[index].divisor / topology_.rate_hz;
+  const double slowdown = max_frame_interval(index) / interval;
+  if (slowdown >= std::numeric_limits<int>::max()) {
+    return std::numeric_limits<int>::max();
+  }
+  return std::max(1, static_cast<int>(slowdown));
+}
+
+void MoteusGroup::Wake(size_t servo) {
+  changes_++;
+  servos_[servo].slowdown = 1;
+  servos_[servo].skip = 0;
+}
+
+void MoteusGroup::SetCompensation(
+    shared_ptr<const Compensation> compensation) {
+  if (compensation && compensation->size() != servos_.size()) {
+    throw std::runtime_error("MoteusGroup: compensation for " +
+                             to_string(compensation->size()) +
+                             " servos, the group has " +
+                             to_string(servos_.size()));
+  }
+  if (compensation) CheckCompensation(topology_, *compensation);
+  compensation_position_.assign(servos_.size(), NAN);
+  compensation_velocity_.assign(servos_.size(), NAN);
+  compensation_torque_.assign(servos_.size(), 0);
+  // Reconfigure() may read it from another thread
+  atomic_store(&compensation_, std::move(compensation));
+}
+
+void MoteusGroup::CheckCompensation(const Topology& topology,
+                                    const Compensation& compensation) {
+  for (size_t ii = 0; ii < topology.servos.size(); ii++) {
+    if (!compensation.compensated(ii)) continue;
+    const auto& config = topology.servos[ii];
+    const string what = "MoteusGroup: servo '" + config.name + "': ";
+    if (config.command.feedforward_torque == Resolution::kIgnore ||
+        config.within.feedforward_torque == Resolution::kIgnore) {
+      throw std::runtime_error(what + "compensation needs "
+                               "command.feedforward_torque and "
+                               "within.feedforward_torque to be sent");
+    }
+    if (config.query.position == Resolution::kIgnore ||
+        config.query.velocity == Resolution::kIgnore) {
+      throw std::runtime_error(
+          what + "compensation needs query.position and query.velocity");
+    }
+  }
+}
+
+void MoteusGroup::Compensate() {
+  for (size_t ii = 0; ii < servos_.size(); ii++) {
+    const auto& servo = servos_[ii];
+    if (lazy_decode_) {
+      const StateView view = this->view(ii);
+      compensation_position_[ii] = view.position();
+      compensation_velocity_[ii] = view.velocity();
+    } else {
+      compensation_position_[ii] = servo.state.position;
+      compensation_velocity_[ii] = servo.state.velocity;
+    }
+  }
+  compensation_->Compute(compensation_position_.data(),
+                         compensation_velocity_.data(),
+                         compensation_torque_.data());
+}
+
+void MoteusGroup::CheckLayout(const Servo& servo) {
+  if (!servo.reply_layout.Matches(servo.reply)) {
+    servo.reply_layout = ParseReplyLayout(servo.reply);
+  }
+  servo.layout_checked = true;
+}
+
+void MoteusGroup::Encode(size_t index, BusFrame* frame) const {
+  const auto& servo = servos_[index];
+  const double torque_max = topology_.servos[index].torque_max;
+  const double compensation = this->compensation(index);
+  // NAN leaves the servo's feedforward at 0
+  auto compensate = [&](double feedforward) {
+    if (std::isnan(feedforward)) feedforward = 0;
+    return Clamp(feedforward + compensation, -torque_max, torque_max);
+  };
+
+  const PositionCommand& position = servo.override_kind == CommandKind::kNone
+                                        ? servo.command
+                                        : servo.override_command;
+
+  frame->arbitration_id = servo.arbitration_id;
+  switch (SentKind(servo)) {
+    case CommandKind::kNone:
+      frame->frame = servo.query_frame;
+      break;
+    case CommandKind::kStop:
+      frame->frame = servo.stop_frame;
+      break;
+    case CommandKind::kPosition:
+      if (compensation != 0) {
+        PositionCommand command = position;
+        command.feedforward_torque = compensate(command.feedforward_torque);
+        EncodePositionCommand(servo.position_layout, command, &frame->frame);
+      } else {
+        EncodePositionCommand(servo.position_layout, position, &frame->frame);
+      }
+      break;
+    case CommandKind::kWithin:
+      if (compensation != 0) {
+        WithinCommand within = servo.within;
+        within.feedforward_torque = compensate(within.feedforward_torque);
+        EncodeWithinCommand(servo.within_layout, within, &frame->frame);
+      } else {
+        EncodeWithinCommand(servo.within_layout, servo.within, &frame->frame);
+      }
+      break;
+    case CommandKind::kRaw:
+      frame->frame = servo.raw;
+      break;
+  }
+}
+
+future<void> MoteusGroup::Reconfigure(const Topology& topology) {
+  bool idle = false;
+  if (!reconfiguring_.compare_exchange_strong(idle, true)) {
+    throw std::runtime_error("MoteusGroup: a reconfiguration is pending");
+  }
+  // the previous builder is done, its plan was swapped in or rejected
+  if (builder_.joinable()) builder_.join();
+  retired_.reset();
+
+  unique_ptr<Plan> plan(new Plan);
+  plan->topology = topology;
+  plan->compensation = atomic_load(&compensation_);
+  future<void> result = plan->done.get_future();
+  // topology_ only changes in Apply(), which waits for this plan
+  const Topology current = topology_;
+  builder_ = thread([this, current](unique_ptr<Plan> plan) {
+    try {
+      ValidateTopology(plan->topology);
+      CheckReconfigure(current, plan->topology, plan->compensation.get());
+      Build(plan.get());
+    } catch (...) {
+      plan->done.set_exception(current_exception());
+      reconfiguring_ = false;
+      return;
+    }
+    lock_guard<mutex> lock(plan_mutex_);
+    pending_ = std::move(plan);
+    plan_ready_.store(true, memory_order_release);
+  }, std::move(plan));
+  return result;
+}
+
+void MoteusGroup::CheckReconfigure(const Topology& current,
+                                   const Topology& next,
+                                   const Compensation* compensation) {
+  if (next.journal != current.journal) {
+    throw std::runtime_error("MoteusGroup: the journal cannot change");
+  }
+  if (next.adapters.size() != current.adapters.size()) {
+    throw std::runtime_error("MoteusGroup: the adapters cannot change");
+  }
+  for (size_t ii = 0; ii < next.adapters.size(); ii++) {
+    const auto& a = current.adapters[ii];
+    const auto& b = next.adapters[ii];
+    if (a.name != b.name || a.dev_name != b.dev_name ||
+        a.capture != b.capture) {
+      throw std::runtime_error("MoteusGroup: adapter '" + a.name +
+                               "' cannot change");
+    }
+  }
+  if (next.servos.size() != current.servos.size()) {
+    throw std::runtime_error("MoteusGroup: the servos cannot change");
+  }
+  for (size_t ii = 0; ii < next.servos.size(); ii++) {
+    const auto& a = current.servos[ii];
+    const auto& b = next.servos[ii];
+    if (a.name != b.name || a.adapter != b.adapter || a.id != b.id) {
+      throw std::runtime_error("MoteusGroup: servo '" + a.name +
+                               "' cannot change its name, adapter or id");
+    }
+  }
+  // compensation would silently stop for the servo otherwise
+  if (compensation) CheckCompensation(next, *compensation);
+}
+
+void MoteusGroup::Apply() {
+  unique_ptr<Plan> plan;
+  {
+    lock_guard<mutex> lock(plan_mutex_);
+    plan = std::move(pending_);
+    plan_ready_.store(false, memory_order_relaxed);
+  }
+
+  // SetCompensation() was called since the plan was checked
+  if (compensation_ && compensation_ != plan->compensation) {
+    try {
+      CheckCompensation(plan->topology, *compensation_);
+    } catch (...) {
+      retired_ = std::move(plan);
+      retired_->done.set_exception(current_exception());
+      reconfiguring_ = false;
+      return;
+    }
+  }
+
+  for (size_t ii = 0; ii < adapters_.size(); ii++) {
+    plan->adapters[ii].transport = std::move(adapters_[ii].transport);
+  }
+  // swapped rather than assigned, the old ones are freed later
+  swap(topology_, plan->topology);
+  swap(servos_, plan->servos);
+  swap(adapters_, plan->adapters);
+
+  for (size_t ii = 0; ii < servos_.size(); ii++) {
+    const auto& old = plan->servos[ii];
+    auto& servo = servos_[ii];
+    if (old.query_overridden) {
+      try {
+        Prepare(topology_.servos[ii], old.query, &servo);
+        servo.query_overridden = true;
+      } catch (const std::runtime_error&) {
+        // no longer fits the new command resolutions, the servo gets the
+        // query of the new topology
+      }
+    }
+
+    // the commands are clamped to the new limits without waking the
+    // servo, nothing changed but the configuration
+    servo.kind = old.kind;
+    servo.command = Limit(ii, old.command);
+    servo.within = Limit(ii, old.within);
+    servo.raw = old.raw;
+    servo.override_kind = old.override_kind;
+    servo.override_command = Limit(ii, old.override_command);
+    servo.slowdown = std::min(old.slowdown, MaxSlowdown(ii));
+    servo.skip = std::min(old.skip, servo.slowdown - 1);
+
+    // the latest values stay readable until the next reply
+    servo.state = old.state;
+    SetQueryFlags(servo.query, &servo.state);
+    servo.reply = old.reply;
+    servo.reply_layout = old.reply_layout;
+    servo.replied = old.replied;
+    servo.reply_time_ns = old.reply_time_ns;
+  }
+
+  reconfigurations_++;
+  retired_ = std::move(plan);
+  retired_->done.set_value();
+  reconfiguring_ = false;
+}
+
+bool MoteusGroup::Cycle() {
+  if (plan_ready_.load(memory_order_acquire)) Apply();
+  if (compensation_) Compensate();
+
+  // Everything is written before anything is read, so the adapters work
+  // on their buses in parallel.
+  const int64_t now_ns = journal_ ? NowNs() : 0;
+  for (auto& adapter : adapters_) {
+    adapter.count = 0;
+    adapter.expected = 0;
+    for (const auto index : adapter.servos) {
+      auto& servo = servos_[index];
+      servo.replied = false;
+      if (!idle_) {
+        if (!Scheduled(index)) continue;
+        if (servo.skip > 0) {
+          servo.skip--;
+          continue;
+        }
+        servo.skip = servo.slowdown - 1;
+      }
+      auto& frame = adapter.tx[adapter.count++];
+      Encode(index, &frame);
+      if (journal_) {
+        journal_->Store(index, SentKind(servo) == CommandKind::kNone
+                                   ? CanFrame()
+                                   : frame.frame,
+                        now_ns);
+      }
+      if (servo.arbitration_id & BusFrame::kReplyRequested) adapter.expected++;
+    }
+    if (!adapter.transport->Send(adapter.tx.data(), adapter.count,
+                                 topology_.timeout_us)) {
+      throw std::runtime_error("MoteusGroup: could not write to " +
+                               adapter.transport->dev_name());
+    }
+  }
+
+  bool result = true;
+  for (auto& adapter : adapters_) {
+    size_t received = 0;
+    if (!adapter.transport->Receive(adapter.count, adapter.expected,
+                                    adapter.rx.data(), adapter.rx.size(),
+                                    &received, topology_.timeout_us)) {
+      result = false;
+    }
+    for (size_t ii = 0; ii < received; ii++) {
+      const auto& reply = adapter.rx[ii];
+      const int index = adapter.by_id[reply.source()];
+      if (index < 0) continue;
+      auto& servo = servos_[index];
+      servo.reply = reply.frame;
+      servo.layout_checked = false;
+      if (!lazy_decode_) DecodeState(reply.frame, &servo.state);
+      servo.replied = true;
+      servo.reply_time_ns = reply.timestamp_ns;
+    }
+  }
+  tick_++;
+  return result;
+}
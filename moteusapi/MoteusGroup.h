@@ -0,0 +1,339 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSGROUP_H__
+#define MOTEUSGROUP_H__
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Transport.h"
+#include "FrameLayout.h"
+#include "MoteusAPI.h"
+#include "StateView.h"
+#include "Topology.h"
+#include "moteus_protocol.h"
+
+using namespace std;
+
+class CommandJournal;
+class Compensation;
+
+// Drives every servo of a topology. Commands are latched with the Set*
+// calls and go out together with each servo's query on the next Cycle(),
+// one write per adapter. All frame layouts are computed at construction.
+//
+// Servos with a rate_hz below the bus rate are only sent a frame every
+// Nth cycle. Servos sharing a rate are spread over the N cycles, so the
+// load on each bus stays even.
+//
+// With a journal in the topology, every command sent is also stored in
+// it and a new group starts out with the commands journaled by its
+// predecessor, so the servos keep being commanded across a restart.
+//
+// Reconfigure() switches to a changed topology between two cycles.
+class MoteusGroup {
+ public:
+  explicit MoteusGroup(const Topology& topology);
+  explicit MoteusGroup(const string& topology_path);
+  ~MoteusGroup();
+
+  MoteusGroup(const MoteusGroup&) = delete;
+  MoteusGroup& operator=(const MoteusGroup&) = delete;
+
+  const Topology& topology() const { return topology_; }
+  size_t size() const { return servos_.size(); }
+  // Throws std::runtime_error for unknown names.
+  size_t Index(const string& name) const;
+  const ServoConfig& config(size_t servo) const {
+    return topology_.servos[servo];
+  }
+
+  // The command is clamped to the servo limits.
+  void SetPositionCommand(size_t servo,
+                          const mjbots::moteus::PositionCommand& command);
+  // Stay within mode at the resolutions of the servo's within.* keys.
+  // The bounds are clamped to the position limits, the torques to
+  // torque_max.
+  void SetWithinCommand(size_t servo,
+                        const mjbots::moteus::WithinCommand& command);
+  // Latches |common| with per-servo bounds for every servo in |servos|,
+  // e.g. to hold a whole pose compliantly. The frames all go out on the
+  // next Cycle().
+  void SetWithinCommands(const vector<size_t>& servos,
+                         const mjbots::moteus::WithinCommand& common,
+                         const vector<double>& bounds_min,
+                         const vector<double>& bounds_max);
+  void SetStopCommand(size_t servo);
+  // Sends |frame| as it is, padded to a valid length. No limits are
+  // applied, the frame should carry the servo's query to get replies.
+  void SetRawCommand(size_t servo, const mjbots::moteus::CanFrame& frame);
+  // Replaces the registers queried from the servo, initially the ones of
+  // its topology. Throws std::runtime_error if the commands no longer
+  // fit a frame.
+  void SetQuery(size_t servo, const mjbots::moteus::QueryCommand& query);
+  const mjbots::moteus::QueryCommand& query(size_t servo) const {
+    return servos_[servo].query;
+  }
+  // Only query the servo from now on.
+  void ClearCommand(size_t servo);
+
+  // Whether the latched command drives the servo, rather than stopping
+  // or only querying it.
+  bool commanded(size_t servo) const {
+    return servos_[servo].kind != CommandKind::kNone &&
+           servos_[servo].kind != CommandKind::kStop;
+  }
+
+  // Sends a stop, or |command| clamped like by SetPositionCommand(),
+  // instead of the latched command until ClearOverride(), e.g. while the
+  // servo recovers from a fault. Set*Command() calls go on latching
+  // underneath and take effect once the override is cleared.
+  void OverrideStop(size_t servo);
+  void OverridePosition(size_t servo,
+                        const mjbots::moteus::PositionCommand& command);
+  void ClearOverride(size_t servo);
+  bool overridden(size_t servo) const {
+    return servos_[servo].override_kind != CommandKind::kNone;
+  }
+
+  // Switches to |topology| without stopping the servos: its frame
+  // layouts and schedule are built on a thread of its own and swapped in
+  // at the start of a later Cycle(). Rates, limits, resolutions and the
+  // bus timeout may change; the adapters and, in the same order, the
+  // servos with their adapter and id must stay, as must the journal,
+  // and compensated servos must keep what SetCompensation() needs. The
+  // latched commands, overrides, slowdowns, queries set with SetQuery()
+  // and the latest state carry over, the commands clamped to the new
+  // limits. References into topology() and config() end with the swap.
+  //
+  // The future becomes ready once the new topology is in use, or holds
+  // the std::runtime_error rejecting it. Throws std::runtime_error if a
+  // reconfiguration is still pending. May be called from any thread.
+  future<void> Reconfigure(const Topology& topology);
+  // Number of reconfigurations swapped in so far.
+  int64_t reconfigurations() const { return reconfigurations_; }
+
+  // Adds the cogging and friction torque of |compensation| to the
+  // feedforward torque of every position and within command sent, for
+  // the servo's latest reported position and velocity, clamped to
+  // torque_max. Needs command.feedforward_torque (within.* for stay
+  // within) and the position and velocity in the query. nullptr turns
+  // it off. Throws std::runtime_error if |compensation| is not for this
+  // group's servos or a compensated servo lacks one of these.
+  void SetCompensation(shared_ptr<const Compensation> compensation);
+  // The torque added to the servo's latest frame, 0 without compensation.
+  double compensation(size_t servo) const {
+    return compensation_ ? compensation_torque_[servo] : 0;
+  }
+
+  // Sends the latched commands and queries of the servos due this cycle
+  // and decodes the replies. Returns false if an adapter timed out or a
+  // servo did not answer.
+  bool Cycle();
+  // Number of servos that started with a journaled command.
+  size_t resumed() const { return resumed_; }
+  // The transport of topology().adapters[adapter].
+  const shared_ptr<Transport>& transport(size_t adapter) const {
+    return adapters_[adapter].transport;
+  }
+
+  // Number of Cycle() calls so far.
+  int64_t tick() const { return tick_; }
+  // Whether the servo gets a frame in the next Cycle().
+  bool due(size_t servo) const {
+    return idle_ || (Scheduled(servo) && servos_[servo].skip == 0);
+  }
+
+  // In idle mode every servo gets a frame in every Cycle(), regardless
+  // of rate_hz and slowdown, so the cycles can be slowed down as a whole.
+  void SetIdle(bool idle) { idle_ = idle; }
+  bool idle() const { return idle_; }
+  // Counts the Set*Command() and ClearCommand() calls that changed a
+  // servo's command.
+  int64_t changes() const { return changes_; }
+  // The longest gap between two frames that keeps the servo's watchdog
+  // fed, half its timeout. That is kDefaultWatchdogTimeout where neither
+  // the topology nor the sent command sets one, infinite for a NAN one.
+  double max_frame_interval(size_t servo) const;
+
+  // Sends the servo only every |slowdown|th of its frames, e.g. while it
+  // holds still. The slowdown is limited so that two frames still reach
+  // the servo per watchdog timeout, assuming kDefaultWatchdogTimeout for
+  // commands without one. Any new command resets it to 1.
+  void SetSlowdown(size_t servo, int slowdown);
+  int slowdown(size_t servo) const { return servos_[servo].slowdown; }
+
+  // Skips decoding the replies into state(), which then keeps its last
+  // values. Read them through view() or decoded() instead, as the
+  // helpers of this library do.
+  void SetLazyDecode(bool lazy) { lazy_decode_ = lazy; }
+  bool lazy_decode() const { return lazy_decode_; }
+
+  const State& state(size_t servo) const { return servos_[servo].state; }
+  // The servo's latest reply, decoded field by field when read, in
+  // either mode. The reply's layout is only checked by the first view()
+  // after a reply. Valid until the next Cycle().
+  StateView view(size_t servo) const {
+    const auto& s = servos_[servo];
+    if (!s.layout_checked) CheckLayout(s);
+    return StateView(s.reply, s.reply_layout);
+  }
+  // The latest reply as a State in either mode: state() itself, or
+  // decoded from view() with lazy decoding.
+  State decoded(size_t servo) const {
+    return lazy_decode_ ? view(servo).ToState() : servos_[servo].state;
+  }
+  // Whether the last Cycle() got a reply from the servo.
+  bool replied(size_t servo) const { return servos_[servo].replied; }
+  // The servo's latest reply as received.
+  const mjbots::moteus::CanFrame& reply_frame(size_t servo) const {
+    return servos_[servo].reply;
+  }
+  // NowNs() when the servo's latest reply was read, 0 before the first.
+  int64_t reply_time_ns(size_t servo) const {
+    return servos_[servo].reply_time_ns;
+  }
+
+ private:
+  enum class CommandKind { kNone, kStop, kPosition, kWithin, kRaw };
+
+  struct Servo {
+    size_t adapter = 0;
+    uint16_t arbitration_id = 0;
+    // scheduled when tick % divisor == phase
+    int divisor = 1;
+    int phase = 0;
+    // scheduled frames left out before the next one is sent
+    int slowdown = 1;
+    int skip = 0;
+    mjbots::moteus::QueryCommand query;
+    // set with SetQuery() rather than from the topology
+    bool query_overridden = false;
+    FrameLayout position_layout;
+    FrameLayout within_layout;
+    mjbots::moteus::CanFrame stop_frame;
+    mjbots::moteus::CanFrame query_frame;
+
+    CommandKind kind = CommandKind::kNone;
+    mjbots::moteus::PositionCommand command;
+    mjbots::moteus::WithinCommand within;
+    mjbots::moteus::CanFrame raw;
+    // sent instead of the above unless kNone
+    CommandKind override_kind = CommandKind::kNone;
+    mjbots::moteus::PositionCommand override_command;
+
+    State state;
+    mjbots::moteus::CanFrame reply;
+    // parsed from the reply by the first view() after it
+    mutable ReplyLayout reply_layout;
+    mutable bool layout_checked = false;
+    bool replied = false;
+    int64_t reply_time_ns = 0;
+  };
+
+  struct Adapter {
+    shared_ptr<Transport> transport;
+    vector<size_t> servos;
+    // servos due in the current cycle
+    size_t count = 0;
+    // servo index by moteus id, -1 if not on this adapter
+    int by_id[128];
+    vector<BusFrame> tx;
+    vector<BusFrame> rx;
+    size_t expected = 0;
+  };
+
+  // A topology with everything derived from it, built ahead of the swap.
+  struct Plan {
+    Topology topology;
+    vector<Servo> servos;
+    vector<Adapter> adapters;
+    // the compensation the topology was checked against
+    shared_ptr<const Compensation> compensation;
+    promise<void> done;
+  };
+
+  // Builds the frames of |servo| for |query|.
+  void Prepare(size_t servo, const mjbots::moteus::QueryCommand& query);
+  static void Prepare(const ServoConfig& config,
+                      const mjbots::moteus::QueryCommand& query,
+                      Servo* servo);
+  // The servos and adapters of plan->topology, without transports.
+  static void Build(Plan* plan);
+  // Throws std::runtime_error if |next| cannot replace |current|, also
+  // when it drops what |compensation| needs.
+  static void CheckReconfigure(const Topology& current, const Topology& next,
+                               const Compensation* compensation);
+  // Throws std::runtime_error if a servo |compensation| has a table for
+  // does not send or query what compensating it needs.
+  static void CheckCompensation(const Topology& topology,
+                                const Compensation& compensation);
+  // Swaps in the pending plan.
+  void Apply();
+  // |command| within the servo's limits.
+  mjbots::moteus::PositionCommand Limit(
+      size_t servo, const mjbots::moteus::PositionCommand& command) const;
+  mjbots::moteus::WithinCommand Limit(
+      size_t servo, const mjbots::moteus::WithinCommand& command) const;
+  // What goes out for the servo, the override if there is one.
+  static CommandKind SentKind(const Servo& servo) {
+    return servo.override_kind != CommandKind::kNone ? servo.override_kind
+                                                     : servo.kind;
+  }
+  void Encode(size_t servo, BusFrame* frame) const;
+  static void CheckLayout(const Servo& servo);
+  // Updates compensation_torque_ from the latest replies.
+  void Compensate();
+  bool Scheduled(size_t servo) const {
+    return tick_ % servos_[servo].divisor == servos_[servo].phase;
+  }
+  int MaxSlowdown(size_t servo) const;
+  // The servo's command changed: count it and send every scheduled frame
+  // again.
+  void Wake(size_t servo);
+
+  Topology topology_;
+  vector<Servo> servos_;
+  vector<Adapter> adapters_;
+  unique_ptr<CommandJournal> journal_;
+  size_t resumed_ = 0;
+  bool lazy_decode_ = false;
+  shared_ptr<const Compensation> compensation_;
+  // the inputs and outputs of compensation_, one entry per servo
+  vector<double> compensation_position_;
+  vector<double> compensation_velocity_;
+  vector<double> compensation_torque_;
+  bool idle_ = false;
+  int64_t changes_ = 0;
+  int64_t tick_ = 0;
+
+  // set from Reconfigure() until the plan is swapped in or rejected
+  atomic<bool> reconfiguring_{false};
+  // the built plan, handed over under plan_mutex_
+  atomic<bool> plan_ready_{false};
+  mutex plan_mutex_;
+  unique_ptr<Plan> pending_;
+  // what the last swap replaced, freed outside of Cycle()
+  unique_ptr<Plan> retired_;
+  thread builder_;
+  int64_t reconfigurations_ = 0;
+};
+
+#endif  // MOTEUSGROUP_H__
@@ -0,0 +1,116 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "MotionEstimator.h"
+
+#include <cmath>
+#include <stdexcept>
+
+#include "MoteusGroup.h"
+
+MotionEstimator::MotionEstimator(size_t servos, double theta,
+                                 double reset_after_s)
+    : reset_after_ns_(static_cast<int64_t>(reset_after_s * 1e9)),
+      x_(servos, 0.0),
+      v_(servos, 0.0),
+      a_(servos, 0.0),
+      last_ns_(servos, 0),
+      initialized_(servos, 0),
+      g_(servos),
+      h_(servos),
+      k_(servos),
+      z_(servos),
+      dt_(servos),
+      mask_(servos),
+      position_(servos),
+      velocity_(servos),
+      timestamp_ns_(servos),
+      valid_(servos) {
+  for (size_t ii = 0; ii < servos; ii++) SetSmoothing(ii, theta);
+}
+
+void MotionEstimator::SetSmoothing(size_t servo, double theta) {
+  if (!(theta > 0 && theta < 1)) {
+    throw std::runtime_error("MotionEstimator: theta must be in (0, 1)");
+  }
+  // critically damped (fading memory) gains
+  const double one_minus = 1 - theta;
+  g_[servo] = 1 - theta * theta * theta;
+  h_[servo] = 1.5 * one_minus * one_minus * (1 + theta);
+  k_[servo] = 0.5 * one_minus * one_minus * one_minus;
+}
+
+void MotionEstimator::Update(const MoteusGroup& group) {
+  for (size_t ii = 0; ii < size(); ii++) {
+    const StateView view = group.view(ii);
+    position_[ii] = view.position();
+    velocity_[ii] = view.velocity();
+    valid_[ii] = group.replied(ii) && !std::isnan(position_[ii]);
+    timestamp_ns_[ii] = group.reply_time_ns(ii);
+  }
+  Update(position_.data(), velocity_.data(), timestamp_ns_.data(),
+         valid_.data());
+}
+
+void MotionEstimator::Update(const double* position, const double* velocity,
+                             const int64_t* timestamp_ns,
+                             const uint8_t* valid) {
+  const size_t count = size();
+
+  // Gather: decide per servo whether it is (re)started or updated, so the
+  // filter loop below needs no branches.
+  for (size_t ii = 0; ii < count; ii++) {
+    mask_[ii] = 0;
+    z_[ii] = x_[ii];
+    dt_[ii] = 1;
+    if (!valid[ii]) continue;
+
+    const int64_t dt_ns = timestamp_ns[ii] - last_ns_[ii];
+    if (!initialized_[ii] || dt_ns <= 0 || dt_ns > reset_after_ns_) {
+      x_[ii] = position[ii];
+      v_[ii] = std::isnan(velocity[ii]) ? 0.0 : velocity[ii];
+      a_[ii] = 0;
+      initialized_[ii] = 1;
+      z_[ii] = x_[ii];
+    } else {
+      mask_[ii] = 1;
+      z_[ii] = position[ii];
+      dt_[ii] = dt_ns * 1e-9;
+    }
+    last_ns_[ii] = timestamp_ns[ii];
+  }
+
+  double* const x = x_.data();
+  double* const v = v_.data();
+  double* const a = a_.data();
+  const double* const z = z_.data();
+  const double* const dt = dt_.data();
+  const double* const m = mask_.data();
+  const double* const g = g_.data();
+  const double* const h = h_.data();
+  const double* const k = k_.data();
+  for (size_t ii = 0; ii < count; ii++) {
+    const double t = dt[ii];
+    const double inv_t = 1.0 / t;
+    const double xp = x[ii] + v[ii] * t + 0.5 * a[ii] * t * t;
+    const double vp = v[ii] + a[ii] * t;
+    const double r = z[ii] - xp;
+    const double x_new = xp + g[ii] * r;
+    const double v_new = vp + h[ii] * r * inv_t;
+    const double a_new = a[ii] + 2 * k[ii] * r * inv_t * inv_t;
+    x[ii] += m[ii] * (x_new - x[ii]);
+    v[ii] += m[ii] * (v_new - v[ii]);
+    a[ii] += m[ii] * (a_new - a[ii]);
+  }
+}
@@ -0,0 +1,72 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSMOTIONESTIMATOR_H__
+#define MOTEUSMOTIONESTIMATOR_H__
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+class MoteusGroup;
+
+// Filtered position, velocity and acceleration of every servo of a group,
+// estimated from the reported positions and the reply timestamps with an
+// alpha-beta-gamma filter. The servo's own velocity is only used to start
+// the filter.
+//
+// The state is kept as one array per quantity and all servos are updated
+// in a single branch free loop, so the update vectorizes.
+class MotionEstimator {
+ public:
+  // |theta| in (0, 1) sets the smoothing of a critically damped filter,
+  // larger is smoother but lags more. A servo whose replies are more
+  // than |reset_after_s| apart is restarted from its next reply.
+  explicit MotionEstimator(size_t servos, double theta = 0.9,
+                           double reset_after_s = 0.1);
+
+  void SetSmoothing(size_t servo, double theta);
+
+  // Folds in the replies of the group's last cycle.
+  void Update(const MoteusGroup& group);
+  // Same from raw arrays, |valid| marks the servos that have a new
+  // measurement.
+  void Update(const double* position, const double* velocity,
+              const int64_t* timestamp_ns, const uint8_t* valid);
+
+  size_t size() const { return x_.size(); }
+  bool initialized(size_t servo) const { return initialized_[servo] != 0; }
+  double position(size_t servo) const { return x_[servo]; }
+  double velocity(size_t servo) const { return v_[servo]; }
+  double acceleration(size_t servo) const { return a_[servo]; }
+
+ private:
+  const int64_t reset_after_ns_;
+
+  // filter state
+  vector<double> x_, v_, a_;
+  vector<int64_t> last_ns_;
+  vector<uint8_t> initialized_;
+  // gains
+  vector<double> g_, h_, k_;
+  // per update scratch: measurement, time step and update mask
+  vector<double> z_, dt_, mask_;
+  // gather buffers for Update(group)
+  vector<double> position_, velocity_;
+  vector<int64_t> timestamp_ns_;
+  vector<uint8_t> valid_;
+};
+
+#endif  // MOTEUSMOTIONESTIMATOR_H__
@@ -0,0 +1,189 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "QueryCoalescer.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "FrameLayout.h"
+
+using mjbots::moteus::QueryCommand;
+using mjbots::moteus::Resolution;
+
+namespace {
+
+// the servo's own resolution for a field it queries anyway, the default
+// for a field only a subscriber wants
+Resolution Pick(bool wanted, Resolution configured, Resolution fallback) {
+  if (configured != Resolution::kIgnore) return configured;
+  return wanted ? fallback : Resolution::kIgnore;
+}
+
+// copies the fields flagged in |fields|
+void CopyFields(const State& from, const State& fields, State* to) {
+  if (fields.position_flag) to->position = from.position;
+  if (fields.velocity_flag) to->velocity = from.velocity;
+  if (fields.torque_flag) to->torque = from.torque;
+  if (fields.q_curr_flag) to->q_curr = from.q_curr;
+  if (fields.d_curr_flag) to->d_curr = from.d_curr;
+  if (fields.rezero_state_flag) to->rezero_state = from.rezero_state;
+  if (fields.voltage_flag) to->voltage = from.voltage;
+  if (fields.temperature_flag) to->temperature = from.temperature;
+  if (fields.fault_flag) to->fault = from.fault;
+  if (fields.mode_flag) to->mode = from.mode;
+}
+
+}  // namespace
+
+QueryCoalescer::QueryCoalescer(MoteusGroup& group)
+    : group_(group),
+      subscribers_(group.size()),
+      configured_(group.size()),
+      dirty_(group.size(), false),
+      reconfigurations_(group.reconfigurations()) {
+  Snapshot();
+}
+
+void QueryCoalescer::Snapshot() {
+  for (size_t ii = 0; ii < configured_.size(); ii++) {
+    const auto& config = group_.config(ii);
+    configured_[ii].command = config.command;
+    configured_[ii].within = config.within;
+    configured_[ii].query = config.query;
+  }
+}
+
+int QueryCoalescer::Subscribe(size_t servo, const State& fields) {
+  // the number of servos never changes, not even on a reconfiguration
+  if (servo >= subscribers_.size()) {
+    throw std::runtime_error("QueryCoalescer: no servo " + to_string(servo));
+  }
+  lock_guard<mutex> lock(mutex_);
+  Consumer consumer;
+  consumer.servo = servo;
+  consumer.active = true;
+  consumer.state = fields;
+  consumers_.push_back(consumer);
+  const int id = static_cast<int>(consumers_.size() - 1);
+  subscribers_[servo].push_back(id);
+
+  // refuse subscriptions whose query would not fit the servo's frames
+  const Configured& config = configured_[servo];
+  const QueryCommand query = Union(servo);
+  try {
+    MakePositionLayout(config.command, query);
+    MakeWithinLayout(config.within, query);
+  } catch (const std::runtime_error&) {
+    subscribers_[servo].pop_back();
+    consumers_.back().active = false;
+    throw;
+  }
+  dirty_[servo] = any_dirty_ = true;
+  return id;
+}
+
+void QueryCoalescer::Unsubscribe(int consumer) {
+  lock_guard<mutex> lock(mutex_);
+  auto& entry = consumers_.at(consumer);
+  if (!entry.active) return;
+  entry.active = false;
+  auto& list = subscribers_[entry.servo];
+  list.erase(std::find(list.begin(), list.end(), consumer));
+  dirty_[entry.servo] = any_dirty_ = true;
+}
+
+QueryCommand QueryCoalescer::Union(size_t servo) const {
+  const QueryCommand& configured = configured_[servo].query;
+  State wanted;
+  for (const int id : subscribers_[servo]) {
+    const State& fields = consumers_[id].state;
+    wanted.mode_flag |= fields.mode_flag;
+    wanted.position_flag |= fields.position_flag;
+    wanted.velocity_flag |= fields.velocity_flag;
+    wanted.torque_flag |= fields.torque_flag;
+    wanted.q_curr_flag |= fields.q_curr_flag;
+    wanted.d_curr_flag |= fields.d_curr_flag;
+    wanted.rezero_state_flag |= fields.rezero_state_flag;
+    wanted.voltage_flag |= fields.voltage_flag;
+    wanted.temperature_flag |= fields.temperature_flag;
+    wanted.fault_flag |= fields.fault_flag;
+  }
+
+  const QueryCommand fallback;
+  QueryCommand query;
+  query.mode = Pick(wanted.mode_flag, configured.mode, fallback.mode);
+  query.position =
+      Pick(wanted.position_flag, configured.position, fallback.position);
+  query.velocity =
+      Pick(wanted.velocity_flag, configured.velocity, fallback.velocity);
+  query.torque = Pick(wanted.torque_flag, configured.torque, fallback.torque);
+  query.q_current =
+      Pick(wanted.q_curr_flag, configured.q_current, fallback.q_current);
+  query.d_current =
+      Pick(wanted.d_curr_flag, configured.d_current, fallback.d_current);
+  query.rezero_state = Pick(wanted.rezero_state_flag, configured.rezero_state,
+                            fallback.rezero_state);
+  query.voltage =
+      Pick(wanted.voltage_flag, configured.voltage, fallback.voltage);
+  query.temperature = Pick(wanted.temperature_flag, configured.temperature,
+                           fallback.temperature);
+  query.fault = Pick(wanted.fault_flag, configured.fault, fallback.fault);
+  return query;
+}
+
+void QueryCoalescer::Rebuild(size_t servo) {
+  try {
+    group_.SetQuery(servo, Union(servo));
+  } catch (const std::runtime_error&) {
+    // checked in Subscribe(), but the servo's command resolutions may
+    // have changed since; the servo keeps its current query
+  }
+}
+
+void QueryCoalescer::Distribute() {
+  lock_guard<mutex> lock(mutex_);
+  for (auto& consumer : consumers_) {
+    if (!consumer.active) continue;
+    consumer.replied = group_.replied(consumer.servo);
+    if (consumer.replied) {
+      CopyFields(group_.decoded(consumer.servo), consumer.state,
+                 &consumer.state);
+    }
+  }
+
+  // the unions follow the queries of a new topology
+  if (group_.reconfigurations() != reconfigurations_) {
+    reconfigurations_ = group_.reconfigurations();
+    Snapshot();
+    for (size_t ii = 0; ii < dirty_.size(); ii++) {
+      if (!subscribers_[ii].empty()) dirty_[ii] = any_dirty_ = true;
+    }
+  }
+
+  // the new queries go out with the next cycle
+  if (!any_dirty_) return;
+  for (size_t ii = 0; ii < dirty_.size(); ii++) {
+    if (dirty_[ii]) Rebuild(ii);
+    dirty_[ii] = false;
+  }
+  any_dirty_ = false;
+}
+
+bool QueryCoalescer::Read(int consumer, State* state) const {
+  lock_guard<mutex> lock(mutex_);
+  const auto& entry = consumers_.at(consumer);
+  CopyFields(entry.state, entry.state, state);
+  return entry.replied;
+}
@@ -0,0 +1,90 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSQUERYCOALESCER_H__
+#define MOTEUSQUERYCOALESCER_H__
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "MoteusGroup.h"
+
+using namespace std;
+
+// Lets several parts of an application read the same servos without
+// each of them going to the bus. Consumers subscribe with the State
+// flags they need; the group then queries every servo for the union of
+// its subscriptions, once per frame it sends, and Distribute() copies
+// the decoded fields to each consumer.
+//
+// Subscriptions only add to the query of the servo's topology, the
+// fields it already has keep their resolution and the others are
+// queried at the default resolution.
+//
+// Subscribe(), Unsubscribe() and Read() may be called from any thread,
+// subscription changes reach the group in the next Distribute(). The
+// constructor and Distribute() belong to the thread calling Cycle(),
+// they copy what the coalescer needs of the group's topology.
+class QueryCoalescer {
+ public:
+  explicit QueryCoalescer(MoteusGroup& group);
+
+  // Returns the consumer id. Throws std::runtime_error if the fields
+  // would no longer fit the servo's command frames.
+  int Subscribe(size_t servo, const State& fields);
+  void Unsubscribe(int consumer);
+
+  // Call after each Cycle().
+  void Distribute();
+
+  // Copies the fields the consumer subscribed to into |state|, the other
+  // fields are left alone. Returns false if the servo did not reply in
+  // the last distributed cycle.
+  bool Read(int consumer, State* state) const;
+
+ private:
+  struct Consumer {
+    size_t servo = 0;
+    bool active = false;
+    bool replied = false;
+    State state;
+  };
+
+  // what the topology configures for a servo, copied on the Cycle()
+  // thread so that other threads never read the group's topology
+  struct Configured {
+    mjbots::moteus::PositionResolution command;
+    mjbots::moteus::WithinResolution within;
+    mjbots::moteus::QueryCommand query;
+  };
+  void Snapshot();
+
+  // the topology's query with the fields of every subscriber added
+  mjbots::moteus::QueryCommand Union(size_t servo) const;
+  void Rebuild(size_t servo);
+
+  MoteusGroup& group_;
+  mutable mutex mutex_;
+  vector<Consumer> consumers_;
+  // per servo
+  vector<vector<int>> subscribers_;
+  vector<Configured> configured_;
+  vector<bool> dirty_;
+  bool any_dirty_ = false;
+  // MoteusGroup::reconfigurations() the unions were built for
+  int64_t reconfigurations_ = 0;
+};
+
+#endif  // MOTEUSQUERYCOALESCER_H__
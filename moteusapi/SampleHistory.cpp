@@ -0,0 +1,84 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "SampleHistory.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "MoteusGroup.h"
+
+namespace {
+
+size_t RoundUp(size_t capacity) {
+  size_t result = 1;
+  while (result < capacity) result <<= 1;
+  return result;
+}
+
+}  // namespace
+
+bool HistoryWindow::valid() const {
+  if (count_ == nullptr) return true;
+  atomic_thread_fence(memory_order_acquire);
+  // the writer overwrites slot first_ while count is first_ + slots
+  return count_->load(memory_order_relaxed) - first_ < slots_;
+}
+
+SampleHistory::SampleHistory(size_t servos, size_t capacity)
+    : slots_(RoundUp(capacity + 1)), rings_(servos) {
+  if (capacity == 0) {
+    throw std::runtime_error("SampleHistory: capacity must not be 0");
+  }
+  for (auto& ring : rings_) {
+    ring.times.reset(new int64_t[slots_]());
+    ring.values.reset(new double[slots_ * kFields]());
+  }
+}
+
+void SampleHistory::Append(size_t servo, int64_t timestamp_ns,
+                           const State& state) {
+  Ring& ring = rings_.at(servo);
+  const uint64_t count = ring.count.load(memory_order_relaxed);
+  const size_t slot = count & (slots_ - 1);
+  ring.times[slot] = timestamp_ns;
+  for (size_t ii = 0; ii < kFields; ii++) {
+    ring.values[ii * slots_ + slot] =
+        FieldValue(state, static_cast<TelemetryField>(ii));
+  }
+  // publishes the slot
+  ring.count.store(count + 1, memory_order_release);
+}
+
+void SampleHistory::Record(const MoteusGroup& group) {
+  for (size_t ii = 0; ii < group.size(); ii++) {
+    if (group.replied(ii)) {
+      Append(ii, group.reply_time_ns(ii), group.decoded(ii));
+    }
+  }
+}
+
+HistoryWindow SampleHistory::Window(size_t servo, size_t samples) const {
+  const Ring& ring = rings_.at(servo);
+  const uint64_t count = ring.count.load(memory_order_acquire);
+
+  HistoryWindow window;
+  window.times_ = ring.times.get();
+  window.values_ = ring.values.get();
+  window.count_ = &ring.count;
+  window.slots_ = slots_;
+  window.size_ = min<uint64_t>({samples, count, capacity()});
+  window.first_ = count - window.size_;
+  return window;
+}
@@ -0,0 +1,118 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSSAMPLEHISTORY_H__
+#define MOTEUSSAMPLEHISTORY_H__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "MoteusAPI.h"
+#include "TelemetryStore.h"
+
+using namespace std;
+
+class MoteusGroup;
+
+// The latest samples of one servo, read in place from its ring. Index 0
+// is the oldest sample of the window, size() - 1 the newest.
+//
+// Reading takes no lock, so the writer may overwrite the oldest samples
+// meanwhile. Check valid() after reading, and read again if it is
+// false. A window stays valid until capacity() - size() more samples
+// were appended.
+class HistoryWindow {
+ public:
+  HistoryWindow() {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  int64_t time_ns(size_t index) const { return times_[Slot(index)]; }
+  // NAN where the servo was not queried for |field|
+  double value(TelemetryField field, size_t index) const {
+    return values_[static_cast<size_t>(field) * slots_ + Slot(index)];
+  }
+  double position(size_t index) const {
+    return value(TelemetryField::kPosition, index);
+  }
+  double velocity(size_t index) const {
+    return value(TelemetryField::kVelocity, index);
+  }
+  double torque(size_t index) const {
+    return value(TelemetryField::kTorque, index);
+  }
+
+  // Whether none of the samples was overwritten since the window was
+  // taken.
+  bool valid() const;
+
+ private:
+  friend class SampleHistory;
+
+  size_t Slot(size_t index) const { return (first_ + index) & (slots_ - 1); }
+
+  const int64_t* times_ = nullptr;
+  const double* values_ = nullptr;
+  const atomic<uint64_t>* count_ = nullptr;
+  size_t slots_ = 0;
+  uint64_t first_ = 0;
+  size_t size_ = 0;
+};
+
+// A fixed size ring of timestamped samples per servo, each ring a
+// structure of arrays: one array of times and one per field, so a
+// filter over one field walks contiguous memory. Appending is O(1) and
+// allocates nothing. One thread appends, any number read windows
+// without locking.
+class SampleHistory {
+ public:
+  // Keeps at least |capacity| samples per servo. The ring has one more
+  // slot, for the sample being written, rounded up to a power of two.
+  SampleHistory(size_t servos, size_t capacity);
+
+  SampleHistory(const SampleHistory&) = delete;
+  SampleHistory& operator=(const SampleHistory&) = delete;
+
+  void Append(size_t servo, int64_t timestamp_ns, const State& state);
+  // Appends every servo that replied in the group's last cycle.
+  void Record(const MoteusGroup& group);
+
+  // samples a window can hold
+  size_t capacity() const { return slots_ - 1; }
+  // samples appended to |servo| so far
+  uint64_t count(size_t servo) const {
+    return rings_[servo].count.load(memory_order_acquire);
+  }
+
+  // The latest |samples| of |servo|, fewer if it has fewer.
+  HistoryWindow Window(size_t servo, size_t samples) const;
+
+ private:
+  static const size_t kFields = static_cast<size_t>(TelemetryField::kCount);
+
+  struct Ring {
+    unique_ptr<int64_t[]> times;
+    // field major, slots_ values per field
+    unique_ptr<double[]> values;
+    atomic<uint64_t> count{0};
+  };
+
+  const size_t slots_;
+  vector<Ring> rings_;
+};
+
+#endif  // MOTEUSSAMPLEHISTORY_H__
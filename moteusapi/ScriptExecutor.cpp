@@ -0,0 +1,279 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ScriptExecutor.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using mjbots::moteus::PositionCommand;
+
+namespace {
+
+string Trim(const string& str) {
+  const auto begin = str.find_first_not_of(" \t\r");
+  if (begin == string::npos) return "";
+  const auto end = str.find_last_not_of(" \t\r");
+  return str.substr(begin, end - begin + 1);
+}
+
+vector<string> SplitCsv(const string& line) {
+  vector<string> result;
+  istringstream iss(line);
+  string cell;
+  while (getline(iss, cell, ',')) result.push_back(Trim(cell));
+  if (!line.empty() && line.back() == ',') result.push_back("");
+  return result;
+}
+
+enum class Column {
+  kTime,
+  kServo,
+  kMode,
+  kPosition,
+  kVelocity,
+  kFeedforwardTorque,
+  kKpScale,
+  kKdScale,
+  kMaximumTorque,
+  kStopPosition,
+  kWatchdogTimeout,
+};
+
+Column ParseColumn(const string& name) {
+  static const pair<const char*, Column> kColumns[] = {
+      {"time", Column::kTime},
+      {"servo", Column::kServo},
+      {"mode", Column::kMode},
+      {"position", Column::kPosition},
+      {"velocity", Column::kVelocity},
+      {"feedforward_torque", Column::kFeedforwardTorque},
+      {"kp_scale", Column::kKpScale},
+      {"kd_scale", Column::kKdScale},
+      {"maximum_torque", Column::kMaximumTorque},
+      {"stop_position", Column::kStopPosition},
+      {"watchdog_timeout", Column::kWatchdogTimeout},
+  };
+  for (const auto& column : kColumns) {
+    if (name == column.first) return column.second;
+  }
+  throw runtime_error("unknown column '" + name + "'");
+}
+
+}  // namespace
+
+CommandScript LoadCommandScript(const string& path, const Topology& topology) {
+  ifstream file(path);
+  if (!file) throw runtime_error("CommandScript: unable to open " + path);
+  stringstream ss;
+  ss << file.rdbuf();
+  return ParseCommandScript(ss.str(), topology, path);
+}
+
+CommandScript ParseCommandScript(const string& text, const Topology& topology,
+                                 const string& source) {
+  CommandScript script;
+  vector<Column> columns;
+  int line_number = 0;
+  auto fail = [&](const string& message) {
+    throw runtime_error("CommandScript: " + source + ":" +
+                        to_string(line_number) + ": " + message);
+  };
+
+  istringstream iss(text);
+  string line;
+  while (getline(iss, line)) {
+    line_number++;
+    line = Trim(line);
+    if (line.empty() || line.front() == '#') continue;
+    const auto cells = SplitCsv(line);
+
+    if (columns.empty()) {
+      try {
+        for (const auto& cell : cells) columns.push_back(ParseColumn(cell));
+      } catch (const runtime_error& e) {
+        fail(e.what());
+      }
+      for (const auto column :
+           {Column::kTime, Column::kServo, Column::kMode}) {
+        if (find(columns.begin(), columns.end(), column) == columns.end()) {
+          fail("header needs the time, servo and mode columns");
+        }
+      }
+      continue;
+    }
+
+    if (cells.size() != columns.size()) {
+      fail("expected " + to_string(columns.size()) + " cells");
+    }
+
+    ScriptEvent event;
+    event.line = line_number;
+    PositionCommand& c = event.command;
+    for (size_t ii = 0; ii < cells.size(); ii++) {
+      const string& cell = cells[ii];
+      if (columns[ii] == Column::kServo) {
+        const int servo = topology.ServoIndex(cell);
+        if (servo < 0) fail("unknown servo '" + cell + "'");
+        event.servo = servo;
+        continue;
+      }
+      if (columns[ii] == Column::kMode) {
+        if (cell == "position") {
+          event.mode = ScriptMode::kPosition;
+        } else if (cell == "stop") {
+          event.mode = ScriptMode::kStop;
+        } else if (cell == "query") {
+          event.mode = ScriptMode::kQuery;
+        } else {
+          fail("unknown mode '" + cell + "'");
+        }
+        continue;
+      }
+      if (cell.empty()) {
+        if (columns[ii] == Column::kTime) fail("missing time");
+        continue;
+      }
+
+      double value = 0;
+      size_t used = 0;
+      try {
+        value = stod(cell, &used);
+      } catch (const logic_error&) {
+      }
+      if (used == 0 || used != cell.size()) {
+        fail("'" + cell + "' is not a number");
+      }
+      switch (columns[ii]) {
+        case Column::kTime:
+          if (!(value >= 0)) fail("time must not be negative");
+          event.time = value;
+          break;
+        case Column::kPosition:
+          c.position = value;
+          break;
+        case Column::kVelocity:
+          c.velocity = value;
+          break;
+        case Column::kFeedforwardTorque:
+          c.feedforward_torque = value;
+          break;
+        case Column::kKpScale:
+          c.kp_scale = value;
+          break;
+        case Column::kKdScale:
+          c.kd_scale = value;
+          break;
+        case Column::kMaximumTorque:
+          c.maximum_torque = value;
+          break;
+        case Column::kStopPosition:
+          c.stop_position = value;
+          break;
+        case Column::kWatchdogTimeout:
+          c.watchdog_timeout = value;
+          break;
+        case Column::kServo:
+        case Column::kMode:
+          break;
+      }
+    }
+    script.events.push_back(event);
+  }
+
+  stable_sort(script.events.begin(), script.events.end(),
+              [](const ScriptEvent& lhs, const ScriptEvent& rhs) {
+                return lhs.time < rhs.time;
+              });
+  return script;
+}
+
+ScriptExecutor::ScriptExecutor(MoteusGroup& group, const CommandScript& script)
+    : group_(group), script_(script), runner_(group.topology().rate_hz) {
+  for (const auto& event : script_.events) {
+    if (event.servo >= group_.size()) {
+      throw runtime_error("ScriptExecutor: script does not match the group");
+    }
+  }
+}
+
+void ScriptExecutor::Run(double tail_s) {
+  const auto& events = script_.events;
+  const int64_t period_ns = runner_.period_ns();
+  const int64_t end_ns = llround((script_.duration() + tail_s) * 1e9);
+
+  // reserve up front so recording does not allocate while cycling
+  records_.clear();
+  records_.reserve((end_ns / period_ns + 1) * group_.size());
+  timeouts_ = 0;
+
+  vector<int> lines(group_.size(), 0);
+  size_t next = 0;
+  runner_.Run([&](int64_t tick) {
+    const int64_t time_ns = tick * period_ns;
+    while (next < events.size() &&
+           llround(events[next].time * 1e9) <= time_ns) {
+      const auto& event = events[next++];
+      switch (event.mode) {
+        case ScriptMode::kPosition:
+          group_.SetPositionCommand(event.servo, event.command);
+          break;
+        case ScriptMode::kStop:
+          group_.SetStopCommand(event.servo);
+          break;
+        case ScriptMode::kQuery:
+          group_.ClearCommand(event.servo);
+          break;
+      }
+      lines[event.servo] = event.line;
+    }
+
+    if (!group_.Cycle()) timeouts_++;
+
+    for (size_t ii = 0; ii < group_.size(); ii++) {
+      if (!group_.replied(ii)) continue;
+      records_.emplace_back();
+      auto& record = records_.back();
+      record.time = time_ns * 1e-9;
+      record.timestamp_ns = group_.reply_time_ns(ii);
+      record.servo = ii;
+      record.line = lines[ii];
+      record.state = group_.decoded(ii);
+    }
+
+    return next < events.size() || time_ns < end_ns;
+  });
+}
+
+void ScriptExecutor::WriteLog(ostream& os) const {
+  os << "time,timestamp_ns,servo,line,mode,position,velocity,torque,q_curr,"
+        "d_curr,rezero_state,voltage,temperature,fault\n";
+  os << std::setprecision(9);
+  for (const auto& record : records_) {
+    const State& s = record.state;
+    os << record.time << ',' << record.timestamp_ns << ','
+       << group_.config(record.servo).name << ',' << record.line << ','
+       << s.mode << ',' << s.position << ',' << s.velocity << ',' << s.torque
+       << ',' << s.q_curr << ',' << s.d_curr << ',' << s.rezero_state << ','
+       << s.voltage << ',' << s.temperature << ',' << s.fault << '\n';
+  }
+}
+
+void ScriptExecutor::SaveLog(const string& path) const {
+  ofstream file(path);
+  if (!file) throw runtime_error("ScriptExecutor: unable to write " + path);
+  WriteLog(file);
+}
@@ -0,0 +1,102 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSSCRIPTEXECUTOR_H__
+#define MOTEUSSCRIPTEXECUTOR_H__
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "LoopRunner.h"
+#include "MoteusGroup.h"
+
+using namespace std;
+
+enum class ScriptMode { kPosition, kStop, kQuery };
+
+struct ScriptEvent {
+  // seconds from the start of the script
+  double time = 0;
+  size_t servo = 0;
+  ScriptMode mode = ScriptMode::kQuery;
+  mjbots::moteus::PositionCommand command;
+  // line in the script file, for the log
+  int line = 0;
+};
+
+// A CSV file with a header line naming the columns. time, servo and
+// mode are required, the remaining columns are the PositionCommand
+// fields and may be left empty to keep their defaults:
+//
+//   time,servo,mode,position,velocity,feedforward_torque,maximum_torque
+//   0.0,shoulder,position,0,0,,1
+//   1.5,shoulder,position,nan,0,-0.2,1
+//   6.5,shoulder,stop,,,,
+//
+// mode is one of position, stop or query. Servos are referred to by
+// their topology name. Events are sorted by time, events with the same
+// time keep their file order.
+struct CommandScript {
+  vector<ScriptEvent> events;
+
+  double duration() const { return events.empty() ? 0 : events.back().time; }
+};
+
+CommandScript LoadCommandScript(const string& path, const Topology& topology);
+CommandScript ParseCommandScript(const string& text, const Topology& topology,
+                                 const string& source = "<string>");
+
+struct ScriptRecord {
+  // scheduled time of the cycle, seconds from the start
+  double time = 0;
+  // NowNs() when the reply was read
+  int64_t timestamp_ns = 0;
+  size_t servo = 0;
+  // script line of the command the servo was executing, 0 for none
+  int line = 0;
+  State state;
+};
+
+// Plays a command script through MoteusGroup::Cycle() at the bus rate.
+// An event is applied on the first cycle whose scheduled time is not
+// before the event time, so the timing is exact to one bus period and
+// independent of how long the cycles take. Every reply is recorded.
+class ScriptExecutor {
+ public:
+  ScriptExecutor(MoteusGroup& group, const CommandScript& script);
+
+  // Blocks until the script finished and |tail_s| more seconds passed.
+  void Run(double tail_s = 0);
+  // Safe to call from any thread.
+  void Stop() { runner_.Stop(); }
+
+  const vector<ScriptRecord>& records() const { return records_; }
+  // cycles that had to be skipped because the loop fell behind
+  int64_t overruns() const { return runner_.overruns(); }
+  // cycles in which a servo did not answer
+  int64_t timeouts() const { return timeouts_; }
+
+  void WriteLog(ostream& os) const;
+  void SaveLog(const string& path) const;
+
+ private:
+  MoteusGroup& group_;
+  const CommandScript script_;
+  LoopRunner runner_;
+  vector<ScriptRecord> records_;
+  int64_t timeouts_ = 0;
+};
+
+#endif  // MOTEUSSCRIPTEXECUTOR_H__
@@ -0,0 +1,274 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifdef __linux__
+
+#include "SocketCan.h"
+
+#include <errno.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include "Clock.h"
+#include "FrameLayout.h"
+
+namespace {
+
+const size_t kControlSize = CMSG_SPACE(sizeof(struct timespec));
+
+int64_t NowUs() { return NowNs() / 1000; }
+
+void ToCanFd(const BusFrame& frame, canfd_frame* out) {
+  mjbots::moteus::CanFrame padded = frame.frame;
+  PadFrame(&padded);
+  out->can_id = frame.arbitration_id;
+  if (out->can_id > CAN_SFF_MASK) out->can_id |= CAN_EFF_FLAG;
+  out->len = padded.size;
+  out->flags = CANFD_BRS;
+  memcpy(out->data, padded.data, padded.size);
+}
+
+void SetupMessages(vector<canfd_frame>* frames, vector<struct iovec>* iov,
+                   vector<struct mmsghdr>* msgs, size_t count) {
+  frames->resize(count);
+  iov->resize(count);
+  msgs->resize(count);
+  for (size_t ii = 0; ii < count; ii++) {
+    (*iov)[ii].iov_base = &(*frames)[ii];
+    (*iov)[ii].iov_len = CANFD_MTU;
+    (*msgs)[ii] = {};
+    (*msgs)[ii].msg_hdr.msg_iov = &(*iov)[ii];
+    (*msgs)[ii].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+// The kernel stamps frames with CLOCK_REALTIME, this is how far it is
+// ahead of NowNs().
+int64_t RealtimeOffsetNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec - NowNs();
+}
+
+}  // namespace
+
+const size_t SocketCan::kBatch;
+
+SocketCan::SocketCan(const string& interface)
+    : interface_(interface), dev_name_("socketcan:" + interface) {
+  fd_ = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
+  if (fd_ < 0) {
+    throw std::runtime_error("SocketCan: Unable to open a CAN socket");
+  }
+
+  const int enable = 1;
+  if (setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable,
+                 sizeof(enable)) < 0 ||
+      setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) <
+          0) {
+    close(fd_);
+    throw std::runtime_error("SocketCan: " + interface_ +
+                             " does not support CAN-FD");
+  }
+
+  struct ifreq ifr = {};
+  strncpy(ifr.ifr_name, interface_.c_str(), IFNAMSIZ - 1);
+  if (ioctl(fd_, SIOCGIFINDEX, &ifr) < 0) {
+    close(fd_);
+    throw std::runtime_error("SocketCan: Unknown interface " + interface_);
+  }
+
+  struct sockaddr_can addr = {};
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) <
+      0) {
+    close(fd_);
+    throw std::runtime_error("SocketCan: Unable to bind to " + interface_);
+  }
+
+  // every buffer is set up once, a cycle only fills in frames
+  SetupMessages(&tx_, &tx_iov_, &tx_msgs_, kBatch);
+  SetupMessages(&urgent_, &urgent_iov_, &urgent_msgs_, kMaxUrgent);
+  SetupMessages(&rx_, &rx_iov_, &rx_msgs_, kBatch);
+  rx_time_ns_.resize(kBatch);
+  rx_control_.resize(kBatch * kControlSize);
+  for (size_t ii = 0; ii < kBatch; ii++) {
+    rx_msgs_[ii].msg_hdr.msg_control = &rx_control_[ii * kControlSize];
+  }
+}
+
+SocketCan::~SocketCan() {
+  if (fd_ >= 0) close(fd_);
+}
+
+shared_ptr<SocketCan> SocketCan::Open(const string& interface) {
+  static mutex registry_mutex;
+  static map<string, weak_ptr<SocketCan>> registry;
+
+  lock_guard<mutex> lock(registry_mutex);
+  auto& entry = registry[interface];
+  shared_ptr<SocketCan> result = entry.lock();
+  if (!result) {
+    result = make_shared<SocketCan>(interface);
+    entry = result;
+  }
+  return result;
+}
+
+bool SocketCan::Send(const BusFrame* frames, size_t count, int timeout_us) {
+  if (stale_) {
+    Drain();
+    stale_ = false;
+  }
+
+  const int64_t deadline_us = NowUs() + timeout_us;
+  size_t sent = 0;
+  while (sent < count) {
+    const size_t batch = min(count - sent, batching_ ? kBatch : 1);
+    for (size_t ii = 0; ii < batch; ii++) ToCanFd(frames[sent + ii], &tx_[ii]);
+
+    const int n = batching_ ? sendmmsg(fd_, tx_msgs_.data(), batch, 0)
+                            : (write(fd_, &tx_[0], CANFD_MTU) == CANFD_MTU
+                                   ? 1
+                                   : -1);
+    if (n < 0) {
+      // the interface queue is full, wait for room
+      if (errno != EAGAIN && errno != ENOBUFS && errno != EINTR) return false;
+      const int64_t remaining_us = deadline_us - NowUs();
+      if (remaining_us <= 0 || !Wait(true, remaining_us)) return false;
+      continue;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+bool SocketCan::SendUrgent(const BusFrame* frames, size_t count) {
+  if (count > kMaxUrgent) return false;
+  lock_guard<mutex> lock(urgent_mutex_);
+  for (size_t ii = 0; ii < count; ii++) ToCanFd(frames[ii], &urgent_[ii]);
+  const int64_t deadline_us = NowUs() + kUrgentTimeoutUs;
+  size_t sent = 0;
+  while (sent < count) {
+    const int n = sendmmsg(fd_, urgent_msgs_.data() + sent, count - sent, 0);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != ENOBUFS && errno != EINTR) return false;
+      const int64_t remaining_us = deadline_us - NowUs();
+      if (remaining_us <= 0 || !Wait(true, remaining_us)) return false;
+      continue;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// A raw socket acknowledges nothing, sent frames are in the kernel queue
+// once Send() returned.
+bool SocketCan::Receive(size_t /* acks */, size_t expected,
+                        BusFrame* replies, size_t max_replies,
+                        size_t* received, int timeout_us) {
+  const int64_t deadline_us = NowUs() + timeout_us;
+  size_t replied = 0;
+  bool error = false;
+
+  while (replied < expected) {
+    // never read past the replies of this cycle
+    const int n = ReadPending(min(expected - replied, kBatch));
+    if (n < 0) {
+      error = true;
+      break;
+    }
+    if (n == 0) {
+      const int64_t remaining_us = deadline_us - NowUs();
+      if (remaining_us <= 0 || !Wait(false, remaining_us)) {
+        stale_ = true;
+        break;
+      }
+      continue;
+    }
+
+    for (int ii = 0; ii < n; ii++) {
+      const auto& in = rx_[ii];
+      if (in.can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG)) continue;
+      if (replied == max_replies) continue;
+      auto& reply = replies[replied++];
+      reply.arbitration_id = static_cast<uint16_t>(in.can_id & CAN_EFF_MASK);
+      reply.frame.size = min<size_t>(in.len, sizeof(reply.frame.data));
+      memcpy(reply.frame.data, in.data, reply.frame.size);
+      reply.timestamp_ns = rx_time_ns_[ii];
+    }
+  }
+
+  *received = replied;
+  return !error && replied >= expected;
+}
+
+bool SocketCan::Wait(bool write, int64_t timeout_us) const {
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(fd_, &fds);
+  struct timeval tv;
+  tv.tv_sec = timeout_us / 1000000;
+  tv.tv_usec = timeout_us % 1000000;
+  const int n = select(fd_ + 1, write ? nullptr : &fds, write ? &fds : nullptr,
+                       nullptr, timeout_us < 0 ? nullptr : &tv);
+  return n > 0 || (n < 0 && errno == EINTR);
+}
+
+int SocketCan::ReadPending(size_t max) {
+  if (!batching_) max = 1;
+  for (size_t ii = 0; ii < max; ii++) {
+    rx_msgs_[ii].msg_hdr.msg_controllen = kControlSize;
+  }
+
+  const int n =
+      batching_ ? recvmmsg(fd_, rx_msgs_.data(), max, MSG_DONTWAIT, nullptr)
+                : (recvmsg(fd_, &rx_msgs_[0].msg_hdr, MSG_DONTWAIT) < 0 ? -1
+                                                                       : 1);
+  if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+  const int64_t offset_ns = RealtimeOffsetNs();
+  for (int ii = 0; ii < n; ii++) {
+    rx_time_ns_[ii] = NowNs();
+    auto& hdr = rx_msgs_[ii].msg_hdr;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET ||
+          cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+        continue;
+      }
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      rx_time_ns_[ii] = ts.tv_sec * 1000000000LL + ts.tv_nsec - offset_ns;
+    }
+  }
+  return n;
+}
+
+void SocketCan::Drain() {
+  while (ReadPending(kBatch) > 0) {
+  }
+}
+
+#endif  // __linux__
@@ -0,0 +1,105 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSSOCKETCAN_H__
+#define MOTEUSSOCKETCAN_H__
+
+#ifdef __linux__
+
+#include <linux/can.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Transport.h"
+
+using namespace std;
+
+// A raw CAN-FD socket on a SocketCAN interface, e.g. a PCAN or mcp2518
+// adapter, or vcan for benchmarks. A whole cycle of frames goes out
+// with one sendmmsg() and the replies are collected with recvmmsg(),
+// so a cycle costs a couple of system calls whatever the number of
+// servos. Reply times are the kernel receive timestamps.
+//
+// Arbitration ids above 11 bits are sent as extended frames, with bit
+// rate switching. The kernel has taken a frame once it was sent, so
+// there is nothing to acknowledge.
+class SocketCan : public Transport {
+ public:
+  explicit SocketCan(const string& interface);
+  ~SocketCan();
+
+  // Returns the transport already open for |interface|, or opens it.
+  static shared_ptr<SocketCan> Open(const string& interface);
+
+  SocketCan(const SocketCan&) = delete;
+  SocketCan& operator=(const SocketCan&) = delete;
+
+  const string& dev_name() const override { return dev_name_; }
+
+  bool Send(const BusFrame* frames, size_t count, int timeout_us) override;
+
+  bool Receive(size_t acks, size_t expected, BusFrame* replies,
+               size_t max_replies, size_t* received,
+               int timeout_us) override;
+
+  bool SendUrgent(const BusFrame* frames, size_t count) override;
+
+  // With batching off every frame takes its own write() and read(), to
+  // measure what the batching saves.
+  void SetBatching(bool batching) { batching_ = batching; }
+  bool batching() const { return batching_; }
+
+ private:
+  // the most frames one system call moves
+  static const size_t kBatch = 64;
+
+  // Waits until the socket is readable, or writable, or |timeout_us|
+  // elapsed; a negative timeout waits forever.
+  bool Wait(bool write, int64_t timeout_us) const;
+  // Reads what is pending, up to |max| frames, into rx_. Returns the
+  // number read, 0 if nothing was pending, -1 on error.
+  int ReadPending(size_t max);
+  void Drain();
+
+  const string interface_;
+  const string dev_name_;
+  int fd_ = -1;
+  bool batching_ = true;
+  // a cycle timed out, its late replies must not count for the next one
+  bool stale_ = false;
+
+  // urgent frames have their own buffers, set up like tx_
+  mutex urgent_mutex_;
+  vector<canfd_frame> urgent_;
+  vector<struct iovec> urgent_iov_;
+  vector<struct mmsghdr> urgent_msgs_;
+
+  vector<canfd_frame> tx_;
+  vector<canfd_frame> rx_;
+  vector<int64_t> rx_time_ns_;
+  vector<struct iovec> tx_iov_;
+  vector<struct iovec> rx_iov_;
+  vector<struct mmsghdr> tx_msgs_;
+  vector<struct mmsghdr> rx_msgs_;
+  // room for the SCM_TIMESTAMPNS control message of every received frame
+  vector<char> rx_control_;
+};
+
+#endif  // __linux__
+
+#endif  // MOTEUSSOCKETCAN_H__
@@ -0,0 +1,186 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "StateView.h"
+
+using namespace mjbots::moteus;
+
+namespace {
+
+int FieldOf(uint32_t reg) {
+  switch (static_cast<Register>(reg)) {
+    case Register::kMode:
+      return static_cast<int>(TelemetryField::kMode);
+    case Register::kPosition:
+      return static_cast<int>(TelemetryField::kPosition);
+    case Register::kVelocity:
+      return static_cast<int>(TelemetryField::kVelocity);
+    case Register::kTorque:
+      return static_cast<int>(TelemetryField::kTorque);
+    case Register::kQCurrent:
+      return static_cast<int>(TelemetryField::kQCurr);
+    case Register::kDCurrent:
+      return static_cast<int>(TelemetryField::kDCurr);
+    case Register::kRezeroState:
+      return static_cast<int>(TelemetryField::kRezeroState);
+    case Register::kVoltage:
+      return static_cast<int>(TelemetryField::kVoltage);
+    case Register::kTemperature:
+      return static_cast<int>(TelemetryField::kTemperature);
+    case Register::kFault:
+      return static_cast<int>(TelemetryField::kFault);
+    default:
+      return -1;
+  }
+}
+
+size_t ResolutionSize(Resolution res) {
+  switch (res) {
+    case Resolution::kInt8:
+      return 1;
+    case Resolution::kInt16:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+}  // namespace
+
+ReplyLayout::ReplyLayout() {
+  for (auto& res : resolution) res = Resolution::kIgnore;
+}
+
+bool ReplyLayout::Matches(const CanFrame& frame) const {
+  if (frame.size != size || size == 0) return false;
+  for (int ii = 0; ii < headers; ii++) {
+    if (frame.data[header_offset[ii]] != header_value[ii]) return false;
+  }
+  return true;
+}
+
+ReplyLayout ParseReplyLayout(const CanFrame& reply) {
+  static const Resolution kResolutions[] = {
+      Resolution::kInt8, Resolution::kInt16, Resolution::kInt32,
+      Resolution::kFloat};
+
+  ReplyLayout layout;
+  bool complete = true;
+  auto header = [&](size_t offset) {
+    if (layout.headers == ReplyLayout::kMaxHeaders) {
+      complete = false;
+      return;
+    }
+    layout.header_offset[layout.headers] = offset;
+    layout.header_value[layout.headers] = reply.data[offset];
+    layout.headers++;
+  };
+
+  // the same grammar as MultiplexParser, remembering where things are
+  size_t offset = 0;
+  while (offset < reply.size) {
+    const uint8_t cmd = reply.data[offset];
+    if (cmd == Multiplex::kNop) {
+      offset++;
+      continue;
+    }
+    if (cmd < 0x20 || cmd >= 0x30) break;
+    header(offset++);
+
+    const Resolution res = kResolutions[(cmd >> 2) & 0x03];
+    size_t count = cmd & 0x03;
+    if (count == 0) {
+      if (offset >= reply.size) break;
+      header(offset);
+      count = reply.data[offset++];
+    }
+    if (offset >= reply.size) break;
+    header(offset);
+    const uint32_t reg = reply.data[offset++];
+
+    for (size_t ii = 0; ii < count; ii++) {
+      if (offset + ResolutionSize(res) > reply.size) break;
+      const int field = FieldOf(reg + ii);
+      if (field >= 0) {
+        layout.resolution[field] = res;
+        layout.offset[field] = offset;
+      }
+      offset += ResolutionSize(res);
+    }
+  }
+
+  // a layout that cannot be checked is never matched, so every reply is
+  // parsed again
+  layout.size = complete ? reply.size : 0;
+  return layout;
+}
+
+double StateView::get(TelemetryField field) const {
+  const int index = static_cast<int>(field);
+  const Resolution res = layout_->resolution[index];
+  if (res == Resolution::kIgnore) return NAN;
+  const uint8_t offset = layout_->offset[index];
+  MultiplexParser parser(frame_->data + offset, frame_->size - offset);
+
+  switch (field) {
+    case TelemetryField::kPosition:
+      return parser.ReadPosition(res);
+    case TelemetryField::kVelocity:
+      return parser.ReadVelocity(res);
+    case TelemetryField::kTorque:
+      return parser.ReadTorque(res);
+    case TelemetryField::kQCurr:
+    case TelemetryField::kDCurr:
+      return parser.ReadCurrent(res);
+    case TelemetryField::kVoltage:
+      return parser.ReadVoltage(res);
+    case TelemetryField::kTemperature:
+      return parser.ReadTemperature(res);
+    case TelemetryField::kRezeroState: {
+      const double value = parser.ReadMapped(res, 1.0, 1.0, 1.0);
+      return std::isnan(value) ? value : (value != 0);
+    }
+    case TelemetryField::kFault:
+    case TelemetryField::kMode:
+      return parser.ReadMapped(res, 1.0, 1.0, 1.0);
+    case TelemetryField::kCount:
+      break;
+  }
+  return NAN;
+}
+
+State StateView::ToState() const {
+  State state;
+  state.position_flag = has(TelemetryField::kPosition);
+  state.velocity_flag = has(TelemetryField::kVelocity);
+  state.torque_flag = has(TelemetryField::kTorque);
+  state.q_curr_flag = has(TelemetryField::kQCurr);
+  state.d_curr_flag = has(TelemetryField::kDCurr);
+  state.rezero_state_flag = has(TelemetryField::kRezeroState);
+  state.voltage_flag = has(TelemetryField::kVoltage);
+  state.temperature_flag = has(TelemetryField::kTemperature);
+  state.fault_flag = has(TelemetryField::kFault);
+  state.mode_flag = has(TelemetryField::kMode);
+  state.position = position();
+  state.velocity = velocity();
+  state.torque = torque();
+  state.q_curr = q_curr();
+  state.d_curr = d_curr();
+  state.rezero_state = rezero_state();
+  state.voltage = voltage();
+  state.temperature = temperature();
+  state.fault = fault();
+  state.mode = mode();
+  return state;
+}
@@ -0,0 +1,84 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSSTATEVIEW_H__
+#define MOTEUSSTATEVIEW_H__
+
+#include <cstdint>
+
+#include "TelemetryStore.h"
+#include "moteus_protocol.h"
+
+using namespace std;
+
+// Where every State field sits in a reply frame. A servo answers the
+// same query with the same layout, so it is parsed from one reply and
+// only checked against the following ones.
+struct ReplyLayout {
+  static const int kFields = static_cast<int>(TelemetryField::kCount);
+  static const int kMaxHeaders = 16;
+
+  uint8_t size = 0;
+  // kIgnore for fields not in the reply
+  mjbots::moteus::Resolution resolution[kFields];
+  uint8_t offset[kFields] = {};
+  // the bytes between the values, which identify the layout
+  uint8_t headers = 0;
+  uint8_t header_offset[kMaxHeaders] = {};
+  uint8_t header_value[kMaxHeaders] = {};
+
+  ReplyLayout();
+
+  // Whether |frame| has this layout.
+  bool Matches(const mjbots::moteus::CanFrame& frame) const;
+};
+
+// Parses the layout of |reply|. Fields the parser does not understand
+// are left out.
+ReplyLayout ParseReplyLayout(const mjbots::moteus::CanFrame& reply);
+
+// The fields of one reply, decoded only when they are read. The view
+// refers to the frame and the layout, it is valid as long as they are.
+class StateView {
+ public:
+  StateView(const mjbots::moteus::CanFrame& frame, const ReplyLayout& layout)
+      : frame_(&frame), layout_(&layout) {}
+
+  bool has(TelemetryField field) const {
+    return layout_->resolution[static_cast<int>(field)] !=
+           mjbots::moteus::Resolution::kIgnore;
+  }
+  // NAN for fields not in the reply.
+  double get(TelemetryField field) const;
+
+  double position() const { return get(TelemetryField::kPosition); }
+  double velocity() const { return get(TelemetryField::kVelocity); }
+  double torque() const { return get(TelemetryField::kTorque); }
+  double q_curr() const { return get(TelemetryField::kQCurr); }
+  double d_curr() const { return get(TelemetryField::kDCurr); }
+  double rezero_state() const { return get(TelemetryField::kRezeroState); }
+  double voltage() const { return get(TelemetryField::kVoltage); }
+  double temperature() const { return get(TelemetryField::kTemperature); }
+  double fault() const { return get(TelemetryField::kFault); }
+  double mode() const { return get(TelemetryField::kMode); }
+
+  // Every field of the reply, flagged as such.
+  State ToState() const;
+
+ private:
+  const mjbots::moteus::CanFrame* frame_;
+  const ReplyLayout* layout_;
+};
+
+#endif  // MOTEUSSTATEVIEW_H__
@@ -0,0 +1,213 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "TelemetryStore.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "MoteusGroup.h"
+
+namespace {
+
+const int kFields = TelemetryBucket::kFields;
+
+void StateValues(const State& state, double* values) {
+  for (int ii = 0; ii < kFields; ii++) {
+    values[ii] = FieldValue(state, static_cast<TelemetryField>(ii));
+  }
+}
+
+}  // namespace
+
+double FieldValue(const State& state, TelemetryField field) {
+  switch (field) {
+    case TelemetryField::kPosition:
+      return state.position;
+    case TelemetryField::kVelocity:
+      return state.velocity;
+    case TelemetryField::kTorque:
+      return state.torque;
+    case TelemetryField::kQCurr:
+      return state.q_curr;
+    case TelemetryField::kDCurr:
+      return state.d_curr;
+    case TelemetryField::kRezeroState:
+      return state.rezero_state;
+    case TelemetryField::kVoltage:
+      return state.voltage;
+    case TelemetryField::kTemperature:
+      return state.temperature;
+    case TelemetryField::kFault:
+      return state.fault;
+    case TelemetryField::kMode:
+    case TelemetryField::kCount:
+      break;
+  }
+  return state.mode;
+}
+
+vector<TelemetryLevel> TelemetryStore::DefaultLevels() {
+  // 10 s at 1 kHz, 1 min at 100 Hz and 1 h at 1 Hz, about 3.4 MB per servo
+  return {{0.001, 10000}, {0.01, 6000}, {1.0, 3600}};
+}
+
+TelemetryStore::TelemetryStore(size_t servos,
+                               const vector<TelemetryLevel>& levels)
+    : levels_(levels) {
+  if (levels_.empty()) {
+    throw std::runtime_error("TelemetryStore: no levels");
+  }
+  for (size_t ii = 0; ii < levels_.size(); ii++) {
+    const int64_t period_ns = llround(levels_[ii].period_s * 1e9);
+    if (period_ns <= 0 || levels_[ii].capacity == 0) {
+      throw std::runtime_error("TelemetryStore: empty level");
+    }
+    if (ii > 0 && period_ns % period_ns_.back() != 0) {
+      throw std::runtime_error(
+          "TelemetryStore: level periods must be multiples of each other");
+    }
+    period_ns_.push_back(period_ns);
+  }
+
+  rings_.resize(servos * levels_.size());
+  for (size_t ii = 0; ii < rings_.size(); ii++) {
+    rings_[ii].buckets.resize(levels_[ii % levels_.size()].capacity);
+  }
+}
+
+void TelemetryStore::Accumulator::Reset(int64_t start) {
+  start_ns = start;
+  count = 0;
+  for (int ii = 0; ii < kFields; ii++) {
+    min[ii] = INFINITY;
+    max[ii] = -INFINITY;
+    sum[ii] = 0;
+    samples[ii] = 0;
+  }
+}
+
+void TelemetryStore::Accumulator::Add(const double* values,
+                                      const double* mins, const double* maxs,
+                                      uint32_t weight,
+                                      const uint32_t* weights) {
+  count += weight;
+  for (int ii = 0; ii < kFields; ii++) {
+    if (std::isnan(values[ii])) continue;
+    min[ii] = std::min(min[ii], mins[ii]);
+    max[ii] = std::max(max[ii], maxs[ii]);
+    sum[ii] += values[ii] * weights[ii];
+    samples[ii] += weights[ii];
+  }
+}
+
+void TelemetryStore::Accumulator::Store(TelemetryBucket* bucket) const {
+  bucket->start_ns = start_ns;
+  bucket->count = count;
+  for (int ii = 0; ii < kFields; ii++) {
+    bucket->samples[ii] = samples[ii];
+    if (samples[ii] == 0) {
+      bucket->min[ii] = bucket->max[ii] = bucket->mean[ii] = NAN;
+      continue;
+    }
+    bucket->min[ii] = min[ii];
+    bucket->max[ii] = max[ii];
+    bucket->mean[ii] = sum[ii] / samples[ii];
+  }
+}
+
+void TelemetryStore::Append(size_t servo, int64_t timestamp_ns,
+                            const State& state) {
+  double values[kFields];
+  StateValues(state, values);
+  uint32_t ones[kFields];
+  fill(ones, ones + kFields, 1);
+
+  lock_guard<mutex> lock(mutex_);
+  Ring& ring = rings_[servo * levels_.size()];
+  const int64_t start = timestamp_ns - timestamp_ns % period_ns_[0];
+  if (ring.current.count > 0 && ring.current.start_ns != start) {
+    Push(servo, 0);
+  }
+  if (ring.current.count == 0) ring.current.Reset(start);
+  ring.current.Add(values, values, values, 1, ones);
+  latest_ns_ = std::max(latest_ns_, timestamp_ns);
+}
+
+void TelemetryStore::Record(const MoteusGroup& group) {
+  for (size_t ii = 0; ii < group.size(); ii++) {
+    if (group.replied(ii)) {
+      Append(ii, group.reply_time_ns(ii), group.decoded(ii));
+    }
+  }
+}
+
+void TelemetryStore::Push(size_t servo, size_t level) {
+  Ring& ring = rings_[servo * levels_.size() + level];
+  TelemetryBucket& bucket = ring.buckets[ring.head];
+  ring.current.Store(&bucket);
+  ring.head = (ring.head + 1) % ring.buckets.size();
+  ring.size = std::min(ring.size + 1, ring.buckets.size());
+  ring.current.count = 0;
+
+  if (level + 1 < levels_.size()) Fold(servo, level + 1, bucket);
+}
+
+void TelemetryStore::Fold(size_t servo, size_t level,
+                          const TelemetryBucket& bucket) {
+  Ring& ring = rings_[servo * levels_.size() + level];
+  const int64_t start = bucket.start_ns - bucket.start_ns % period_ns_[level];
+  if (ring.current.count > 0 && ring.current.start_ns != start) {
+    Push(servo, level);
+  }
+  if (ring.current.count == 0) ring.current.Reset(start);
+
+  double mean[kFields], min[kFields], max[kFields];
+  for (int ii = 0; ii < kFields; ii++) {
+    mean[ii] = bucket.mean[ii];
+    min[ii] = bucket.min[ii];
+    max[ii] = bucket.max[ii];
+  }
+  ring.current.Add(mean, min, max, bucket.count, bucket.samples);
+}
+
+size_t TelemetryStore::Query(size_t servo, size_t level, int64_t from_ns,
+                             int64_t to_ns,
+                             vector<TelemetryBucket>* buckets) const {
+  buckets->clear();
+  lock_guard<mutex> lock(mutex_);
+  const Ring& ring = rings_[servo * levels_.size() + level];
+  const size_t capacity = ring.buckets.size();
+  for (size_t ii = 0; ii < ring.size; ii++) {
+    const auto& bucket =
+        ring.buckets[(ring.head + capacity - ring.size + ii) % capacity];
+    if (bucket.start_ns >= from_ns && bucket.start_ns < to_ns) {
+      buckets->push_back(bucket);
+    }
+  }
+  return buckets->size();
+}
+
+size_t TelemetryStore::SelectLevel(int64_t from_ns, int64_t to_ns,
+                                   size_t max_points) const {
+  lock_guard<mutex> lock(mutex_);
+  for (size_t ii = 0; ii < levels_.size(); ii++) {
+    const int64_t span_ns = period_ns_[ii] * levels_[ii].capacity;
+    const bool holds = latest_ns_ - from_ns <= span_ns;
+    const bool fits =
+        (to_ns - from_ns) / period_ns_[ii] <= static_cast<int64_t>(max_points);
+    if (holds && fits) return ii;
+  }
+  return levels_.size() - 1;
+}
@@ -0,0 +1,130 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSTELEMETRYSTORE_H__
+#define MOTEUSTELEMETRYSTORE_H__
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "MoteusAPI.h"
+
+using namespace std;
+
+class MoteusGroup;
+
+enum class TelemetryField {
+  kPosition,
+  kVelocity,
+  kTorque,
+  kQCurr,
+  kDCurr,
+  kRezeroState,
+  kVoltage,
+  kTemperature,
+  kFault,
+  kMode,
+  kCount,
+};
+
+// The value of |field| in |state|.
+double FieldValue(const State& state, TelemetryField field);
+
+// Statistics of the samples that fell into one time bucket. Fields that
+// were not in any sample are NAN.
+struct TelemetryBucket {
+  static const int kFields = static_cast<int>(TelemetryField::kCount);
+
+  int64_t start_ns = 0;
+  uint32_t count = 0;
+  // the samples each field was in, the weight of its mean
+  uint32_t samples[kFields];
+  float min[kFields];
+  float max[kFields];
+  float mean[kFields];
+};
+
+struct TelemetryLevel {
+  // bucket width, every level must be a multiple of the previous one
+  double period_s;
+  // number of buckets kept, older ones are overwritten
+  size_t capacity;
+};
+
+// Keeps the state history of every servo at several resolutions. Each
+// level is a ring of buckets with min/max/mean per field. Samples only
+// update the finest level, a completed bucket is folded into the next
+// coarser level, so appending costs the same however many levels there
+// are. Queries may come from another thread than the appends.
+class TelemetryStore {
+ public:
+  // 10 s at 1 kHz, 1 min at 100 Hz and 1 h at 1 Hz
+  static vector<TelemetryLevel> DefaultLevels();
+
+  explicit TelemetryStore(size_t servos,
+                          const vector<TelemetryLevel>& levels =
+                              DefaultLevels());
+
+  void Append(size_t servo, int64_t timestamp_ns, const State& state);
+  // Appends every servo that replied in the group's last cycle.
+  void Record(const MoteusGroup& group);
+
+  size_t levels() const { return levels_.size(); }
+  const TelemetryLevel& level(size_t index) const { return levels_[index]; }
+
+  // Copies the completed buckets of |level| starting in [from_ns, to_ns),
+  // oldest first. Returns their number.
+  size_t Query(size_t servo, size_t level, int64_t from_ns, int64_t to_ns,
+               vector<TelemetryBucket>* buckets) const;
+
+  // The finest level still holding |from_ns| that needs at most
+  // |max_points| buckets for the span, the coarsest one if none does.
+  size_t SelectLevel(int64_t from_ns, int64_t to_ns, size_t max_points) const;
+
+ private:
+  struct Accumulator {
+    int64_t start_ns = 0;
+    uint32_t count = 0;
+    double min[TelemetryBucket::kFields];
+    double max[TelemetryBucket::kFields];
+    double sum[TelemetryBucket::kFields];
+    uint32_t samples[TelemetryBucket::kFields];
+
+    void Reset(int64_t start);
+    // |weights| holds the samples behind each field of |values|
+    void Add(const double* values, const double* mins, const double* maxs,
+             uint32_t weight, const uint32_t* weights);
+    void Store(TelemetryBucket* bucket) const;
+  };
+
+  struct Ring {
+    vector<TelemetryBucket> buckets;
+    size_t head = 0;
+    size_t size = 0;
+    Accumulator current;
+  };
+
+  void Fold(size_t servo, size_t level, const TelemetryBucket& bucket);
+  void Push(size_t servo, size_t level);
+
+  const vector<TelemetryLevel> levels_;
+  vector<int64_t> period_ns_;
+  // rings_[servo * levels + level]
+  vector<Ring> rings_;
+  int64_t latest_ns_ = 0;
+  mutable mutex mutex_;
+};
+
+#endif  // MOTEUSTELEMETRYSTORE_H__
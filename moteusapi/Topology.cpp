@@ -0,0 +1,407 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Topology.h"
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include "FrameLayout.h"
+
+using mjbots::moteus::Resolution;
+
+namespace {
+
+string Trim(const string& str) {
+  const auto begin = str.find_first_not_of(" \t\r");
+  if (begin == string::npos) return "";
+  const auto end = str.find_last_not_of(" \t\r");
+  return str.substr(begin, end - begin + 1);
+}
+
+class TopologyParser {
+ public:
+  TopologyParser(const string& source) : source_(source) {}
+
+  Topology Parse(const string& text) {
+    istringstream iss(text);
+    string line;
+    while (getline(iss, line)) {
+      line_++;
+      const auto comment = line.find('#');
+      if (comment != string::npos) line.erase(comment);
+      line = Trim(line);
+      if (line.empty()) continue;
+
+      if (line.front() == '[') {
+        if (line.back() != ']') Fail("unterminated section header");
+        StartSection(Trim(line.substr(1, line.size() - 2)));
+        continue;
+      }
+
+      const auto eq = line.find('=');
+      if (eq == string::npos) Fail("expected 'key = value'");
+      SetValue(Trim(line.substr(0, eq)), Trim(line.substr(eq + 1)));
+    }
+
+    // adapters may be declared after the servos using them
+    for (size_t ii = 0; ii < topology_.servos.size(); ii++) {
+      const int adapter = topology_.AdapterIndex(servo_adapters_[ii]);
+      if (adapter < 0) {
+        throw runtime_error("Topology: " + source_ + ": servo '" +
+                            topology_.servos[ii].name +
+                            "' uses unknown adapter '" + servo_adapters_[ii] +
+                            "'");
+      }
+      topology_.servos[ii].adapter = adapter;
+    }
+    return topology_;
+  }
+
+ private:
+  enum class Section { kNone, kBus, kAdapter, kServo };
+
+  [[noreturn]] void Fail(const string& message) const {
+    throw runtime_error("Topology: " + source_ + ":" + to_string(line_) +
+                        ": " + message);
+  }
+
+  void StartSection(const string& header) {
+    istringstream iss(header);
+    string kind, name, extra;
+    iss >> kind >> name >> extra;
+    if (!extra.empty()) Fail("unexpected '" + extra + "' in section header");
+
+    if (kind == "bus") {
+      if (!name.empty()) Fail("the bus section takes no name");
+      section_ = Section::kBus;
+    } else if (kind == "adapter" || kind == "servo") {
+      if (name.empty()) Fail("missing " + kind + " name");
+      if (kind == "adapter") {
+        section_ = Section::kAdapter;
+        topology_.adapters.emplace_back();
+        topology_.adapters.back().name = name;
+      } else {
+        section_ = Section::kServo;
+        topology_.servos.emplace_back();
+        topology_.servos.back().name = name;
+        servo_adapters_.emplace_back();
+      }
+    } else {
+      Fail("unknown section '" + kind + "'");
+    }
+  }
+
+  double Number(const string& value) const {
+    size_t used = 0;
+    double result = 0;
+    try {
+      result = stod(value, &used);
+    } catch (const logic_error&) {
+      Fail("'" + value + "' is not a number");
+    }
+    if (used != value.size()) Fail("'" + value + "' is not a number");
+    return result;
+  }
+
+  int Integer(const string& value) const {
+    const double result = Number(value);
+    if (result != std::floor(result)) Fail("'" + value + "' is not an integer");
+    return static_cast<int>(result);
+  }
+
+  Resolution Res(const string& value) const {
+    try {
+      return ParseResolution(value);
+    } catch (const runtime_error& e) {
+      Fail(e.what());
+    }
+  }
+
+  void SetValue(const string& key, const string& value) {
+    switch (section_) {
+      case Section::kNone:
+        Fail("'" + key + "' outside of any section");
+      case Section::kBus:
+        if (key == "rate_hz") {
+          topology_.rate_hz = Number(value);
+        } else if (key == "timeout_us") {
+          topology_.timeout_us = Integer(value);
+        } else if (key == "journal") {
+          topology_.journal = value;
+        } else if (key == "journal_max_age_s") {
+          topology_.journal_max_age_s = Number(value);
+        } else {
+          Fail("unknown bus key '" + key + "'");
+        }
+        return;
+      case Section::kAdapter:
+        if (key == "device") {
+          topology_.adapters.back().dev_name = value;
+        } else if (key == "capture") {
+          topology_.adapters.back().capture = value;
+        } else {
+          Fail("unknown adapter key '" + key + "'");
+        }
+        return;
+      case Section::kServo:
+        SetServoValue(topology_.servos.back(), key, value);
+        return;
+    }
+  }
+
+  void SetServoValue(ServoConfig& servo, const string& key,
+                     const string& value) {
+    if (key == "adapter") {
+      servo_adapters_.back() = value;
+    } else if (key == "id") {
+      servo.id = Integer(value);
+    } else if (key == "rate_hz") {
+      servo.rate_hz = Number(value);
+    } else if (key == "watchdog_timeout") {
+      servo.watchdog_timeout = Number(value);
+    } else if (key == "position_min") {
+      servo.position_min = Number(value);
+    } else if (key == "position_max") {
+      servo.position_max = Number(value);
+    } else if (key == "velocity_max") {
+      servo.velocity_max = Number(value);
+    } else if (key == "torque_max") {
+      servo.torque_max = Number(value);
+    } else if (key == "command.position") {
+      servo.command.position = Res(value);
+    } else if (key == "command.velocity") {
+      servo.command.velocity = Res(value);
+    } else if (key == "command.feedforward_torque") {
+      servo.command.feedforward_torque = Res(value);
+    } else if (key == "command.kp_scale") {
+      servo.command.kp_scale = Res(value);
+    } else if (key == "command.kd_scale") {
+      servo.command.kd_scale = Res(value);
+    } else if (key == "command.maximum_torque") {
+      servo.command.maximum_torque = Res(value);
+    } else if (key == "command.stop_position") {
+      servo.command.stop_position = Res(value);
+    } else if (key == "command.watchdog_timeout") {
+      servo.command.watchdog_timeout = Res(value);
+    } else if (key == "within.bounds_min") {
+      servo.within.bounds_min = Res(value);
+    } else if (key == "within.bounds_max") {
+      servo.within.bounds_max = Res(value);
+    } else if (key == "within.feedforward_torque") {
+      servo.within.feedforward_torque = Res(value);
+    } else if (key == "within.kp_scale") {
+      servo.within.kp_scale = Res(value);
+    } else if (key == "within.kd_scale") {
+      servo.within.kd_scale = Res(value);
+    } else if (key == "within.maximum_torque") {
+      servo.within.maximum_torque = Res(value);
+    } else if (key == "within.watchdog_timeout") {
+      servo.within.watchdog_timeout = Res(value);
+    } else if (key == "query.mode") {
+      servo.query.mode = Res(value);
+    } else if (key == "query.position") {
+      servo.query.position = Res(value);
+    } else if (key == "query.velocity") {
+      servo.query.velocity = Res(value);
+    } else if (key == "query.torque") {
+      servo.query.torque = Res(value);
+    } else if (key == "query.q_current") {
+      servo.query.q_current = Res(value);
+    } else if (key == "query.d_current") {
+      servo.query.d_current = Res(value);
+    } else if (key == "query.rezero_state") {
+      servo.query.rezero_state = Res(value);
+    } else if (key == "query.voltage") {
+      servo.query.voltage = Res(value);
+    } else if (key == "query.temperature") {
+      servo.query.temperature = Res(value);
+    } else if (key == "query.fault") {
+      servo.query.fault = Res(value);
+    } else {
+      Fail("unknown servo key '" + key + "'");
+    }
+  }
+
+  const string source_;
+  int line_ = 0;
+  Section section_ = Section::kNone;
+  Topology topology_;
+  vector<string> servo_adapters_;
+};
+
+}  // namespace
+
+mjbots::moteus::WithinResolution CompactWithinResolution() {
+  mjbots::moteus::WithinResolution res;
+  res.bounds_min = Resolution::kInt16;
+  res.bounds_max = Resolution::kInt16;
+  res.feedforward_torque = Resolution::kInt16;
+  res.kp_scale = Resolution::kInt8;
+  res.kd_scale = Resolution::kInt8;
+  res.maximum_torque = Resolution::kInt16;
+  res.stop_position = Resolution::kIgnore;
+  res.watchdog_timeout = Resolution::kInt16;
+  return res;
+}
+
+int Topology::AdapterIndex(const string& name) const {
+  for (size_t ii = 0; ii < adapters.size(); ii++) {
+    if (adapters[ii].name == name) return static_cast<int>(ii);
+  }
+  return -1;
+}
+
+int Topology::ServoIndex(const string& name) const {
+  for (size_t ii = 0; ii < servos.size(); ii++) {
+    if (servos[ii].name == name) return static_cast<int>(ii);
+  }
+  return -1;
+}
+
+Topology LoadTopology(const string& path) {
+  ifstream file(path);
+  if (!file) throw runtime_error("Topology: unable to open " + path);
+  stringstream ss;
+  ss << file.rdbuf();
+  return ParseTopology(ss.str(), path);
+}
+
+Topology ParseTopology(const string& text, const string& source) {
+  Topology topology = TopologyParser(source).Parse(text);
+  ValidateTopology(topology);
+  return topology;
+}
+
+void ValidateTopology(const Topology& topology) {
+  auto fail = [](const string& message) {
+    throw runtime_error("Topology: " + message);
+  };
+
+  if (!(topology.rate_hz > 0)) fail("bus rate_hz must be positive");
+  if (topology.timeout_us <= 0) fail("bus timeout_us must be positive");
+  if (!(topology.journal_max_age_s >= 0)) {
+    fail("bus journal_max_age_s must not be negative");
+  }
+  if (topology.adapters.empty()) fail("no adapters defined");
+  if (topology.servos.empty()) fail("no servos defined");
+
+  set<string> names;
+  for (const auto& adapter : topology.adapters) {
+    if (!names.insert(adapter.name).second) {
+      fail("duplicate adapter '" + adapter.name + "'");
+    }
+    if (adapter.dev_name.empty()) {
+      fail("adapter '" + adapter.name + "' has no device");
+    }
+  }
+
+  names.clear();
+  set<pair<int, int>> ids;
+  for (const auto& servo : topology.servos) {
+    const string what = "servo '" + servo.name + "' ";
+    if (!names.insert(servo.name).second) fail("duplicate " + what);
+    if (servo.adapter < 0 ||
+        servo.adapter >= static_cast<int>(topology.adapters.size())) {
+      fail(what + "has no adapter");
+    }
+    if (servo.id < 1 || servo.id > 127) fail(what + "id must be in [1, 127]");
+    if (!ids.insert(make_pair(servo.adapter, servo.id)).second) {
+      fail(what + "reuses id " + to_string(servo.id) + " on adapter '" +
+           topology.adapters[servo.adapter].name + "'");
+    }
+    if (!std::isnan(servo.rate_hz) &&
+        !(servo.rate_hz > 0 && servo.rate_hz <= topology.rate_hz)) {
+      fail(what + "rate_hz must be in (0, bus rate_hz]");
+    }
+    // a frame must reach the servo at least twice per watchdog period,
+    // unless the watchdog is disabled
+    const double interval =
+        CommandDivisor(topology, servo) / topology.rate_hz;
+    const double watchdog = servo.watchdog_timeout == 0
+                                ? kDefaultWatchdogTimeout
+                                : servo.watchdog_timeout;
+    if (servo.watchdog_timeout < 0) {
+      fail(what + "watchdog_timeout must not be negative");
+    }
+    if (watchdog < 2 * interval) {
+      fail(what + (servo.watchdog_timeout == 0
+                       ? "rate_hz is too low for the servo's default "
+                         "watchdog_timeout, set a longer one or nan to "
+                         "disable it"
+                       : "watchdog_timeout is shorter than two command "
+                         "intervals"));
+    }
+    if (!(servo.position_min <= servo.position_max)) {
+      fail(what + "position_min is above position_max");
+    }
+    if (!(servo.velocity_max >= 0) || !(servo.torque_max >= 0)) {
+      fail(what + "velocity_max and torque_max must not be negative");
+    }
+    if (std::isfinite(servo.torque_max) &&
+        servo.command.maximum_torque == Resolution::kIgnore) {
+      fail(what + "torque_max needs command.maximum_torque to be sent");
+    }
+    if (std::isfinite(servo.torque_max) &&
+        servo.within.maximum_torque == Resolution::kIgnore) {
+      fail(what + "torque_max needs within.maximum_torque to be sent");
+    }
+    if (servo.watchdog_timeout != 0 &&
+        servo.command.watchdog_timeout == Resolution::kIgnore) {
+      fail(what + "watchdog_timeout needs command.watchdog_timeout to be sent");
+    }
+    if (servo.watchdog_timeout != 0 &&
+        servo.within.watchdog_timeout == Resolution::kIgnore) {
+      fail(what + "watchdog_timeout needs within.watchdog_timeout to be sent");
+    }
+    try {
+      MakePositionLayout(servo.command, servo.query);
+      MakeWithinLayout(servo.within, servo.query);
+    } catch (const exception& e) {
+      fail(what + "does not fit a CAN-FD frame: " + e.what());
+    }
+  }
+}
+
+int CommandDivisor(const Topology& topology, const ServoConfig& servo) {
+  if (std::isnan(servo.rate_hz)) return 1;
+  return max(1, static_cast<int>(std::round(topology.rate_hz / servo.rate_hz)));
+}
+
+Resolution ParseResolution(const string& name) {
+  if (name == "int8") return Resolution::kInt8;
+  if (name == "int16") return Resolution::kInt16;
+  if (name == "int32") return Resolution::kInt32;
+  if (name == "float") return Resolution::kFloat;
+  if (name == "ignore") return Resolution::kIgnore;
+  throw runtime_error("unknown resolution '" + name + "'");
+}
+
+const char* ResolutionName(Resolution res) {
+  switch (res) {
+    case Resolution::kInt8:
+      return "int8";
+    case Resolution::kInt16:
+      return "int16";
+    case Resolution::kInt32:
+      return "int32";
+    case Resolution::kFloat:
+      return "float";
+    case Resolution::kIgnore:
+      return "ignore";
+  }
+  return "ignore";
+}
@@ -0,0 +1,120 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSTOPOLOGY_H__
+#define MOTEUSTOPOLOGY_H__
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "moteus_protocol.h"
+
+using namespace std;
+
+// One fdcanusb adapter on the host.
+struct AdapterConfig {
+  string name;
+  string dev_name;
+  // fdcanusb traffic is captured to this file, see Fdcanusb::SetCapture()
+  string capture;
+};
+
+// int16 bounds, torques and timeout, int8 gains: the stay within command
+// takes 21 bytes of the frame instead of 33 at float resolution.
+mjbots::moteus::WithinResolution CompactWithinResolution();
+
+// One servo on one of the adapters.
+struct ServoConfig {
+  string name;
+  int id = 0;
+  // index into Topology::adapters
+  int adapter = -1;
+  // command rate, defaults to the bus rate. The servo is sent a frame
+  // every CommandDivisor() bus cycles, so the effective rate is the bus
+  // rate divided by an integer.
+  double rate_hz = NAN;
+  // watchdog timeout sent with every position command, as moteus reads
+  // it: 0 is the servo's default, kDefaultWatchdogTimeout, and NAN
+  // disables the watchdog. Left at 0 the commands keep their own.
+  double watchdog_timeout = 0;
+  // limits applied to every command before it is encoded
+  double position_min = -INFINITY;
+  double position_max = INFINITY;
+  double velocity_max = INFINITY;
+  double torque_max = INFINITY;
+
+  mjbots::moteus::PositionResolution command;
+  mjbots::moteus::WithinResolution within = CompactWithinResolution();
+  mjbots::moteus::QueryCommand query;
+};
+
+struct Topology {
+  double rate_hz = 1000;
+  // how long a bus cycle waits for all acknowledges and replies
+  int timeout_us = 5000;
+  // command journal file, see CommandJournal. Empty for none.
+  string journal;
+  // journaled commands older than this are not resumed
+  double journal_max_age_s = 1.0;
+  vector<AdapterConfig> adapters;
+  vector<ServoConfig> servos;
+
+  int AdapterIndex(const string& name) const;
+  int ServoIndex(const string& name) const;
+};
+
+// Parses a topology file. The format is line based, '#' starts a
+// comment and every entity lives in its own section:
+//
+//   [bus]
+//   rate_hz = 1000
+//   timeout_us = 5000
+//   journal = /dev/shm/robot.journal
+//   journal_max_age_s = 1
+//
+//   [adapter front]
+//   device = /dev/ttyACM0
+//
+//   [servo hip_left]
+//   adapter = front
+//   id = 1
+//   rate_hz = 500
+//   watchdog_timeout = 0.1      # or nan for none
+//   position_min = -0.5
+//   position_max = 0.5
+//   velocity_max = 2
+//   torque_max = 1.5
+//   command.position = int16
+//   within.kp_scale = float
+//   query.temperature = ignore
+//
+// Resolutions are one of int8, int16, int32, float or ignore. The
+// result is validated, errors are thrown as std::runtime_error.
+Topology LoadTopology(const string& path);
+Topology ParseTopology(const string& text, const string& source = "<string>");
+
+// the watchdog timeout of a moteus left at its defaults, in seconds
+const double kDefaultWatchdogTimeout = 0.1;
+
+// Throws std::runtime_error describing the first problem found.
+void ValidateTopology(const Topology& topology);
+
+// Number of bus cycles between two frames to |servo|.
+int CommandDivisor(const Topology& topology, const ServoConfig& servo);
+
+mjbots::moteus::Resolution ParseResolution(const string& name);
+const char* ResolutionName(mjbots::moteus::Resolution res);
+
+#endif  // MOTEUSTOPOLOGY_H__
@@ -0,0 +1,187 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "TrajectoryStreamer.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+using mjbots::moteus::PositionCommand;
+
+namespace {
+
+const char kMagic[8] = "MOTTRAJ";
+const uint32_t kVersion = 1;
+
+size_t PageSize() { return static_cast<size_t>(sysconf(_SC_PAGESIZE)); }
+
+}  // namespace
+
+TrajectoryWriter::TrajectoryWriter(const string& path, double rate_hz) {
+  if (!(rate_hz > 0)) {
+    throw std::runtime_error("TrajectoryWriter: rate_hz must be positive");
+  }
+  file_ = fopen(path.c_str(), "wb");
+  if (file_ == nullptr) {
+    throw std::runtime_error("TrajectoryWriter: unable to create " + path);
+  }
+  memcpy(header_.magic, kMagic, sizeof(kMagic));
+  header_.version = kVersion;
+  header_.sample_size = sizeof(TrajectorySample);
+  header_.rate_hz = rate_hz;
+  header_.count = 0;
+  if (fwrite(&header_, sizeof(header_), 1, file_) != 1) {
+    fclose(file_);
+    throw std::runtime_error("TrajectoryWriter: write failed");
+  }
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+  // a destructor must not throw, Close() first to learn of errors
+  try {
+    Close();
+  } catch (const std::runtime_error&) {
+  }
+}
+
+void TrajectoryWriter::Append(const TrajectorySample& sample) {
+  if (fwrite(&sample, sizeof(sample), 1, file_) != 1) {
+    throw std::runtime_error("TrajectoryWriter: write failed");
+  }
+  header_.count++;
+}
+
+void TrajectoryWriter::Close() {
+  if (file_ == nullptr) return;
+  FILE* file = file_;
+  file_ = nullptr;
+  // the file is closed either way, buffered samples fail in fclose()
+  const bool written = fseek(file, 0, SEEK_SET) == 0 &&
+                       fwrite(&header_, sizeof(header_), 1, file) == 1;
+  if (fclose(file) != 0 || !written) {
+    throw std::runtime_error("TrajectoryWriter: write failed");
+  }
+}
+
+TrajectoryFile::TrajectoryFile(const string& path, double readahead_s)
+    : path_(path) {
+  fd_ = open(path.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    throw std::runtime_error("TrajectoryFile: unable to open " + path);
+  }
+  struct stat st;
+  if (fstat(fd_, &st) < 0 || st.st_size < (off_t)sizeof(header_) ||
+      pread(fd_, &header_, sizeof(header_), 0) != sizeof(header_) ||
+      memcmp(header_.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header_.version != kVersion ||
+      header_.sample_size != sizeof(TrajectorySample) ||
+      !(header_.rate_hz > 0) ||
+      header_.count >
+          (st.st_size - sizeof(header_)) / sizeof(TrajectorySample)) {
+    close(fd_);
+    throw std::runtime_error("TrajectoryFile: " + path +
+                             " is not a valid trajectory");
+  }
+
+  map_size_ = st.st_size;
+  map_ = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (map_ == MAP_FAILED) {
+    close(fd_);
+    throw std::runtime_error("TrajectoryFile: unable to map " + path);
+  }
+  madvise(map_, map_size_, MADV_SEQUENTIAL);
+  samples_ = reinterpret_cast<const TrajectorySample*>(
+      static_cast<const char*>(map_) + sizeof(header_));
+
+  const size_t page_samples = PageSize() / sizeof(TrajectorySample);
+  window_ = static_cast<size_t>(readahead_s * header_.rate_hz);
+  window_ = max(page_samples, window_ + page_samples - window_ % page_samples);
+  Advise(0);
+}
+
+TrajectoryFile::~TrajectoryFile() {
+  munmap(map_, map_size_);
+  close(fd_);
+}
+
+const TrajectorySample& TrajectoryFile::at(size_t index) {
+  if (index + window_ >= next_window_ && next_window_ < header_.count) {
+    Advise(index);
+  }
+  return samples_[index];
+}
+
+void TrajectoryFile::Advise(size_t index) {
+  const size_t page = PageSize();
+  auto page_start = [&](size_t sample) {
+    const size_t offset = sizeof(header_) + sample * sizeof(TrajectorySample);
+    return offset - offset % page;
+  };
+
+  // ask for the next window while the current one is being consumed
+  const size_t begin = max(next_window_, index);
+  const size_t end = min<size_t>(begin + window_, header_.count);
+  const size_t ahead = page_start(begin);
+  const size_t length = min(page_start(end) + page, map_size_) - ahead;
+  madvise(static_cast<char*>(map_) + ahead, length, MADV_WILLNEED);
+  next_window_ = end;
+
+  // and drop everything older than one window
+  if (index > window_) {
+    const size_t behind = page_start(index - window_);
+    if (behind > released_) {
+      madvise(static_cast<char*>(map_) + released_, behind - released_,
+              MADV_DONTNEED);
+      released_ = behind;
+    }
+  }
+}
+
+TrajectoryStreamer::TrajectoryStreamer(MoteusGroup& group, double readahead_s)
+    : group_(group), readahead_s_(readahead_s) {}
+
+void TrajectoryStreamer::Add(size_t servo, const string& path,
+                             const PositionCommand& base) {
+  if (servo >= group_.size()) {
+    throw std::runtime_error("TrajectoryStreamer: no servo " +
+                             to_string(servo));
+  }
+  streams_.emplace_back();
+  auto& stream = streams_.back();
+  stream.servo = servo;
+  stream.file.reset(new TrajectoryFile(path, readahead_s_));
+  stream.command = base;
+}
+
+bool TrajectoryStreamer::Feed(double time_s) {
+  bool active = false;
+  for (auto& stream : streams_) {
+    auto& file = *stream.file;
+    const double index = std::floor(time_s * file.rate_hz());
+    if (!(index >= 0) || index >= file.size()) continue;
+    active = true;
+
+    const TrajectorySample& sample = file.at(static_cast<size_t>(index));
+    stream.command.position = sample.position;
+    stream.command.velocity = sample.velocity;
+    stream.command.feedforward_torque = sample.feedforward_torque;
+    group_.SetPositionCommand(stream.servo, stream.command);
+  }
+  return active;
+}
@@ -0,0 +1,138 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSTRAJECTORYSTREAMER_H__
+#define MOTEUSTRAJECTORYSTREAMER_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MoteusGroup.h"
+
+using namespace std;
+
+// One setpoint of a trajectory file.
+struct TrajectorySample {
+  float position = 0;
+  float velocity = 0;
+  float feedforward_torque = 0;
+};
+
+// On disk a trajectory is a 32 byte header followed by the samples,
+// little endian:
+//
+//   char magic[8] = "MOTTRAJ"
+//   uint32_t version = 1
+//   uint32_t sample_size = sizeof(TrajectorySample)
+//   double rate_hz
+//   uint64_t count
+//   TrajectorySample samples[count]
+struct TrajectoryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t sample_size;
+  double rate_hz;
+  uint64_t count;
+};
+
+// Writes a trajectory file sample by sample, so arbitrarily long
+// trajectories can be produced without holding them in memory.
+class TrajectoryWriter {
+ public:
+  TrajectoryWriter(const string& path, double rate_hz);
+  ~TrajectoryWriter();
+
+  TrajectoryWriter(const TrajectoryWriter&) = delete;
+  TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+  void Append(const TrajectorySample& sample);
+  // Writes the final sample count, also done by the destructor. Throws
+  // std::runtime_error if the file could not be completed, which the
+  // destructor ignores.
+  void Close();
+
+ private:
+  FILE* file_ = nullptr;
+  TrajectoryHeader header_;
+};
+
+// A read only mapping of a trajectory file. Only the pages around the
+// current position are kept resident: the window ahead is requested from
+// the kernel before it is needed and the pages behind are released.
+class TrajectoryFile {
+ public:
+  TrajectoryFile(const string& path, double readahead_s);
+  ~TrajectoryFile();
+
+  TrajectoryFile(const TrajectoryFile&) = delete;
+  TrajectoryFile& operator=(const TrajectoryFile&) = delete;
+
+  double rate_hz() const { return header_.rate_hz; }
+  size_t size() const { return header_.count; }
+
+  // Returns the sample at |index|, which must be below size(). Accesses
+  // are expected to move forward.
+  const TrajectorySample& at(size_t index);
+
+ private:
+  void Advise(size_t index);
+
+  const string path_;
+  int fd_ = -1;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+  TrajectoryHeader header_;
+  const TrajectorySample* samples_ = nullptr;
+  // samples per read-ahead window, at least a page
+  size_t window_ = 0;
+  // first sample of the next window to request
+  size_t next_window_ = 0;
+  // bytes at the start of the mapping already given back
+  size_t released_ = 0;
+};
+
+// Feeds per-servo trajectory files into a MoteusGroup. Once started,
+// Feed() neither allocates nor reads the files itself, the page faults
+// are served from the read-ahead.
+class TrajectoryStreamer {
+ public:
+  explicit TrajectoryStreamer(MoteusGroup& group, double readahead_s = 1.0);
+
+  // Streams |path| to |servo|. Position, velocity and feedforward torque
+  // come from the file, the other fields from |base|.
+  void Add(size_t servo, const string& path,
+           const mjbots::moteus::PositionCommand& base =
+               mjbots::moteus::PositionCommand());
+
+  // Latches the setpoints for |time_s| from the start into the group.
+  // Returns false once every trajectory has ended, the servos then keep
+  // their last setpoint.
+  bool Feed(double time_s);
+
+ private:
+  struct Stream {
+    size_t servo;
+    unique_ptr<TrajectoryFile> file;
+    mjbots::moteus::PositionCommand command;
+  };
+
+  MoteusGroup& group_;
+  const double readahead_s_;
+  vector<Stream> streams_;
+};
+
+#endif  // MOTEUSTRAJECTORYSTREAMER_H__
@@ -0,0 +1,32 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Transport.h"
+
+#include <stdexcept>
+
+#include "Fdcanusb.h"
+#include "SocketCan.h"
+
+shared_ptr<Transport> Transport::Open(const string& dev_name) {
+  const string kSocketCan = "socketcan:";
+  if (dev_name.compare(0, kSocketCan.size(), kSocketCan) != 0) {
+    return Fdcanusb::Open(dev_name);
+  }
+#ifdef __linux__
+  return SocketCan::Open(dev_name.substr(kSocketCan.size()));
+#else
+  throw std::runtime_error("Transport: SocketCAN needs Linux, " + dev_name);
+#endif
+}
@@ -0,0 +1,80 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSTRANSPORT_H__
+#define MOTEUSTRANSPORT_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "moteus_protocol.h"
+
+using namespace std;
+
+// A frame on the CAN-FD bus. The arbitration id is laid out the way
+// moteus expects it: bit 15 requests a reply, bits 8-14 hold the source
+// and bits 0-6 the destination.
+struct BusFrame {
+  static const uint16_t kReplyRequested = 0x8000;
+
+  uint16_t arbitration_id = 0;
+  mjbots::moteus::CanFrame frame;
+  // NowNs() time base, when the reply was received
+  int64_t timestamp_ns = 0;
+
+  int source() const { return (arbitration_id >> 8) & 0x7f; }
+  int destination() const { return arbitration_id & 0x7f; }
+};
+
+// One CAN-FD bus the host sends whole cycles of frames on.
+//
+// Users sharing a transport must not drive it from several threads at
+// once, only SendUrgent() may be called from anywhere.
+class Transport {
+ public:
+  virtual ~Transport() {}
+
+  // Returns the transport already open for |dev_name|, or opens it.
+  // "socketcan:<interface>" names a SocketCAN interface, anything else
+  // the serial device of an fdcanusb.
+  static shared_ptr<Transport> Open(const string& dev_name);
+
+  virtual const string& dev_name() const = 0;
+
+  // Sends every frame, in order. Returns false on error or when the
+  // adapter did not take them all within |timeout_us|.
+  virtual bool Send(const BusFrame* frames, size_t count,
+                    int timeout_us) = 0;
+
+  // Waits until |acks| frames were acknowledged and |expected| replies
+  // arrived, or |timeout_us| elapsed. Replies are stored in |replies|,
+  // their number in |received|. Returns false on timeout or error.
+  virtual bool Receive(size_t acks, size_t expected, BusFrame* replies,
+                       size_t max_replies, size_t* received,
+                       int timeout_us) = 0;
+
+  // Sends at most kMaxUrgent frames without replies, from any thread and
+  // also while another thread is in Send() or Receive(), e.g. to stop
+  // the servos when that thread stalls. Allocates nothing. Gives up and
+  // returns false when the frames could not be written within
+  // kUrgentTimeoutUs.
+  virtual bool SendUrgent(const BusFrame* frames, size_t count) = 0;
+
+  static const size_t kMaxUrgent = 64;
+  static const int kUrgentTimeoutUs = 2000;
+};
+
+#endif  // MOTEUSTRANSPORT_H__
@@ -0,0 +1,356 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "UdpBridge.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "Clock.h"
+#include "FrameLayout.h"
+
+using mjbots::moteus::CanFrame;
+
+namespace {
+
+const char kMagic[2] = {'M', 'B'};
+const uint8_t kVersion = 1;
+const size_t kHeaderSize = 16;
+const size_t kRecordHeaderSize = 3;
+// largest UDP payload over IPv4
+const size_t kMaxDatagram = 65507;
+// how often the receiver checks whether it should stop
+const int kPollMs = 100;
+
+// whether |sequence| comes after |last|, across the wrap around
+bool Newer(uint32_t sequence, uint32_t last) {
+  return static_cast<int32_t>(sequence - last) > 0;
+}
+
+bool WaitReadable(int fd, int timeout_ms) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN);
+}
+
+}  // namespace
+
+size_t EncodeBridgePacket(const BridgePacket& packet, uint8_t* buffer,
+                          size_t size) {
+  if (size < kHeaderSize) return 0;
+  memcpy(buffer, kMagic, 2);
+  buffer[2] = kVersion;
+  buffer[3] = packet.type;
+  memcpy(buffer + 4, &packet.sequence, 4);
+  memcpy(buffer + 8, &packet.timestamp_ns, 8);
+
+  size_t used = kHeaderSize;
+  for (const auto& record : packet.records) {
+    const size_t length = kRecordHeaderSize + record.frame.size;
+    if (used + length > size) return 0;
+    memcpy(buffer + used, &record.servo, 2);
+    buffer[used + 2] = record.frame.size;
+    memcpy(buffer + used + kRecordHeaderSize, record.frame.data,
+           record.frame.size);
+    used += length;
+  }
+  return used;
+}
+
+bool DecodeBridgePacket(const uint8_t* buffer, size_t size,
+                        BridgePacket* packet) {
+  if (size < kHeaderSize || memcmp(buffer, kMagic, 2) != 0 ||
+      buffer[2] != kVersion) {
+    return false;
+  }
+  if (buffer[3] != BridgePacket::kState &&
+      buffer[3] != BridgePacket::kCommand) {
+    return false;
+  }
+  packet->type = static_cast<BridgePacket::Type>(buffer[3]);
+  memcpy(&packet->sequence, buffer + 4, 4);
+  memcpy(&packet->timestamp_ns, buffer + 8, 8);
+
+  packet->records.clear();
+  size_t used = kHeaderSize;
+  while (used < size) {
+    if (size - used < kRecordHeaderSize) return false;
+    BridgeRecord record;
+    memcpy(&record.servo, buffer + used, 2);
+    record.frame.size = buffer[used + 2];
+    used += kRecordHeaderSize;
+    if (record.frame.size > sizeof(record.frame.data) ||
+        size - used < record.frame.size) {
+      return false;
+    }
+    memcpy(record.frame.data, buffer + used, record.frame.size);
+    used += record.frame.size;
+    packet->records.push_back(record);
+  }
+  return true;
+}
+
+BridgeServer::BridgeServer(MoteusGroup& group, const string& address,
+                           int port, double command_timeout_s)
+    : group_(group),
+      command_timeout_ns_(llround(command_timeout_s * 1e9)),
+      commands_(group.size()),
+      pending_(group.size(), false),
+      remote_(group.size(), false) {
+  if (group.size() > 65535) {
+    throw std::runtime_error("BridgeServer: too many servos");
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo* result = nullptr;
+  if (getaddrinfo(address.c_str(), to_string(port).c_str(), &hints,
+                  &result) != 0) {
+    throw std::runtime_error("BridgeServer: unable to resolve " + address);
+  }
+  for (auto* info = result; info != nullptr; info = info->ai_next) {
+    fd_ = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd_ < 0) continue;
+    if (info->ai_family == AF_INET6) {
+      // "::" accepts IPv4 peers as well
+      int off = 0;
+      setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+    if (bind(fd_, info->ai_addr, info->ai_addrlen) == 0) break;
+    close(fd_);
+    fd_ = -1;
+  }
+  freeaddrinfo(result);
+  if (fd_ < 0) {
+    throw std::runtime_error("BridgeServer: unable to bind " + address +
+                             " port " + to_string(port));
+  }
+
+  snapshot_.type = BridgePacket::kState;
+  snapshot_.records.reserve(group.size());
+  sender_ = thread(&BridgeServer::SendLoop, this);
+  receiver_ = thread(&BridgeServer::ReceiveLoop, this);
+}
+
+BridgeServer::~BridgeServer() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    done_ = true;
+  }
+  ready_.notify_all();
+  sender_.join();
+  receiver_.join();
+  close(fd_);
+}
+
+void BridgeServer::Publish() {
+  lock_guard<mutex> lock(mutex_);
+  if (fresh_) dropped_++;
+  snapshot_.sequence = state_sequence_++;
+  snapshot_.timestamp_ns = NowNs();
+  snapshot_.records.resize(group_.size());
+  size_t count = 0;
+  for (size_t ii = 0; ii < group_.size(); ii++) {
+    if (!group_.replied(ii)) continue;
+    snapshot_.records[count].servo = static_cast<uint16_t>(ii);
+    snapshot_.records[count].frame = group_.reply_frame(ii);
+    count++;
+  }
+  snapshot_.records.resize(count);
+  fresh_ = true;
+  ready_.notify_one();
+}
+
+size_t BridgeServer::Apply() {
+  lock_guard<mutex> lock(mutex_);
+  size_t count = 0;
+  for (size_t ii = 0; ii < pending_.size(); ii++) {
+    if (!pending_[ii]) continue;
+    pending_[ii] = false;
+    // latched like local commands, so the servo's limits apply
+    DecodedCommand command;
+    if (!DecodeCommandFrame(commands_[ii], &command)) {
+      rejected_++;
+      continue;
+    }
+    switch (command.kind) {
+      case DecodedCommand::Kind::kNone:
+        group_.ClearCommand(ii);
+        break;
+      case DecodedCommand::Kind::kStop:
+        group_.SetStopCommand(ii);
+        break;
+      case DecodedCommand::Kind::kPosition:
+        group_.SetPositionCommand(ii, command.position);
+        break;
+      case DecodedCommand::Kind::kWithin:
+        group_.SetWithinCommand(ii, command.within);
+        break;
+    }
+    remote_[ii] = true;
+    count++;
+  }
+
+  if (have_sequence_ && NowNs() - command_ns_ > command_timeout_ns_) {
+    for (size_t ii = 0; ii < remote_.size(); ii++) {
+      if (remote_[ii]) group_.SetStopCommand(ii);
+      remote_[ii] = false;
+    }
+  }
+  return count;
+}
+
+void BridgeServer::SendLoop() {
+  BridgePacket packet;
+  packet.records.reserve(group_.size());
+  vector<uint8_t> buffer(kMaxDatagram);
+  uint8_t peer[sizeof(peer_)];
+  socklen_t peer_size = 0;
+
+  while (true) {
+    {
+      unique_lock<mutex> lock(mutex_);
+      ready_.wait(lock, [this]() { return fresh_ || done_; });
+      if (done_) return;
+      swap(packet, snapshot_);
+      fresh_ = false;
+      memcpy(peer, peer_, sizeof(peer));
+      peer_size = peer_size_;
+    }
+    if (peer_size == 0) continue;
+    const size_t size =
+        EncodeBridgePacket(packet, buffer.data(), buffer.size());
+    if (size == 0) continue;
+    sendto(fd_, buffer.data(), size, 0,
+           reinterpret_cast<struct sockaddr*>(peer), peer_size);
+  }
+}
+
+void BridgeServer::ReceiveLoop() {
+  vector<uint8_t> buffer(kMaxDatagram);
+  BridgePacket packet;
+  while (!done_) {
+    if (!WaitReadable(fd_, kPollMs)) continue;
+    struct sockaddr_storage from;
+    socklen_t from_size = sizeof(from);
+    const ssize_t size =
+        recvfrom(fd_, buffer.data(), buffer.size(), 0,
+                 reinterpret_cast<struct sockaddr*>(&from), &from_size);
+    if (size <= 0) continue;
+    if (!DecodeBridgePacket(buffer.data(), size, &packet) ||
+        packet.type != BridgePacket::kCommand) {
+      continue;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    const int64_t now_ns = NowNs();
+    const bool same_peer =
+        from_size == peer_size_ && memcmp(&from, peer_, from_size) == 0;
+    // the bridge belongs to its peer until that stops sending commands
+    if (!same_peer && peer_size_ != 0 &&
+        now_ns - command_ns_ <= command_timeout_ns_) {
+      refused_++;
+      continue;
+    }
+    // a new peer starts its own sequence
+    if (same_peer && have_sequence_) {
+      if (!Newer(packet.sequence, command_sequence_)) continue;
+      lost_ += packet.sequence - command_sequence_ - 1;
+    }
+    if (!same_peer) {
+      memcpy(peer_, &from, from_size);
+      peer_size_ = from_size;
+    }
+    have_sequence_ = true;
+    command_sequence_ = packet.sequence;
+    command_ns_ = now_ns;
+    for (const auto& record : packet.records) {
+      if (record.servo >= commands_.size()) continue;
+      commands_[record.servo] = record.frame;
+      pending_[record.servo] = true;
+    }
+  }
+}
+
+BridgeClient::BridgeClient(const string& host, int port)
+    : buffer_(kMaxDatagram) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo* result = nullptr;
+  if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) !=
+      0) {
+    throw std::runtime_error("BridgeClient: unable to resolve " + host);
+  }
+  for (auto* info = result; info != nullptr; info = info->ai_next) {
+    fd_ = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd_ < 0) continue;
+    if (connect(fd_, info->ai_addr, info->ai_addrlen) == 0) break;
+    close(fd_);
+    fd_ = -1;
+  }
+  freeaddrinfo(result);
+  if (fd_ < 0) {
+    throw std::runtime_error("BridgeClient: unable to reach " + host);
+  }
+  command_.type = BridgePacket::kCommand;
+}
+
+BridgeClient::~BridgeClient() { close(fd_); }
+
+void BridgeClient::SendCommands(const vector<BridgeRecord>& records) {
+  command_.records = records;
+  command_.timestamp_ns = NowNs();
+  const size_t size =
+      EncodeBridgePacket(command_, buffer_.data(), buffer_.size());
+  if (size == 0) throw std::runtime_error("BridgeClient: packet too large");
+  command_.sequence++;
+  // a refused send only means the server is not up yet
+  send(fd_, buffer_.data(), size, 0);
+}
+
+bool BridgeClient::ReceiveState(BridgePacket* packet, int timeout_us) {
+  const int64_t deadline_ns = NowNs() + timeout_us * 1000ll;
+  while (true) {
+    const int64_t remaining_ns = deadline_ns - NowNs();
+    if (remaining_ns < 0) return false;
+    const int timeout_ms = static_cast<int>((remaining_ns + 999999) / 1000000);
+    if (!WaitReadable(fd_, timeout_ms)) return false;
+    const ssize_t size = recv(fd_, buffer_.data(), buffer_.size(), 0);
+    if (size <= 0) continue;
+    if (!DecodeBridgePacket(buffer_.data(), size, packet) ||
+        packet->type != BridgePacket::kState) {
+      continue;
+    }
+    if (have_sequence_) {
+      if (!Newer(packet->sequence, sequence_)) continue;
+      lost_ += packet->sequence - sequence_ - 1;
+    }
+    have_sequence_ = true;
+    sequence_ = packet->sequence;
+    return true;
+  }
+}
@@ -0,0 +1,169 @@
+// Copyright 2021 Sina Aghli, sinaaghli.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MOTEUSUDPBRIDGE_H__
+#define MOTEUSUDPBRIDGE_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MoteusGroup.h"
+#include "moteus_protocol.h"
+
+using namespace std;
+
+// One servo's multiplex payload, a reply in state packets and a command
+// frame in command packets.
+struct BridgeRecord {
+  uint16_t servo = 0;
+  mjbots::moteus::CanFrame frame;
+};
+
+// A datagram is a 16 byte header followed by the records, little endian:
+//
+//   char magic[2] = "MB"
+//   uint8_t version = 1
+//   uint8_t type
+//   uint32_t sequence
+//   int64_t timestamp_ns
+//   { uint16_t servo; uint8_t size; uint8_t data[size]; } records[]
+//
+// The payloads are the bytes exchanged with the servos, so neither side
+// re-encodes them. Servos are topology indices.
+struct BridgePacket {
+  enum Type : uint8_t { kState = 1, kCommand = 2 };
+
+  Type type = kState;
+  // counts up by one per packet from the same sender
+  uint32_t sequence = 0;
+  // NowNs() of the sender
+  int64_t timestamp_ns = 0;
+  vector<BridgeRecord> records;
+};
+
+// Returns the datagram size, 0 if the packet does not fit |size|.
+size_t EncodeBridgePacket(const BridgePacket& packet, uint8_t* buffer,
+                          size_t size);
+// Returns false for anything that is not a well formed packet.
+bool DecodeBridgePacket(const uint8_t* buffer, size_t size,
+                        BridgePacket* packet);
+
+// The robot side. Publish() and Apply() are called from the control loop
+// and only copy frames under a lock, the sockets are served by two
+// threads of the bridge. The server listens on |address| only, e.g.
+// "127.0.0.1", or "::" for every interface. The first client to send a
+// command packet, even without records, becomes the peer the state
+// snapshots go to; packets from other addresses are refused until it
+// has been silent for |command_timeout_s|.
+//
+// Commands are snapshots too: the latest frame per servo wins and lost
+// or reordered packets are simply skipped. The frames are decoded and
+// latched with MoteusGroup's Set*Command(), so the servos' limits apply;
+// frames writing anything but a stop, position or stay within command
+// are rejected. If no command packet arrived for |command_timeout_s|,
+// the servos commanded over the bridge are stopped.
+class BridgeServer {
+ public:
+  BridgeServer(MoteusGroup& group, const string& address, int port,
+               double command_timeout_s = 0.1);
+  ~BridgeServer();
+
+  BridgeServer(const BridgeServer&) = delete;
+  BridgeServer& operator=(const BridgeServer&) = delete;
+
+  // Queues the replies of the last Cycle(). A snapshot still unsent is
+  // replaced and counted in dropped().
+  void Publish();
+  // Latches the commands received since the last call into the group.
+  // Returns how many servos got a new frame.
+  size_t Apply();
+
+  // command packets missing from the sequence
+  uint64_t lost() const { return lost_; }
+  // snapshots replaced before the sender got to them
+  uint64_t dropped() const { return dropped_; }
+  // command packets from other addresses than the peer's
+  uint64_t refused() const { return refused_; }
+  // command frames that were not a stop, position or within command
+  uint64_t rejected() const { return rejected_; }
+
+ private:
+  void SendLoop();
+  void ReceiveLoop();
+
+  MoteusGroup& group_;
+  const int64_t command_timeout_ns_;
+  int fd_ = -1;
+
+  mutable mutex mutex_;
+  condition_variable ready_;
+  atomic<bool> done_{false};
+  // filled by Publish(), swapped out by the sender
+  BridgePacket snapshot_;
+  bool fresh_ = false;
+  uint32_t state_sequence_ = 0;
+  // peer address, sockaddr_storage sized
+  uint8_t peer_[128] = {};
+  uint32_t peer_size_ = 0;
+  // per servo, filled by the receiver
+  vector<mjbots::moteus::CanFrame> commands_;
+  vector<bool> pending_;
+  bool have_sequence_ = false;
+  uint32_t command_sequence_ = 0;
+  int64_t command_ns_ = 0;
+  // servos currently driven over the bridge, control thread only
+  vector<bool> remote_;
+  atomic<uint64_t> lost_{0};
+  atomic<uint64_t> dropped_{0};
+  atomic<uint64_t> refused_{0};
+  atomic<uint64_t> rejected_{0};
+
+  thread sender_;
+  thread receiver_;
+};
+
+// The operator side of a BridgeServer. Not thread safe.
+class BridgeClient {
+ public:
+  BridgeClient(const string& host, int port);
+  ~BridgeClient();
+
+  BridgeClient(const BridgeClient&) = delete;
+  BridgeClient& operator=(const BridgeClient&) = delete;
+
+  // Sends one command packet. The frames are best built with the layouts
+  // of the same topology, e.g. EncodePositionCommand(); the server only
+  // keeps their commands.
+  void SendCommands(const vector<BridgeRecord>& records);
+  // Waits up to |timeout_us| for a state packet newer than the last one.
+  bool ReceiveState(BridgePacket* packet, int timeout_us);
+
+  // state packets missing from the sequence
+  uint64_t lost() const { return lost_; }
+
+ private:
+  int fd_ = -1;
+  BridgePacket command_;
+  vector<uint8_t> buffer_;
+  bool have_sequence_ = false;
+  uint32_t sequence_ = 0;
+  uint64_t lost_ = 0;
+};
+
+#endif  // MOTEUSUDPBRIDGE_H__
@@ -20,6 +20,8 @@
 #include <cstdlib>
 #include <cstring>
 #include <limits>
+#include <stdexcept>
+#include <tuple>
 
 /// @file
 ///
@@ -637,7 +639,8 @@ struct WithinResolution {
   Resolution kp_scale = Resolution::kFloat;
   Resolution kd_scale = Resolution::kFloat;
   Resolution maximum_torque = Resolution::kFloat;
-  Resolution stop_position = Resolution::kFloat;
+  // unused, stay within mode has no stop position register
+  Resolution stop_position = Resolution::kIgnore;
   Resolution watchdog_timeout = Resolution::kFloat;
 };
 
@@ -656,8 +659,9 @@ inline void EmitWithinCommand(WriteCanFrame *frame,
   frame->Write<int8_t>(Mode::kStayWithinBounds);
 
   // Now we use some heuristics to try and group consecutive registers
-  // of the same resolution together into larger writes.
-  WriteCombiner<8> combiner(frame, 0x00, Register::kStayWithinLower,
+  // of the same resolution together into larger writes.  The stay
+  // within registers end with the timeout, there is no stop position.
+  WriteCombiner<7> combiner(frame, 0x00, Register::kStayWithinLower,
                             {
                                 resolution.bounds_min,
                                 resolution.bounds_max,
@@ -665,15 +669,14 @@ inline void EmitWithinCommand(WriteCanFrame *frame,
                                 resolution.kp_scale,
                                 resolution.kd_scale,
                                 resolution.maximum_torque,
-                                resolution.stop_position,
                                 resolution.watchdog_timeout,
                             });
 
   if (combiner.MaybeWrite()) {
-    frame->WriteTime(command.bounds_min, resolution.bounds_min);
+    frame->WritePosition(command.bounds_min, resolution.bounds_min);
   }
   if (combiner.MaybeWrite()) {
-    frame->WriteTime(command.bounds_max, resolution.bounds_max);
+    frame->WritePosition(command.bounds_max, resolution.bounds_max);
   }
   if (combiner.MaybeWrite()) {
     frame->WriteTorque(command.feedforward_torque,
@@ -688,9 +691,6 @@ inline void EmitWithinCommand(WriteCanFrame *frame,
   if (combiner.MaybeWrite()) {
     frame->WriteTorque(command.maximum_torque, resolution.maximum_torque);
   }
-  if (combiner.MaybeWrite()) {
-    frame->WritePosition(command.stop_position, resolution.stop_position);
-  }
   if (combiner.MaybeWrite()) {
     frame->WriteTime(command.watchdog_timeout, resolution.watchdog_timeout);
   }
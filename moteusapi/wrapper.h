@@ -1,5 +1,3 @@
-
-
 #ifndef MOTEUSWRAPPER_H__
 #define MOTEUSWRAPPER_H__
 
@@ -15,14 +13,15 @@ class MoteusWrapper {
  public:
   vector<MoteusAPI> drivers;
   MoteusWrapper(vector<string> dev_name, vector<int> moteus_id) {
-    assert((dev_name.size() != moteus_id.size()) &&
+    assert((dev_name.size() == moteus_id.size()) &&
            "Length of dev_name and moteus_id vector does not match");
-    for (int i = 0; i < dev_name.size(); i++) {
-      MoteusAPI api(dev_name[i], moteus_id[i]);
-      drivers.push_back(api);
+    // handles on the same device share one transport
+    drivers.reserve(dev_name.size());
+    for (size_t i = 0; i < dev_name.size(); i++) {
+      drivers.emplace_back(dev_name[i], moteus_id[i]);
     };
   };
-  ~MoteusWrapper();
+  ~MoteusWrapper() {}
 };
 
-#endif
\ No newline at end of file
+#endif